@@ -0,0 +1,345 @@
+// Dirty tile tracking for incremental rendering (--incremental).
+//
+// Between two frames the satelites move a few pixels, and most of the
+// frame changes by far less than the error check allows. markDirtyTiles()
+// compares the satelite positions of the last and the current frame and
+// lists the tiles whose cached pixels may be wrong, so the graphics engine
+// re-shades only those. A tile is dirty when
+//
+//  - a satelite disk touches it in either frame (white hit pixels),
+//  - more than one satelite can be the nearest one somewhere in the tile
+//    in either frame, or the nearest one changed (the base color),
+//  - or the weighted color may have moved by more than the tolerance.
+//
+// For the last point, with weights w = 1 / d^4, W their sum and m the
+// weighted mean of the colors c at a pixel, moving the satelites changes
+// the mean by
+//
+//    m' - m = sum_j (w'_j - w_j) (c_j - m) / W'.
+//
+// Per tile, |w'_j - w_j| / W' is bounded from the smallest and largest
+// distances of the satelites to the tile and how far they moved, and
+// |c_j - m| from the range of m over the tile, which the cached pixels
+// give back since the base color is known. These bounds are added up per
+// tile over the frames since it was last shaded, so a clean tile is never
+// off by more than the tolerance in total. Every refreshInterval frames
+// all tiles are shaded again.
+
+#ifndef COMMON_DIRTY_TILES_H
+#define COMMON_DIRTY_TILES_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "render_state.h"
+#include "tile_scheduler.h"
+
+// Slack in pixels for the distance tests, the shaders work in float
+#define DIRTY_TILES_DISTANCE_SLACK 1e-2
+
+#define DIRTY_TILES_DEFAULT_TOLERANCE 0.02
+
+typedef struct{
+   float *previousX;        // Satelite positions of the last frame
+   float *previousY;
+   double *moved;           // How far each satelite moved since then
+   double *errorBound;      // Per tile, accumulated since it was shaded
+   int *dirtyList;          // Tiles to shade this frame
+   int dirtyCount;
+   unsigned char *dirty;    // Per tile verdict of the parallel test
+   int framesSinceRefresh;
+   int refreshInterval;     // Full frame every this many frames
+   double tolerance;        // Allowed error of a clean pixel
+   int valid;               // Whether the frame buffer holds a frame
+   long long shadedTiles;   // Totals for the summary
+   long long totalTiles;
+} dirtyTiles;
+
+static inline void initDirtyTiles(dirtyTiles *d, int sateliteCount,
+                                  int tileCount, int refreshInterval,
+                                  double tolerance){
+   d->previousX = allocateRenderArray(sateliteCount);
+   d->previousY = allocateRenderArray(sateliteCount);
+   d->moved = (double*)malloc(sizeof(double) * sateliteCount);
+   d->errorBound = (double*)calloc(tileCount, sizeof(double));
+   d->dirtyList = (int*)malloc(sizeof(int) * tileCount);
+   d->dirty = (unsigned char*)malloc(tileCount);
+   if(d->moved == NULL || d->errorBound == NULL || d->dirtyList == NULL ||
+      d->dirty == NULL){
+      fprintf(stderr, "Failed to allocate dirty tiles\n");
+      exit(EXIT_FAILURE);
+   }
+   d->dirtyCount = 0;
+   d->framesSinceRefresh = 0;
+   d->refreshInterval = refreshInterval;
+   d->tolerance = tolerance;
+   d->valid = 0;
+   d->shadedTiles = 0;
+   d->totalTiles = 0;
+}
+
+static inline void freeDirtyTiles(dirtyTiles *d){
+   free(d->previousX);
+   free(d->previousY);
+   free(d->moved);
+   free(d->errorBound);
+   free(d->dirtyList);
+   free(d->dirty);
+}
+
+// Squared smallest and largest distance from (x, y) to the pixel centers
+// of the rectangle [x0, x1] x [y0, y1]
+static inline void rectangleDistances2(double x, double y, double x0,
+                                       double y0, double x1, double y1,
+                                       double *nearest2, double *farthest2){
+   double dx = x < x0 ? x0 - x : (x > x1 ? x - x1 : 0.0);
+   double dy = y < y0 ? y0 - y : (y > y1 ? y - y1 : 0.0);
+   double fx = fmax(fabs(x - x0), fabs(x - x1));
+   double fy = fmax(fabs(y - y0), fabs(y - y1));
+   *nearest2 = dx * dx + dy * dy;
+   *farthest2 = fx * fx + fy * fy;
+}
+
+// Index of the only satelite that can be the nearest one in the
+// rectangle, or -1 when there are several candidates. The pixels closer to
+// a satelite j than to another k form a half-plane, so j is nearest in the
+// whole rectangle when it is nearer than every k at all four corners.
+static inline int soleNearestSatelite(const float *x, const float *y,
+                                      int count, double x0, double y0,
+                                      double x1, double y1){
+   const double cornerX[4] = {x0, x1, x0, x1};
+   const double cornerY[4] = {y0, y0, y1, y1};
+   double centerX = 0.5 * (x0 + x1), centerY = 0.5 * (y0 + y1);
+   double bestDistance2 = INFINITY;
+   int best = -1;
+   for(int j = 0; j < count; ++j){
+      double dx = x[j] - centerX, dy = y[j] - centerY;
+      if(dx * dx + dy * dy < bestDistance2){
+         bestDistance2 = dx * dx + dy * dy;
+         best = j;
+      }
+   }
+   double limit2[4];
+   for(int c = 0; c < 4; ++c){
+      double dx = x[best] - cornerX[c], dy = y[best] - cornerY[c];
+      double limit = sqrt(dx * dx + dy * dy) + DIRTY_TILES_DISTANCE_SLACK;
+      limit2[c] = limit * limit;
+   }
+   for(int j = 0; j < count; ++j){
+      if(j == best){
+         continue;
+      }
+      for(int c = 0; c < 4; ++c){
+         double dx = x[j] - cornerX[c], dy = y[j] - cornerY[c];
+         if(dx * dx + dy * dy <= limit2[c]){
+            return -1;
+         }
+      }
+   }
+   return best;
+}
+
+// Range [low, high] per channel of the weighted mean over the cached
+// pixels of a tile whose base color is nearest. Exactly one of pixels and
+// pixelsRGBA8 is the frame buffer.
+static inline void cachedMeanRange(const float *pixels,
+                                   const unsigned char *pixelsRGBA8,
+                                   int width, int x0, int y0, int x1,
+                                   int y1, const float nearest[3],
+                                   double low[3], double high[3]){
+   if(pixels != NULL){
+      float minimum[3] = {INFINITY, INFINITY, INFINITY};
+      float maximum[3] = {-INFINITY, -INFINITY, -INFINITY};
+      for(int row = y0; row < y1; ++row){
+         const float *pixel = &pixels[3 * ((size_t)row * width + x0)];
+         for(int column = x0; column < x1; ++column, pixel += 3){
+            for(int c = 0; c < 3; ++c){
+               minimum[c] = pixel[c] < minimum[c] ? pixel[c] : minimum[c];
+               maximum[c] = pixel[c] > maximum[c] ? pixel[c] : maximum[c];
+            }
+         }
+      }
+      for(int c = 0; c < 3; ++c){
+         low[c] = ((double)minimum[c] - nearest[c]) / 3.0;
+         high[c] = ((double)maximum[c] - nearest[c]) / 3.0;
+      }
+   } else {
+      int minimum[3] = {255, 255, 255};
+      int maximum[3] = {0, 0, 0};
+      for(int row = y0; row < y1; ++row){
+         const unsigned char *pixel =
+            &pixelsRGBA8[4 * ((size_t)row * width + x0)];
+         for(int column = x0; column < x1; ++column, pixel += 4){
+            for(int c = 0; c < 3; ++c){
+               minimum[c] = pixel[c] < minimum[c] ? pixel[c] : minimum[c];
+               maximum[c] = pixel[c] > maximum[c] ? pixel[c] : maximum[c];
+            }
+         }
+      }
+      // The values before quantization, which clamps at 0 and 1
+      for(int c = 0; c < 3; ++c){
+         low[c] = minimum[c] == 0 ? -INFINITY :
+            ((minimum[c] - 0.5) / 255.0 - nearest[c]) / 3.0;
+         high[c] = maximum[c] == 255 ? INFINITY :
+            ((maximum[c] + 0.5) / 255.0 - nearest[c]) / 3.0;
+      }
+   }
+}
+
+// Decides whether tile needs shading for the move from the previous
+// positions to s, and updates its error bound. colorLow and colorHigh
+// bound the satelite colors per channel.
+static inline int tileIsDirty(dirtyTiles *d, const tileScheduler *tiles,
+                              const renderSatelites *s, float radius,
+                              const double colorLow[3],
+                              const double colorHigh[3], const float *pixels,
+                              const unsigned char *pixelsRGBA8, int tile,
+                              int width, int height){
+   int px0, py0, px1, py1;
+   tileBounds(tiles, tile, width, height, &px0, &py0, &px1, &py1);
+   double x0 = px0, y0 = py0, x1 = px1 - 1, y1 = py1 - 1;
+
+   int nearestIndex = soleNearestSatelite(d->previousX, d->previousY,
+                                          s->count, x0, y0, x1, y1);
+   if(nearestIndex < 0 ||
+      nearestIndex != soleNearestSatelite(s->x, s->y, s->count,
+                                          x0, y0, x1, y1)){
+      return 1;
+   }
+
+   // Lower bounds of the weight sums, from the farthest corners
+   const double radius2 = (radius + DIRTY_TILES_DISTANCE_SLACK) *
+                          (radius + DIRTY_TILES_DISTANCE_SLACK);
+   double weights = 0.0, weightsNow = 0.0;
+   for(int j = 0; j < s->count; ++j){
+      double nearestBefore2, farthestBefore2, nearestNow2, farthestNow2;
+      rectangleDistances2(d->previousX[j], d->previousY[j], x0, y0, x1, y1,
+                          &nearestBefore2, &farthestBefore2);
+      rectangleDistances2(s->x[j], s->y[j], x0, y0, x1, y1,
+                          &nearestNow2, &farthestNow2);
+      if(fmin(nearestBefore2, nearestNow2) < radius2){
+         return 1;
+      }
+      double farthest2 = fmax(farthestBefore2, farthestNow2);
+      weights += 1.0 / (farthest2 * farthest2);
+      weightsNow += 1.0 / (farthestNow2 * farthestNow2);
+   }
+
+   // The mean of the last frame is within the accumulated bound of the
+   // cached one, and always within the satelite colors
+   const float nearestColor[3] = {s->red[nearestIndex],
+                                  s->green[nearestIndex],
+                                  s->blue[nearestIndex]};
+   double meanLow[3], meanHigh[3];
+   cachedMeanRange(pixels, pixelsRGBA8, width, px0, py0, px1, py1,
+                   nearestColor, meanLow, meanHigh);
+   for(int c = 0; c < 3; ++c){
+      meanLow[c] = fmax(meanLow[c] - d->errorBound[tile] / 3.0, colorLow[c]);
+      meanHigh[c] = fmin(meanHigh[c] + d->errorBound[tile] / 3.0,
+                         colorHigh[c]);
+   }
+
+   const float *channels[3] = {s->red, s->green, s->blue};
+   double change[3] = {0.0, 0.0, 0.0};
+   for(int j = 0; j < s->count; ++j){
+      double nearestBefore2, farthestBefore2, nearestNow2, farthestNow2;
+      rectangleDistances2(d->previousX[j], d->previousY[j], x0, y0, x1, y1,
+                          &nearestBefore2, &farthestBefore2);
+      rectangleDistances2(s->x[j], s->y[j], x0, y0, x1, y1,
+                          &nearestNow2, &farthestNow2);
+      double moved = d->moved[j];
+
+      // |w'_j - w_j| / W', once from the absolute change of w_j over the
+      // tile and once relative to w'_j, whose share of W' is at most 1
+      double nearest2 = fmin(nearestBefore2, nearestNow2);
+      double reach = sqrt(nearest2) + moved;
+      double reach2 = reach * reach;
+      double share = (1.0 / (nearest2 * nearest2) -
+                      1.0 / (reach2 * reach2)) / weights;
+      double nearestNow = sqrt(nearestNow2);
+      if(nearestNow > moved){
+         double ratio = nearestNow / (nearestNow - moved);
+         double shareNow = 1.0 / (nearestNow2 * nearestNow2) / weightsNow;
+         share = fmin(share, fmin(1.0, shareNow) *
+                             (ratio * ratio * ratio * ratio - 1.0));
+      }
+
+      for(int c = 0; c < 3; ++c){
+         change[c] += share * fmax(fabs(channels[c][j] - meanLow[c]),
+                                   fabs(channels[c][j] - meanHigh[c]));
+      }
+   }
+
+   // The shaders add the weighted color three times
+   d->errorBound[tile] += 3.0 * fmax(change[0], fmax(change[1], change[2]));
+   return d->errorBound[tile] > d->tolerance;
+}
+
+// Lists the tiles to shade for the satelites s in dirtyList and remembers
+// their positions for the next frame. Call once per frame before shading,
+// with the frame buffer of the last frame in pixels (interleaved float RGB)
+// or pixelsRGBA8.
+static inline void markDirtyTiles(dirtyTiles *d, const tileScheduler *tiles,
+                                  const renderSatelites *s, float radius,
+                                  const float *pixels,
+                                  const unsigned char *pixelsRGBA8,
+                                  int width, int height){
+
+   int refresh = !d->valid || d->refreshInterval <= 1 ||
+                 d->framesSinceRefresh + 1 >= d->refreshInterval;
+   d->dirtyCount = 0;
+
+   if(refresh){
+      for(int tile = 0; tile < tiles->tileCount; ++tile){
+         d->dirtyList[tile] = tile;
+      }
+      d->dirtyCount = tiles->tileCount;
+      d->framesSinceRefresh = 0;
+   } else {
+      for(int j = 0; j < s->count; ++j){
+         double dx = (double)s->x[j] - d->previousX[j];
+         double dy = (double)s->y[j] - d->previousY[j];
+         d->moved[j] = sqrt(dx * dx + dy * dy);
+      }
+
+      // Satelite colors per channel
+      double colorLow[3], colorHigh[3];
+      const float *channels[3] = {s->red, s->green, s->blue};
+      for(int c = 0; c < 3; ++c){
+         colorLow[c] = INFINITY;
+         colorHigh[c] = -INFINITY;
+         for(int j = 0; j < s->count; ++j){
+            colorLow[c] = fmin(colorLow[c], channels[c][j]);
+            colorHigh[c] = fmax(colorHigh[c], channels[c][j]);
+         }
+      }
+
+      #pragma omp parallel for schedule(dynamic, 16)
+      for(int tile = 0; tile < tiles->tileCount; ++tile){
+         d->dirty[tile] = (unsigned char)tileIsDirty(d, tiles, s, radius,
+                                                     colorLow, colorHigh,
+                                                     pixels, pixelsRGBA8,
+                                                     tile, width, height);
+      }
+      for(int tile = 0; tile < tiles->tileCount; ++tile){
+         if(d->dirty[tile]){
+            d->dirtyList[d->dirtyCount++] = tile;
+         }
+      }
+      ++d->framesSinceRefresh;
+   }
+
+   for(int i = 0; i < d->dirtyCount; ++i){
+      d->errorBound[d->dirtyList[i]] = 0.0;
+   }
+   for(int j = 0; j < s->count; ++j){
+      d->previousX[j] = s->x[j];
+      d->previousY[j] = s->y[j];
+   }
+   d->valid = 1;
+   d->shadedTiles += d->dirtyCount;
+   d->totalTiles += tiles->tileCount;
+}
+
+#endif // COMMON_DIRTY_TILES_H
@@ -0,0 +1,332 @@
+// Per-frame timing statistics shared by all backends.
+//
+// compute() records the physics, graphics and total time of every frame
+// after the first STATS_SKIPPED_FRAMES. At the end of a headless run the
+// minimum, median, 95th and 99th percentile and mean of each phase are
+// written in microseconds as JSON (--stats-json FILE) and/or CSV
+// (--stats-csv FILE); "-" writes to stdout. tools/benchmark.sh runs every
+// backend with the same seed and collects these files.
+//
+// Backends that step the next frame's physics while rendering also record
+// that time with recordPipelinedPhysics(). It is already part of the
+// graphics time and is written as its own pipelined_physics phase.
+//
+// With --perf-counters, perfRecordStats() (perf_counters.h) hands over
+// the IPC, cache and branch miss rates, busy CPUs and nominal GFLOP/s of
+// the physics and graphics phases over the whole run. They are written as
+// a "counters" object in JSON and as extra columns of the phase rows in
+// CSV, which are empty without counters.
+
+#ifndef COMMON_FRAME_STATS_H
+#define COMMON_FRAME_STATS_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+// The first frames also run the sequential reference engines for the
+// error check and would distort the statistics
+#define STATS_SKIPPED_FRAMES 2
+
+// Hardware counter metrics of a phase, NAN where a counter is missing
+typedef struct{
+   double ipc;
+   double cacheMissPercent;
+   double branchMissPercent;
+   double cpusBusy;
+   double gflops;
+} counterMetrics;
+
+enum{
+   STATS_COUNTERS_PHYSICS,
+   STATS_COUNTERS_GRAPHICS,
+   STATS_COUNTERS_COUNT
+};
+
+typedef struct{
+   long long *physics;      // Nanoseconds per recorded frame
+   long long *graphics;
+   long long *total;
+   unsigned int count;
+   unsigned int capacity;
+   long long *pipelinedPhysics;  // Overlapped with graphics, if any
+   unsigned int pipelinedCount;
+   unsigned int pipelinedCapacity;
+   int hasCounters;               // Whether counters holds metrics
+   counterMetrics counters[STATS_COUNTERS_COUNT];
+} frameStats;
+
+// Summary of one phase in microseconds
+typedef struct{
+   double min;
+   double median;
+   double p95;
+   double p99;
+   double mean;
+} phaseSummary;
+
+static inline void initFrameStats(frameStats *stats){
+   stats->physics = NULL;
+   stats->graphics = NULL;
+   stats->total = NULL;
+   stats->count = 0;
+   stats->capacity = 0;
+   stats->pipelinedPhysics = NULL;
+   stats->pipelinedCount = 0;
+   stats->pipelinedCapacity = 0;
+   stats->hasCounters = 0;
+}
+
+static inline void freeFrameStats(frameStats *stats){
+   free(stats->physics);
+   free(stats->graphics);
+   free(stats->total);
+   free(stats->pipelinedPhysics);
+   initFrameStats(stats);
+}
+
+static inline void recordFrame(frameStats *stats, long long physics,
+                               long long graphics, long long total){
+   if(stats->count == stats->capacity){
+      unsigned int capacity = stats->capacity ? stats->capacity * 2 : 256;
+      stats->physics = (long long*)realloc(stats->physics,
+                                           sizeof(long long) * capacity);
+      stats->graphics = (long long*)realloc(stats->graphics,
+                                            sizeof(long long) * capacity);
+      stats->total = (long long*)realloc(stats->total,
+                                         sizeof(long long) * capacity);
+      if(!stats->physics || !stats->graphics || !stats->total){
+         fprintf(stderr, "Failed to grow frame statistics\n");
+         exit(EXIT_FAILURE);
+      }
+      stats->capacity = capacity;
+   }
+   stats->physics[stats->count] = physics;
+   stats->graphics[stats->count] = graphics;
+   stats->total[stats->count] = total;
+   ++stats->count;
+}
+
+static inline void recordPipelinedPhysics(frameStats *stats,
+                                          long long physics){
+   if(stats->pipelinedCount == stats->pipelinedCapacity){
+      unsigned int capacity = stats->pipelinedCapacity ?
+                              stats->pipelinedCapacity * 2 : 256;
+      stats->pipelinedPhysics = (long long*)realloc(stats->pipelinedPhysics,
+                                                    sizeof(long long) *
+                                                    capacity);
+      if(!stats->pipelinedPhysics){
+         fprintf(stderr, "Failed to grow frame statistics\n");
+         exit(EXIT_FAILURE);
+      }
+      stats->pipelinedCapacity = capacity;
+   }
+   stats->pipelinedPhysics[stats->pipelinedCount++] = physics;
+}
+
+static int compareNanoseconds(const void *a, const void *b){
+   long long x = *(const long long*)a;
+   long long y = *(const long long*)b;
+   return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static inline double percentileMicroseconds(const long long *sorted,
+                                            unsigned int count, int percent){
+   unsigned int rank = (unsigned int)(((unsigned long long)count * percent +
+                                       99) / 100);
+   return sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+static inline phaseSummary summarizePhase(const long long *values,
+                                          unsigned int count){
+   phaseSummary summary = {0.0, 0.0, 0.0, 0.0, 0.0};
+   if(count == 0){
+      return summary;
+   }
+
+   long long *sorted = (long long*)malloc(sizeof(long long) * count);
+   if(sorted == NULL){
+      fprintf(stderr, "Failed to allocate frame statistics\n");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(sorted, values, sizeof(long long) * count);
+   qsort(sorted, count, sizeof(long long), compareNanoseconds);
+
+   double sum = 0.0;
+   for(unsigned int i = 0; i < count; ++i){
+      sum += sorted[i];
+   }
+
+   summary.min = sorted[0] / 1000.0;
+   summary.median = (count % 2) ? sorted[count / 2] / 1000.0 :
+      (sorted[count / 2 - 1] + sorted[count / 2]) / 2000.0;
+   summary.p95 = percentileMicroseconds(sorted, count, 95);
+   summary.p99 = percentileMicroseconds(sorted, count, 99);
+   summary.mean = sum / count / 1000.0;
+   free(sorted);
+   return summary;
+}
+
+static inline void writePhaseJSON(FILE *out, const char *name,
+                                  phaseSummary s, int last){
+   fprintf(out,
+      "  \"%s\": {\"min\": %.3f, \"median\": %.3f, \"p95\": %.3f, "
+      "\"p99\": %.3f, \"mean\": %.3f}%s\n",
+      name, s.min, s.median, s.p95, s.p99, s.mean, last ? "" : ",");
+}
+
+// A number, or null for NAN
+static inline void writeNumberJSON(FILE *out, double value){
+   if(isnan(value)){
+      fprintf(out, "null");
+   } else {
+      fprintf(out, "%.3f", value);
+   }
+}
+
+static inline void writeCountersJSON(FILE *out, const frameStats *stats){
+   const char *names[STATS_COUNTERS_COUNT] = {"physics", "graphics"};
+
+   fprintf(out, "  \"counters\": {\n");
+   for(int phase = 0; phase < STATS_COUNTERS_COUNT; ++phase){
+      const counterMetrics *m = &stats->counters[phase];
+      fprintf(out, "    \"%s\": {\"ipc\": ", names[phase]);
+      writeNumberJSON(out, m->ipc);
+      fprintf(out, ", \"cache_miss_pct\": ");
+      writeNumberJSON(out, m->cacheMissPercent);
+      fprintf(out, ", \"branch_miss_pct\": ");
+      writeNumberJSON(out, m->branchMissPercent);
+      fprintf(out, ", \"cpus_busy\": ");
+      writeNumberJSON(out, m->cpusBusy);
+      fprintf(out, ", \"gflops\": ");
+      writeNumberJSON(out, m->gflops);
+      fprintf(out, "}%s\n", phase + 1 < STATS_COUNTERS_COUNT ? "," : "");
+   }
+   fprintf(out, "  }\n");
+}
+
+// threads <= 0 is written as null, for backends that do not decide it
+static inline void writeStatsJSON(FILE *out, const frameStats *stats,
+                                  const char *backend, int threads,
+                                  const simulationOptions *options){
+   fprintf(out, "{\n");
+   fprintf(out, "  \"backend\": \"%s\",\n", backend);
+   fprintf(out, "  \"seed\": %u,\n", options->seed);
+   fprintf(out, "  \"satellites\": %d,\n", options->sateliteCount);
+   fprintf(out, "  \"width\": %d,\n", options->windowWidth);
+   fprintf(out, "  \"height\": %d,\n", options->windowHeight);
+   fprintf(out, "  \"substeps\": %d,\n", options->physicsUpdatesPerFrame);
+   if(threads > 0){
+      fprintf(out, "  \"threads\": %d,\n", threads);
+   } else {
+      fprintf(out, "  \"threads\": null,\n");
+   }
+   fprintf(out, "  \"frames\": %u,\n", stats->count);
+   writePhaseJSON(out, "physics_us",
+                  summarizePhase(stats->physics, stats->count), 0);
+   writePhaseJSON(out, "graphics_us",
+                  summarizePhase(stats->graphics, stats->count), 0);
+   int counters = stats->hasCounters;
+   writePhaseJSON(out, "frame_us",
+                  summarizePhase(stats->total, stats->count),
+                  stats->pipelinedCount == 0 && !counters);
+   if(stats->pipelinedCount > 0){
+      writePhaseJSON(out, "pipelined_physics_us",
+                     summarizePhase(stats->pipelinedPhysics,
+                                    stats->pipelinedCount), !counters);
+   }
+   if(counters){
+      writeCountersJSON(out, stats);
+   }
+   fprintf(out, "}\n");
+}
+
+// A column value, empty for NAN
+static inline void writeNumberCSV(FILE *out, double value){
+   if(isnan(value)){
+      fprintf(out, ",");
+   } else {
+      fprintf(out, ",%.3f", value);
+   }
+}
+
+// One header line and one line per phase
+static inline void writeStatsCSV(FILE *out, const frameStats *stats,
+                                 const char *backend, int threads,
+                                 const simulationOptions *options){
+   const char *names[4] = {"physics", "graphics", "frame",
+                           "pipelined_physics"};
+   const long long *values[4] = {stats->physics, stats->graphics,
+                                 stats->total, stats->pipelinedPhysics};
+   const unsigned int counts[4] = {stats->count, stats->count, stats->count,
+                                   stats->pipelinedCount};
+
+   fprintf(out, "backend,seed,satellites,width,height,substeps,threads,"
+                "frames,phase,min_us,median_us,p95_us,p99_us,mean_us,"
+                "ipc,cache_miss_pct,branch_miss_pct,cpus_busy,gflops\n");
+   for(int p = 0; p < 4; ++p){
+      // Only backends that pipeline record the last phase
+      if(p == 3 && counts[p] == 0){
+         continue;
+      }
+      phaseSummary s = summarizePhase(values[p], counts[p]);
+      fprintf(out, "%s,%u,%d,%d,%d,%d,%d,%u,%s,%.3f,%.3f,%.3f,%.3f,%.3f",
+              backend, options->seed, options->sateliteCount,
+              options->windowWidth, options->windowHeight,
+              options->physicsUpdatesPerFrame, threads > 0 ? threads : 0,
+              counts[p], names[p], s.min, s.median, s.p95, s.p99, s.mean);
+
+      // The first rows are the counter phases
+      counterMetrics m = {NAN, NAN, NAN, NAN, NAN};
+      if(p < STATS_COUNTERS_COUNT && stats->hasCounters){
+         m = stats->counters[p];
+      }
+      writeNumberCSV(out, m.ipc);
+      writeNumberCSV(out, m.cacheMissPercent);
+      writeNumberCSV(out, m.branchMissPercent);
+      writeNumberCSV(out, m.cpusBusy);
+      writeNumberCSV(out, m.gflops);
+      fprintf(out, "\n");
+   }
+}
+
+static inline FILE *openStatsFile(const char *path){
+   if(strcmp(path, "-") == 0){
+      return stdout;
+   }
+   FILE *out = fopen(path, "w");
+   if(out == NULL){
+      fprintf(stderr, "Failed to open %s for writing\n", path);
+   }
+   return out;
+}
+
+// Writes the files requested with --stats-json and --stats-csv
+static inline void writeFrameStats(const frameStats *stats,
+                                   const char *backend, int threads,
+                                   const simulationOptions *options){
+   if(options->statsJson != NULL){
+      FILE *out = openStatsFile(options->statsJson);
+      if(out != NULL){
+         writeStatsJSON(out, stats, backend, threads, options);
+         if(out != stdout){
+            fclose(out);
+         }
+      }
+   }
+   if(options->statsCsv != NULL){
+      FILE *out = openStatsFile(options->statsCsv);
+      if(out != NULL){
+         writeStatsCSV(out, stats, backend, threads, options);
+         if(out != stdout){
+            fclose(out);
+         }
+      }
+   }
+}
+
+#endif // COMMON_FRAME_STATS_H
@@ -0,0 +1,402 @@
+// Asynchronous frame output for headless runs.
+//
+// The compute thread converts each finished frame from float RGB to 8-bit
+// RGB (SIMD where available) into a free slot of a bounded ring and
+// returns; a writer thread drains the ring to disk or to an encoder
+// process. When every slot is still waiting for I/O the frame is dropped
+// and counted rather than stalling the frame loop, unless the writer was
+// opened with waitWhenFull.
+//
+// Output kinds, chosen by openFrameWriter():
+//
+//  - a path containing a printf pattern ("frames/%05d.ppm"): one binary
+//    PPM per frame. The pattern must have exactly one %d or %u conversion
+//    and may use %% for a literal %,
+//  - a path ending in .y4m: one YUV4MPEG2 stream (4:4:4, BT.601),
+//  - any other path: raw rgb24 frames back to back,
+//  - a shell command (command != 0): YUV4MPEG2 on its stdin, for example
+//    "ffmpeg -y -i - out.mp4".
+//
+// Frames are flipped vertically on the way out: row 0 of the pixel buffer
+// is the bottom of the window (glDrawPixels) but the top of an image.
+//
+// The including file must define _POSIX_C_SOURCE (200809L) for popen.
+
+#ifndef COMMON_FRAME_WRITER_H
+#define COMMON_FRAME_WRITER_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAME_WRITER_X86 1
+#include <immintrin.h>
+#endif
+
+#define FRAME_WRITER_DEFAULT_SLOTS 4
+
+#define FRAME_OUTPUT_PPM 0
+#define FRAME_OUTPUT_Y4M 1
+#define FRAME_OUTPUT_RAW 2
+
+// Converts count floats to bytes, clamped to [0, 1] and rounded to
+// nearest even like the vector conversion
+typedef void (*frameConvertFunction)(const float *in, unsigned char *out,
+                                     int count);
+
+typedef struct{
+   unsigned char *data;     // width * height * 3 bytes, top row first
+   unsigned int frame;
+} frameSlot;
+
+typedef struct{
+   frameSlot *slots;
+   int slotCount;
+   int head;                // Next slot to write out
+   int queued;              // Slots waiting for the writer
+   int closing;
+   int running;             // Writer thread started, closeFrameWriter() joins it
+   int waitWhenFull;
+   pthread_mutex_t lock;
+   pthread_cond_t notEmpty;
+   pthread_cond_t notFull;
+   pthread_t thread;
+
+   int kind;
+   int command;             // target is a shell command
+   const char *target;      // Path, pattern or command
+   FILE *stream;            // Y4M, raw and pipe output
+   int width;
+   int height;
+   unsigned char *yuv;      // Y4M planes of the writer thread
+   frameConvertFunction convert;
+
+   unsigned int written;
+   unsigned int dropped;
+   int failed;
+} frameWriter;
+
+static void convertFrameScalar(const float *in, unsigned char *out,
+                               int count){
+   for(int i = 0; i < count; ++i){
+      float value = in[i];
+      value = value < 0.f ? 0.f : (value > 1.f ? 1.f : value);
+      out[i] = (unsigned char)lrintf(value * 255.f);
+   }
+}
+
+#ifdef FRAME_WRITER_X86
+
+// 32 floats per iteration: clamp, scale, round to int32 and pack the
+// four vectors down to bytes. The packs work per 128-bit lane, the final
+// permute puts the dwords back in order.
+__attribute__((target("avx2")))
+static void convertFrameAVX2(const float *in, unsigned char *out, int count){
+
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.f);
+   const __m256 scale = _mm256_set1_ps(255.f);
+   const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+   int i = 0;
+
+   for(; i + 32 <= count; i += 32){
+      __m256i v[4];
+      for(int k = 0; k < 4; ++k){
+         __m256 value = _mm256_loadu_ps(in + i + 8 * k);
+         value = _mm256_min_ps(_mm256_max_ps(value, zero), one);
+         v[k] = _mm256_cvtps_epi32(_mm256_mul_ps(value, scale));
+      }
+      __m256i words0 = _mm256_packs_epi32(v[0], v[1]);
+      __m256i words1 = _mm256_packs_epi32(v[2], v[3]);
+      __m256i bytes = _mm256_packus_epi16(words0, words1);
+      bytes = _mm256_permutevar8x32_epi32(bytes, order);
+      _mm256_storeu_si256((__m256i*)(out + i), bytes);
+   }
+   convertFrameScalar(in + i, out + i, count - i);
+}
+
+#endif // FRAME_WRITER_X86
+
+static inline frameConvertFunction selectFrameConverter(void){
+#ifdef FRAME_WRITER_X86
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2")){
+      return convertFrameAVX2;
+   }
+#endif
+   return convertFrameScalar;
+}
+
+// BT.601 full range RGB to three 4:4:4 planes
+static inline void frameToYUV(const unsigned char *rgb, unsigned char *yuv,
+                              int pixels){
+   unsigned char *yPlane = yuv;
+   unsigned char *uPlane = yuv + pixels;
+   unsigned char *vPlane = yuv + 2 * pixels;
+   for(int i = 0; i < pixels; ++i){
+      int r = rgb[3 * i], g = rgb[3 * i + 1], b = rgb[3 * i + 2];
+      yPlane[i] = (unsigned char)((77 * r + 150 * g + 29 * b + 128) >> 8);
+      uPlane[i] = (unsigned char)((-43 * r - 85 * g + 128 * b + 32896) >> 8);
+      vPlane[i] = (unsigned char)((128 * r - 107 * g - 21 * b + 32896) >> 8);
+   }
+}
+
+// Writes one slot, called by the writer thread without the lock
+static int writeFrameSlot(frameWriter *w, const frameSlot *slot){
+
+   size_t bytes = (size_t)w->width * w->height * 3;
+
+   if(w->kind == FRAME_OUTPUT_PPM){
+      char path[4096];
+      snprintf(path, sizeof(path), w->target, slot->frame);
+      FILE *file = fopen(path, "wb");
+      if(file == NULL){
+         return 0;
+      }
+      fprintf(file, "P6\n%d %d\n255\n", w->width, w->height);
+      int ok = fwrite(slot->data, 1, bytes, file) == bytes;
+      return fclose(file) == 0 && ok;
+   }
+   if(w->kind == FRAME_OUTPUT_Y4M){
+      frameToYUV(slot->data, w->yuv, w->width * w->height);
+      fputs("FRAME\n", w->stream);
+      return fwrite(w->yuv, 1, bytes, w->stream) == bytes;
+   }
+   return fwrite(slot->data, 1, bytes, w->stream) == bytes;
+}
+
+static void *frameWriterThread(void *argument){
+
+   frameWriter *w = (frameWriter*)argument;
+
+   pthread_mutex_lock(&w->lock);
+   for(;;){
+      while(w->queued == 0 && !w->closing){
+         pthread_cond_wait(&w->notEmpty, &w->lock);
+      }
+      if(w->queued == 0){
+         break;
+      }
+      frameSlot *slot = &w->slots[w->head];
+      pthread_mutex_unlock(&w->lock);
+
+      int ok = !w->failed && writeFrameSlot(w, slot);
+
+      pthread_mutex_lock(&w->lock);
+      if(ok){
+         ++w->written;
+      } else if(!w->failed){
+         fprintf(stderr, "Frame output to %s failed, frames from %u on "
+                 "are not written\n", w->target, slot->frame);
+         w->failed = 1;
+      }
+      w->head = (w->head + 1) % w->slotCount;
+      --w->queued;
+      pthread_cond_signal(&w->notFull);
+   }
+   pthread_mutex_unlock(&w->lock);
+   return NULL;
+}
+
+// Checks that a PPM pattern has exactly one frame number conversion,
+// %d or %u with an optional 0 flag and width, and no other conversion
+// than %%, since it is used as the snprintf() format of the file names
+static inline int validFramePattern(const char *pattern){
+
+   int conversions = 0;
+   for(const char *p = pattern; *p != '\0'; ++p){
+      if(*p != '%'){
+         continue;
+      }
+      ++p;
+      if(*p == '%'){
+         continue;
+      }
+      if(*p == '0'){
+         ++p;
+      }
+      while(*p >= '0' && *p <= '9'){
+         ++p;
+      }
+      if(*p != 'd' && *p != 'u'){
+         return 0;
+      }
+      ++conversions;
+   }
+   return conversions == 1;
+}
+
+// Opens the output and starts the writer thread. Exits on failure.
+static inline void openFrameWriter(frameWriter *w, const char *target,
+                                   int command, int width, int height,
+                                   int slotCount, int waitWhenFull){
+
+   size_t bytes = (size_t)width * height * 3;
+   size_t length = strlen(target);
+
+   memset(w, 0, sizeof(*w));
+   w->target = target;
+   w->command = command;
+   w->width = width;
+   w->height = height;
+   w->slotCount = slotCount;
+   w->waitWhenFull = waitWhenFull;
+   w->convert = selectFrameConverter();
+
+   if(command || (length >= 4 && strcmp(target + length - 4, ".y4m") == 0)){
+      w->kind = FRAME_OUTPUT_Y4M;
+   } else if(strchr(target, '%') != NULL){
+      w->kind = FRAME_OUTPUT_PPM;
+      if(!validFramePattern(target)){
+         fprintf(stderr, "Invalid frame output pattern %s: it needs exactly "
+                 "one %%d or %%u (like %%05d) and %%%% for a literal %%\n",
+                 target);
+         exit(EXIT_FAILURE);
+      }
+   } else {
+      w->kind = FRAME_OUTPUT_RAW;
+   }
+
+   if(command){
+      w->stream = popen(target, "w");
+   } else if(w->kind != FRAME_OUTPUT_PPM){
+      w->stream = fopen(target, "wb");
+   }
+   if(w->kind != FRAME_OUTPUT_PPM && w->stream == NULL){
+      fprintf(stderr, "Cannot open frame output %s\n", target);
+      exit(EXIT_FAILURE);
+   }
+   if(w->kind == FRAME_OUTPUT_Y4M){
+      // 30 fps is only a playback rate for the container
+      fprintf(w->stream, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n",
+              width, height);
+      w->yuv = (unsigned char*)malloc(bytes);
+   }
+
+   w->slots = (frameSlot*)calloc(slotCount, sizeof(frameSlot));
+   for(int s = 0; s < slotCount; ++s){
+      w->slots[s].data = (unsigned char*)malloc(bytes);
+      if(w->slots[s].data == NULL){
+         fprintf(stderr, "Failed to allocate frame output buffers\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   pthread_mutex_init(&w->lock, NULL);
+   pthread_cond_init(&w->notEmpty, NULL);
+   pthread_cond_init(&w->notFull, NULL);
+   if(pthread_create(&w->thread, NULL, frameWriterThread, w) != 0){
+      fprintf(stderr, "Failed to start the frame writer thread\n");
+      exit(EXIT_FAILURE);
+   }
+   w->running = 1;
+}
+
+// Returns the slot to fill for the next frame, or NULL if the frame is
+// dropped because the ring is full
+static inline frameSlot *acquireFrameSlot(frameWriter *w){
+
+   frameSlot *slot = NULL;
+   pthread_mutex_lock(&w->lock);
+   while(w->queued == w->slotCount && w->waitWhenFull){
+      pthread_cond_wait(&w->notFull, &w->lock);
+   }
+   if(w->queued == w->slotCount){
+      ++w->dropped;
+   } else {
+      // Only the compute thread fills slots, so this one stays free
+      slot = &w->slots[(w->head + w->queued) % w->slotCount];
+   }
+   pthread_mutex_unlock(&w->lock);
+   return slot;
+}
+
+// Hands a filled slot to the writer thread
+static inline void queueFrameSlot(frameWriter *w, frameSlot *slot,
+                                  unsigned int frame){
+   slot->frame = frame;
+   pthread_mutex_lock(&w->lock);
+   ++w->queued;
+   pthread_cond_signal(&w->notEmpty);
+   pthread_mutex_unlock(&w->lock);
+}
+
+// Queues a frame of interleaved float RGB pixels, bottom row first.
+// Returns 0 if the frame was dropped because the ring was full.
+static inline int submitFrame(frameWriter *w, const float *pixels,
+                              unsigned int frame){
+
+   frameSlot *slot = acquireFrameSlot(w);
+   if(slot == NULL){
+      return 0;
+   }
+
+   int rowFloats = w->width * 3;
+   for(int row = 0; row < w->height; ++row){
+      w->convert(pixels + (size_t)row * rowFloats,
+                 slot->data + (size_t)(w->height - 1 - row) * rowFloats,
+                 rowFloats);
+   }
+   queueFrameSlot(w, slot, frame);
+   return 1;
+}
+
+// submitFrame() for an RGBA8 framebuffer (common/pixel_format.h), which
+// only needs the alpha dropped
+static inline int submitFrameRGBA8(frameWriter *w, const unsigned char *pixels,
+                                   unsigned int frame){
+
+   frameSlot *slot = acquireFrameSlot(w);
+   if(slot == NULL){
+      return 0;
+   }
+
+   for(int row = 0; row < w->height; ++row){
+      const unsigned char *in = pixels + (size_t)row * w->width * 4;
+      unsigned char *out = slot->data +
+         (size_t)(w->height - 1 - row) * w->width * 3;
+      for(int column = 0; column < w->width; ++column){
+         out[3 * column] = in[4 * column];
+         out[3 * column + 1] = in[4 * column + 1];
+         out[3 * column + 2] = in[4 * column + 2];
+      }
+   }
+   queueFrameSlot(w, slot, frame);
+   return 1;
+}
+
+// Writes the queued frames, stops the thread and closes the output
+static inline void closeFrameWriter(frameWriter *w){
+
+   // openFrameWriter() exited before the writer was up
+   if(!w->running){
+      return;
+   }
+   pthread_mutex_lock(&w->lock);
+   w->closing = 1;
+   pthread_cond_signal(&w->notEmpty);
+   pthread_mutex_unlock(&w->lock);
+   pthread_join(w->thread, NULL);
+
+   if(w->command){
+      pclose(w->stream);
+   } else if(w->stream != NULL){
+      fclose(w->stream);
+   }
+   printf("Frame output: %u frames written, %u dropped\n", w->written,
+          w->dropped);
+
+   for(int s = 0; s < w->slotCount; ++s){
+      free(w->slots[s].data);
+   }
+   free(w->slots);
+   free(w->yuv);
+   pthread_mutex_destroy(&w->lock);
+   pthread_cond_destroy(&w->notEmpty);
+   pthread_cond_destroy(&w->notFull);
+}
+
+#endif // COMMON_FRAME_WRITER_H
@@ -0,0 +1,219 @@
+// Alternative integrators for the satelite orbits.
+//
+// The only force is the black hole at (centerX, centerY), so every
+// satelite follows a Kepler orbit. Two cheaper alternatives to the
+// 100000 symplectic Euler steps per frame of the reference engine:
+//
+//  - Yoshida: fourth order symplectic composition of three leapfrog steps,
+//    p->updates steps per frame with three force evaluations each.
+//  - Kepler: analytic propagation with universal variables, exact up to
+//    the Newton tolerance whatever the orbit type, in one step per frame.
+//
+// Both integrate the same equations as the reference, but the results are
+// not bit-identical to it. Since the reference is itself only first order,
+// the difference is a discretisation error, mostly of the Euler reference;
+// comparePhysicsStates() measures it.
+//
+// Both have the signature of a physicsKernelFunction and can be used as a
+// physicsKernel of width 1.
+
+#ifndef COMMON_INTEGRATORS_H
+#define COMMON_INTEGRATORS_H
+
+#include <math.h>
+
+#include "physics_simd.h"
+
+// Yoshida coefficients, w1 = 1 / (2 - 2^(1/3)) and w0 = 1 - 2 w1
+#define YOSHIDA_W1 1.3512071919596576
+#define YOSHIDA_W0 (-1.7024143839193153)
+
+// Newton iterations of the Kepler solver before falling back to Yoshida
+#define KEPLER_MAX_ITERATIONS 64
+// Steps per frame of that fallback
+#define KEPLER_FALLBACK_STEPS 4096
+
+static inline void gravityAcceleration(double px, double py,
+                                       const physicsParameters *p,
+                                       double *ax, double *ay){
+   double dx = px - p->centerX;
+   double dy = py - p->centerY;
+   double distSquared = dx * dx + dy * dy;
+   double dist = sqrt(distSquared);
+   double scale = p->gravity / (distSquared * dist);
+   *ax = -dx * scale;
+   *ay = -dy * scale;
+}
+
+// Fourth order Yoshida integration, p->updates steps per frame
+static void stepSatelitesYoshida(physicsState *state, int begin, int end,
+                                 const physicsParameters *p){
+
+   const double h = p->deltaTime / p->updatesPerFrame;
+   const double c[4] = {YOSHIDA_W1 / 2, (YOSHIDA_W0 + YOSHIDA_W1) / 2,
+                        (YOSHIDA_W0 + YOSHIDA_W1) / 2, YOSHIDA_W1 / 2};
+   const double d[3] = {YOSHIDA_W1, YOSHIDA_W0, YOSHIDA_W1};
+
+   for(int i = begin; i < end; ++i){
+      double x = state->x[i];
+      double y = state->y[i];
+      double vx = state->vx[i];
+      double vy = state->vy[i];
+
+      for(int step = 0; step < p->updates; ++step){
+         for(int k = 0; k < 3; ++k){
+            double ax, ay;
+            x += c[k] * h * vx;
+            y += c[k] * h * vy;
+            gravityAcceleration(x, y, p, &ax, &ay);
+            vx += d[k] * h * ax;
+            vy += d[k] * h * ay;
+         }
+         x += c[3] * h * vx;
+         y += c[3] * h * vy;
+      }
+
+      state->x[i] = x;
+      state->y[i] = y;
+      state->vx[i] = vx;
+      state->vy[i] = vy;
+   }
+}
+
+// Stumpff functions c2(psi) and c3(psi)
+static inline void stumpff(double psi, double *c2, double *c3){
+   if(psi > 1e-6){
+      double s = sqrt(psi);
+      *c2 = (1.0 - cos(s)) / psi;
+      *c3 = (s - sin(s)) / (psi * s);
+   } else if(psi < -1e-6){
+      double s = sqrt(-psi);
+      *c2 = (1.0 - cosh(s)) / psi;
+      *c3 = (sinh(s) - s) / (-psi * s);
+   } else {
+      *c2 = 0.5 - psi / 24.0 + psi * psi / 720.0;
+      *c3 = 1.0 / 6.0 - psi / 120.0 + psi * psi / 5040.0;
+   }
+}
+
+// Propagates one satelite by dt relative to the center. Returns 0 if the
+// Newton iteration for the universal anomaly did not converge.
+static inline int keplerPropagate(double *rx, double *ry,
+                                  double *vx, double *vy,
+                                  double mu, double dt){
+
+   const double sqrtMu = sqrt(mu);
+   const double r0 = sqrt(*rx * *rx + *ry * *ry);
+   const double v02 = *vx * *vx + *vy * *vy;
+   const double rv = *rx * *vx + *ry * *vy;
+   const double alpha = 2.0 / r0 - v02 / mu;   // 1 / semi-major axis
+
+   // Initial guess of the universal anomaly
+   double chi;
+   if(alpha > 1e-9){
+      chi = sqrtMu * dt * alpha;
+   } else if(alpha < -1e-9){
+      double a = 1.0 / alpha;
+      double sign = dt >= 0.0 ? 1.0 : -1.0;
+      chi = sign * sqrt(-a) *
+         log((-2.0 * mu * alpha * dt) /
+             (rv + sign * sqrt(-mu * a) * (1.0 - r0 * alpha)));
+   } else {
+      chi = sqrtMu * dt / r0;
+   }
+   if(!isfinite(chi)){
+      chi = sqrtMu * dt / r0;
+   }
+
+   double psi = 0.0, c2 = 0.5, c3 = 1.0 / 6.0, r = r0;
+   int converged = 0;
+   for(int iteration = 0; iteration < KEPLER_MAX_ITERATIONS; ++iteration){
+      double chi2 = chi * chi;
+      psi = chi2 * alpha;
+      stumpff(psi, &c2, &c3);
+      r = chi2 * c2 + rv / sqrtMu * chi * (1.0 - psi * c3) +
+          r0 * (1.0 - psi * c2);
+      double delta = (sqrtMu * dt - chi2 * chi * c3 -
+                      rv / sqrtMu * chi2 * c2 -
+                      r0 * chi * (1.0 - psi * c3)) / r;
+      chi += delta;
+      if(fabs(delta) <= 1e-12 * (1.0 + fabs(chi))){
+         converged = 1;
+         break;
+      }
+   }
+   if(!converged || !isfinite(chi)){
+      return 0;
+   }
+
+   double chi2 = chi * chi;
+   psi = chi2 * alpha;
+   stumpff(psi, &c2, &c3);
+   r = chi2 * c2 + rv / sqrtMu * chi * (1.0 - psi * c3) +
+       r0 * (1.0 - psi * c2);
+
+   double f = 1.0 - chi2 / r0 * c2;
+   double g = dt - chi2 * chi / sqrtMu * c3;
+   double fdot = sqrtMu / (r * r0) * chi * (psi * c3 - 1.0);
+   double gdot = 1.0 - chi2 / r * c2;
+
+   double x = f * *rx + g * *vx;
+   double y = f * *ry + g * *vy;
+   *vx = fdot * *rx + gdot * *vx;
+   *vy = fdot * *ry + gdot * *vy;
+   *rx = x;
+   *ry = y;
+   return 1;
+}
+
+// Analytic Kepler propagation over one frame
+static void stepSatelitesKepler(physicsState *state, int begin, int end,
+                                const physicsParameters *p){
+
+   for(int i = begin; i < end; ++i){
+      double rx = state->x[i] - p->centerX;
+      double ry = state->y[i] - p->centerY;
+      double vx = state->vx[i];
+      double vy = state->vy[i];
+
+      if(keplerPropagate(&rx, &ry, &vx, &vy, p->gravity, p->deltaTime)){
+         state->x[i] = rx + p->centerX;
+         state->y[i] = ry + p->centerY;
+         state->vx[i] = vx;
+         state->vy[i] = vy;
+      } else {
+         physicsParameters fallback = *p;
+         fallback.updates = KEPLER_FALLBACK_STEPS;
+         fallback.updatesPerFrame = KEPLER_FALLBACK_STEPS;
+         stepSatelitesYoshida(state, i, i + 1, &fallback);
+      }
+   }
+}
+
+// Position difference between two states, in pixels
+typedef struct{
+   double maxError;
+   double rmsError;
+   int worstSatelite;
+} integratorError;
+
+static inline integratorError comparePhysicsStates(const physicsState *a,
+                                                   const physicsState *b,
+                                                   int count){
+   integratorError error = {0.0, 0.0, -1};
+   double sum = 0.0;
+   for(int i = 0; i < count; ++i){
+      double dx = a->x[i] - b->x[i];
+      double dy = a->y[i] - b->y[i];
+      double distance = sqrt(dx * dx + dy * dy);
+      sum += distance * distance;
+      if(distance > error.maxError || error.worstSatelite < 0){
+         error.maxError = distance;
+         error.worstSatelite = i;
+      }
+   }
+   error.rmsError = count > 0 ? sqrt(sum / count) : 0.0;
+   return error;
+}
+
+#endif // COMMON_INTEGRATORS_H
@@ -0,0 +1,215 @@
+// N-body physics: the black hole plus gravity between the satelites.
+//
+// All satelites have the same mass, given relative to the black hole.
+// Pairwise forces are softened with a length epsilon,
+//
+//    a_i = G m sum_j (x_j - x_i) / (|x_j - x_i|^2 + epsilon^2)^(3/2),
+//
+// so close encounters stay finite and a satelite's own term vanishes
+// without a branch. Each substep is a symplectic Euler kick and drift like
+// the reference engine's, but there are far fewer of them per frame.
+//
+// The direct O(N^2) kernels work through the bodies in tiles of
+// NBODY_TILE so a tile of positions stays in L1 while a chunk of bodies
+// accumulates against it. For large N, satellite_tree.h provides the
+// Barnes-Hut approximation (treeAcceleration).
+
+#ifndef COMMON_NBODY_H
+#define COMMON_NBODY_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "physics_simd.h"
+
+// Bodies per tile of the direct kernels, 16 KB of positions
+#define NBODY_TILE 1024
+
+// Above this many satelites --nbody auto picks the Barnes-Hut tree
+#define NBODY_DIRECT_LIMIT 4096
+
+#define NBODY_DEFAULT_MASS 1e-4     // Relative to the black hole
+#define NBODY_DEFAULT_SOFTENING 1.0 // Pixels
+#define NBODY_DEFAULT_STEPS 100     // Substeps per frame
+#define NBODY_DEFAULT_THETA 0.5
+
+typedef struct{
+   double centerX;          // Black hole position
+   double centerY;
+   double gravity;          // Black hole G M
+   double sateliteGravity;  // G m of one satelite
+   double softening2;       // epsilon^2
+   double deltaTime;        // Length of one substep
+} nbodyParameters;
+
+// Adds the satelite-satelite accelerations of bodies [begin, end) from
+// all count bodies to ax and ay
+typedef void (*nbodyForceFunction)(const physicsState *state, int count,
+                                   int begin, int end,
+                                   const nbodyParameters *p,
+                                   double *ax, double *ay);
+
+typedef struct{
+   nbodyForceFunction force;
+   const char *name;
+} nbodyKernel;
+
+static void nbodyForceScalar(const physicsState *state, int count,
+                             int begin, int end, const nbodyParameters *p,
+                             double *ax, double *ay){
+
+   for(int tile = 0; tile < count; tile += NBODY_TILE){
+      int tileEnd = tile + NBODY_TILE < count ? tile + NBODY_TILE : count;
+      for(int i = begin; i < end; ++i){
+         double xi = state->x[i];
+         double yi = state->y[i];
+         double sumX = 0.0, sumY = 0.0;
+         for(int j = tile; j < tileEnd; ++j){
+            double dx = state->x[j] - xi;
+            double dy = state->y[j] - yi;
+            double r2 = dx * dx + dy * dy + p->softening2;
+            double inverse = 1.0 / sqrt(r2);
+            double inverse3 = inverse * inverse * inverse;
+            sumX += dx * inverse3;
+            sumY += dy * inverse3;
+         }
+         ax[i] += p->sateliteGravity * sumX;
+         ay[i] += p->sateliteGravity * sumY;
+      }
+   }
+}
+
+#ifdef PHYSICS_SIMD_X86
+
+// The direct kernel for one vector of bodies against one tile. A macro so
+// the AVX2 and AVX-512 versions share it.
+#define NBODY_VECTOR_TILE(T, W, i)                                          \
+   {                                                                        \
+      T xi = W##_loadu_pd(&state->x[i]);                                    \
+      T yi = W##_loadu_pd(&state->y[i]);                                    \
+      T sumX = W##_setzero_pd();                                            \
+      T sumY = W##_setzero_pd();                                            \
+      for(int j = tile; j < tileEnd; ++j){                                  \
+         T dx = W##_sub_pd(W##_set1_pd(state->x[j]), xi);                   \
+         T dy = W##_sub_pd(W##_set1_pd(state->y[j]), yi);                   \
+         T r2 = W##_fmadd_pd(dx, dx, W##_fmadd_pd(dy, dy, softening2));     \
+         T inverse = W##_div_pd(one, W##_sqrt_pd(r2));                      \
+         T inverse3 = W##_mul_pd(W##_mul_pd(inverse, inverse), inverse);    \
+         sumX = W##_fmadd_pd(dx, inverse3, sumX);                           \
+         sumY = W##_fmadd_pd(dy, inverse3, sumY);                           \
+      }                                                                     \
+      W##_storeu_pd(&ax[i], W##_fmadd_pd(gravity, sumX,                     \
+                                          W##_loadu_pd(&ax[i])));           \
+      W##_storeu_pd(&ay[i], W##_fmadd_pd(gravity, sumY,                     \
+                                          W##_loadu_pd(&ay[i])));           \
+   }
+
+// 4 bodies per instruction
+__attribute__((target("avx2,fma")))
+static void nbodyForceAVX2(const physicsState *state, int count,
+                           int begin, int end, const nbodyParameters *p,
+                           double *ax, double *ay){
+
+   const __m256d softening2 = _mm256_set1_pd(p->softening2);
+   const __m256d gravity = _mm256_set1_pd(p->sateliteGravity);
+   const __m256d one = _mm256_set1_pd(1.0);
+   int vectorEnd = begin + (end - begin) / 4 * 4;
+
+   for(int tile = 0; tile < count; tile += NBODY_TILE){
+      int tileEnd = tile + NBODY_TILE < count ? tile + NBODY_TILE : count;
+      for(int i = begin; i < vectorEnd; i += 4){
+         NBODY_VECTOR_TILE(__m256d, _mm256, i)
+      }
+   }
+   nbodyForceScalar(state, count, vectorEnd, end, p, ax, ay);
+}
+
+// 8 bodies per instruction
+__attribute__((target("avx512f")))
+static void nbodyForceAVX512(const physicsState *state, int count,
+                             int begin, int end, const nbodyParameters *p,
+                             double *ax, double *ay){
+
+   const __m512d softening2 = _mm512_set1_pd(p->softening2);
+   const __m512d gravity = _mm512_set1_pd(p->sateliteGravity);
+   const __m512d one = _mm512_set1_pd(1.0);
+   int vectorEnd = begin + (end - begin) / 8 * 8;
+
+   for(int tile = 0; tile < count; tile += NBODY_TILE){
+      int tileEnd = tile + NBODY_TILE < count ? tile + NBODY_TILE : count;
+      for(int i = begin; i < vectorEnd; i += 8){
+         NBODY_VECTOR_TILE(__m512d, _mm512, i)
+      }
+   }
+   nbodyForceScalar(state, count, vectorEnd, end, p, ax, ay);
+}
+
+#undef NBODY_VECTOR_TILE
+
+#endif // PHYSICS_SIMD_X86
+
+// Picks the widest direct kernel the CPU supports, PHYSICS_KERNEL forces
+// one like for selectPhysicsKernel()
+static inline nbodyKernel selectNbodyKernel(void){
+
+   nbodyKernel scalar = {nbodyForceScalar, "scalar"};
+   const char *forced = getenv("PHYSICS_KERNEL");
+
+#ifdef PHYSICS_SIMD_X86
+   nbodyKernel avx2 = {nbodyForceAVX2, "avx2"};
+   nbodyKernel avx512 = {nbodyForceAVX512, "avx512"};
+
+   __builtin_cpu_init();
+   int hasAVX2 = __builtin_cpu_supports("avx2") &&
+                 __builtin_cpu_supports("fma");
+   int hasAVX512 = __builtin_cpu_supports("avx512f");
+
+   if(forced != NULL && strcmp(forced, "scalar") == 0){
+      return scalar;
+   }
+   if(forced != NULL && strcmp(forced, "avx2") == 0 && hasAVX2){
+      return avx2;
+   }
+   if(hasAVX512){
+      return avx512;
+   }
+   if(hasAVX2){
+      return avx2;
+   }
+#else
+   (void)forced;
+#endif
+   return scalar;
+}
+
+// Sets ax and ay of bodies [begin, end) to the black hole acceleration,
+// computed like the reference engine
+static inline void nbodyCentralForce(const physicsState *state, int begin,
+                                     int end, const nbodyParameters *p,
+                                     double *ax, double *ay){
+   for(int i = begin; i < end; ++i){
+      double px = state->x[i] - p->centerX;
+      double py = state->y[i] - p->centerY;
+      double distSquared = px * px + py * py;
+      double dist = sqrt(distSquared);
+      double accumulation = p->gravity / distSquared;
+      ax[i] = -accumulation * px / dist;
+      ay[i] = -accumulation * py / dist;
+   }
+}
+
+// Kick and drift of bodies [begin, end) with the accelerations ax, ay
+static inline void nbodyKickDrift(physicsState *state, int begin, int end,
+                                  const nbodyParameters *p,
+                                  const double *ax, const double *ay){
+   for(int i = begin; i < end; ++i){
+      state->vx[i] += ax[i] * p->deltaTime;
+      state->vy[i] += ay[i] * p->deltaTime;
+      state->x[i] += state->vx[i] * p->deltaTime;
+      state->y[i] += state->vy[i] * p->deltaTime;
+   }
+}
+
+#endif // COMMON_NBODY_H
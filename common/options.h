@@ -0,0 +1,270 @@
+// Command line options shared by all backends.
+//
+// Every backend parses its arguments with parseCommonOption() first and
+// only handles the options it does not recognise itself. A bare number is
+// the random seed, as it always has been:
+//
+//    ./parallel [seed] [--headless] [--frames N] [--satellites N] ...
+//
+// The problem size can also be set through the environment variables
+// SATELITE_COUNT, WINDOW_WIDTH, WINDOW_HEIGHT and PHYSICSUPDATESPERFRAME;
+// command line options take precedence.
+
+#ifndef COMMON_OPTIONS_H
+#define COMMON_OPTIONS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Default problem size. Benchmarks must be run with these values.
+#define DEFAULT_WINDOW_WIDTH 1024
+#define DEFAULT_WINDOW_HEIGHT 1024
+#define DEFAULT_SATELITE_COUNT 64
+#define DEFAULT_PHYSICSUPDATESPERFRAME 100000
+
+#define DEFAULT_HEADLESS_FRAMES 100
+
+// Edge of the square tiles the CPU graphics engines hand out
+#define DEFAULT_TILE_SIZE 32
+
+// Prints the options a backend parses itself, after the common ones
+typedef void (*backendUsagePrinter)(FILE *stream);
+
+typedef struct{
+   unsigned int seed;     // Seed for the satelite generation, 0 = default
+   int headless;          // Run without a GLUT window
+   unsigned int frames;   // Number of frames in headless mode
+
+   int windowWidth;
+   int windowHeight;
+   int sateliteCount;
+   int physicsUpdatesPerFrame;
+
+   int tileSize;          // CPU backends only
+   int threads;           // CPU backends only, 0 = one per online CPU
+   int pinThreads;        // CPU backends only, pin workers to cores
+   int perfCounters;      // CPU backends only, perf_event counters per phase
+
+   const char *statsJson; // Frame statistics files, NULL = none
+   const char *statsCsv;
+   const char *traceFile; // Chrome trace of the hot paths, NULL = none
+
+   backendUsagePrinter backendUsage; // For --help, NULL = common only
+} simulationOptions;
+
+// Parses an unsigned integer option value or exits with an error
+static inline unsigned int parseUnsignedValue(const char *option,
+                                              const char *value){
+   char *end;
+   unsigned long parsed;
+
+   if(value == NULL){
+      fprintf(stderr, "Missing value for %s\n", option);
+      exit(EXIT_FAILURE);
+   }
+   parsed = strtoul(value, &end, 10);
+   if(*value == '\0' || *end != '\0'){
+      fprintf(stderr, "Invalid value for %s: %s\n", option, value);
+      exit(EXIT_FAILURE);
+   }
+   return (unsigned int)parsed;
+}
+
+// Parses a non-negative floating point option value or exits with an error
+static inline double parseDoubleValue(const char *option, const char *value){
+   char *end;
+   double parsed;
+
+   if(value == NULL){
+      fprintf(stderr, "Missing value for %s\n", option);
+      exit(EXIT_FAILURE);
+   }
+   parsed = strtod(value, &end);
+   if(*value == '\0' || *end != '\0' || !(parsed >= 0.0)){
+      fprintf(stderr, "Invalid value for %s: %s\n", option, value);
+      exit(EXIT_FAILURE);
+   }
+   return parsed;
+}
+
+// Parses a size option which has to be at least 1
+static inline int parseSizeValue(const char *option, const char *value){
+   unsigned int parsed = parseUnsignedValue(option, value);
+   if(parsed < 1 || parsed > 1000000000u){
+      fprintf(stderr, "Value for %s out of range: %s\n", option, value);
+      exit(EXIT_FAILURE);
+   }
+   return (int)parsed;
+}
+
+// Checks that an option has a value or exits with an error
+static inline const char *requireValue(const char *option, const char *value){
+   if(value == NULL){
+      fprintf(stderr, "Missing value for %s\n", option);
+      exit(EXIT_FAILURE);
+   }
+   return value;
+}
+
+// Checks that a file name option has a value
+static inline const char *parsePathValue(const char *option,
+                                         const char *value){
+   return requireValue(option, value);
+}
+
+// Overrides *target with the environment variable name if it is set
+static inline void sizeFromEnvironment(const char *name, int *target){
+   const char *value = getenv(name);
+   if(value != NULL && *value != '\0'){
+      *target = parseSizeValue(name, value);
+   }
+}
+
+static inline void initOptions(simulationOptions *options){
+   options->seed = 0;
+   options->headless = 0;
+   options->frames = DEFAULT_HEADLESS_FRAMES;
+
+   options->windowWidth = DEFAULT_WINDOW_WIDTH;
+   options->windowHeight = DEFAULT_WINDOW_HEIGHT;
+   options->sateliteCount = DEFAULT_SATELITE_COUNT;
+   options->physicsUpdatesPerFrame = DEFAULT_PHYSICSUPDATESPERFRAME;
+
+   sizeFromEnvironment("WINDOW_WIDTH", &options->windowWidth);
+   sizeFromEnvironment("WINDOW_HEIGHT", &options->windowHeight);
+   sizeFromEnvironment("SATELITE_COUNT", &options->sateliteCount);
+   sizeFromEnvironment("PHYSICSUPDATESPERFRAME",
+                       &options->physicsUpdatesPerFrame);
+
+   options->tileSize = DEFAULT_TILE_SIZE;
+   options->threads = 0;
+   options->pinThreads = 1;
+   options->perfCounters = 0;
+
+   options->statsJson = NULL;
+   options->statsCsv = NULL;
+   options->traceFile = NULL;
+   options->backendUsage = NULL;
+}
+
+static inline void printCommonUsage(FILE *stream, const char *program){
+   fprintf(stream,
+      "Usage: %s [seed] [options]\n"
+      "  --headless       run without a window and exit after --frames\n"
+      "  --frames N       number of frames in headless mode (default %d)\n"
+      "  --satellites N   number of satelites (default %d)\n"
+      "  --width W        window width in pixels (default %d)\n"
+      "  --height H       window height in pixels (default %d)\n"
+      "  --substeps N     physics updates per frame (default %d)\n"
+      "  --tile-size N    tile edge of the CPU graphics engines (default %d)\n"
+      "  --threads N      CPU backend threads (default: online CPUs)\n"
+      "  --affinity A     CPU thread placement: cores (default) or none\n"
+      "  --perf-counters  CPU backends: print hardware counters per phase\n"
+      "  --stats-json F   write frame time statistics as JSON, - = stdout\n"
+      "  --stats-csv F    write frame time statistics as CSV, - = stdout\n"
+      "  --trace F        write a Chrome trace (build with -DPARALLEL_TRACE)\n",
+      program, DEFAULT_HEADLESS_FRAMES, DEFAULT_SATELITE_COUNT,
+      DEFAULT_WINDOW_WIDTH, DEFAULT_WINDOW_HEIGHT,
+      DEFAULT_PHYSICSUPDATESPERFRAME, DEFAULT_TILE_SIZE);
+}
+
+// Prints the common and the backend options
+static inline void printUsage(FILE *stream, const simulationOptions *options,
+                              const char *program){
+   printCommonUsage(stream, program);
+   if(options->backendUsage != NULL){
+      options->backendUsage(stream);
+   }
+}
+
+// Tries to parse argv[*index] as a common option. Returns 1 and advances
+// *index past any consumed value if the option was recognised, 0 otherwise.
+static inline int parseCommonOption(simulationOptions *options, int argc,
+                                    char **argv, int *index){
+   const char *argument = argv[*index];
+   const char *value = (*index + 1 < argc) ? argv[*index + 1] : NULL;
+
+   if(strcmp(argument, "--headless") == 0){
+      options->headless = 1;
+      return 1;
+   }
+   if(strcmp(argument, "--frames") == 0){
+      options->frames = parseUnsignedValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--satellites") == 0){
+      options->sateliteCount = parseSizeValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--width") == 0){
+      options->windowWidth = parseSizeValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--height") == 0){
+      options->windowHeight = parseSizeValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--substeps") == 0){
+      options->physicsUpdatesPerFrame = parseSizeValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--tile-size") == 0){
+      options->tileSize = parseSizeValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--threads") == 0){
+      options->threads = parseSizeValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--affinity") == 0){
+      requireValue(argument, value);
+      if(strcmp(value, "cores") == 0){
+         options->pinThreads = 1;
+      } else if(strcmp(value, "none") == 0){
+         options->pinThreads = 0;
+      } else {
+         fprintf(stderr, "Invalid value for %s: %s\n", argument, value);
+         exit(EXIT_FAILURE);
+      }
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--perf-counters") == 0){
+      options->perfCounters = 1;
+      return 1;
+   }
+   if(strcmp(argument, "--stats-json") == 0){
+      options->statsJson = parsePathValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--stats-csv") == 0){
+      options->statsCsv = parsePathValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--trace") == 0){
+      options->traceFile = parsePathValue(argument, value);
+      ++*index;
+      return 1;
+   }
+   if(strcmp(argument, "--help") == 0){
+      printUsage(stdout, options, argv[0]);
+      exit(EXIT_SUCCESS);
+   }
+   if(argument[0] != '-'){
+      options->seed = parseUnsignedValue("seed", argument);
+      return 1;
+   }
+   return 0;
+}
+
+#endif // COMMON_OPTIONS_H
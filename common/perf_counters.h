@@ -0,0 +1,375 @@
+// Hardware performance counters around the engine phases (--perf-counters).
+//
+// Every worker thread opens its own counters with perf_event_open(): CPU
+// time, cycles, instructions, last level cache references and misses,
+// branches and branch misses, user space only. The calling thread reads
+// the counters of all workers before and after parallelPhysicsEngine()
+// and parallelGraphicsEngine(), so a phase gets the sum over the threads
+// of everything they did in it, busy waiting included. Counters the
+// kernel multiplexes are scaled by their enabled / running time.
+//
+// Counters that cannot be opened (no PMU in a virtual machine,
+// perf_event_paranoid, not Linux) are reported once and shown as "-",
+// the others still work. Reading costs one read() per counter and thread
+// at every phase boundary, so the counters are off by default.
+//
+// perf has no portable floating point event. GFLOP/s are nominal: the
+// operations of the reference algorithms (PERF_*_FLOPS) times the work of
+// the frame, divided by the phase time. Engines which skip work, like
+// incremental rendering or the N-body tree, show higher rates than they
+// execute.
+
+#ifndef COMMON_PERF_COUNTERS_H
+#define COMMON_PERF_COUNTERS_H
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define PERF_COUNTERS_LINUX 1
+#endif
+
+#include "frame_stats.h"
+#include "timing.h"
+
+// Floating point operations of the reference engines, sqrt and division
+// counted as one: one physics update of one satelite and one pixel shaded
+// against one satelite
+#define PERF_PHYSICS_FLOPS 23
+#define PERF_GRAPHICS_FLOPS 30
+
+enum{
+   PERF_TASK_CLOCK,
+   PERF_CYCLES,
+   PERF_INSTRUCTIONS,
+   PERF_CACHE_REFERENCES,
+   PERF_CACHE_MISSES,
+   PERF_BRANCHES,
+   PERF_BRANCH_MISSES,
+   PERF_EVENT_COUNT
+};
+
+enum{
+   PERF_PHASE_PHYSICS,
+   PERF_PHASE_GRAPHICS,
+   PERF_PHASE_COUNT
+};
+
+static const char *const perfEventNames[PERF_EVENT_COUNT] = {
+   "task-clock", "cycles", "instructions", "cache-references",
+   "cache-misses", "branches", "branch-misses"
+};
+
+// Counter deltas of one phase, summed over the threads
+typedef struct{
+   double value[PERF_EVENT_COUNT];
+   long long nanoseconds;   // Wall time of the phase
+} perfSample;
+
+// Derived metrics of a phase, NAN where a counter is missing
+typedef struct{
+   double ipc;
+   double cacheMissPercent;
+   double branchMissPercent;
+   double cpusBusy;
+   double workRate;         // Physics updates or pixels per second
+   double interactionRate;  // Graphics only, pixel-satelite pairs per second
+   double gflops;           // Nominal, see PERF_*_FLOPS
+} perfMetrics;
+
+typedef struct{
+   int enabled;
+   int threads;
+   int *fds;       // threads * PERF_EVENT_COUNT, -1 = not open
+   int *errors;    // errno of the failed opens, 0 = open
+
+   // Work of one frame for the derived metrics
+   double physicsUpdates;   // Satelites * physics updates
+   double pixels;
+   double interactions;     // Pixels * satelites
+
+   double begin[PERF_EVENT_COUNT];
+   long long beginTime;
+   perfSample frame[PERF_PHASE_COUNT];
+   perfSample total[PERF_PHASE_COUNT];
+   unsigned int frames;
+} perfCounters;
+
+static inline void initPerfCounters(perfCounters *p, int enabled,
+                                    int threads, int satelites,
+                                    int physicsUpdates, int pixels){
+   memset(p, 0, sizeof(*p));
+   p->enabled = enabled;
+   p->threads = threads;
+   p->physicsUpdates = (double)satelites * physicsUpdates;
+   p->pixels = pixels;
+   p->interactions = (double)pixels * satelites;
+   if(!enabled){
+      return;
+   }
+   p->fds = (int*)malloc(sizeof(int) * threads * PERF_EVENT_COUNT);
+   p->errors = (int*)malloc(sizeof(int) * threads * PERF_EVENT_COUNT);
+   if(p->fds == NULL || p->errors == NULL){
+      fprintf(stderr, "Failed to allocate the performance counters\n");
+      exit(EXIT_FAILURE);
+   }
+   for(int i = 0; i < threads * PERF_EVENT_COUNT; ++i){
+      p->fds[i] = -1;
+      p->errors[i] = 0;
+   }
+}
+
+// Opens the counters of the calling thread as worker. Run on every worker.
+static inline void perfOpenThread(perfCounters *p, int worker){
+   if(!p->enabled || worker < 0 || worker >= p->threads){
+      return;
+   }
+   int *fds = &p->fds[worker * PERF_EVENT_COUNT];
+   int *errors = &p->errors[worker * PERF_EVENT_COUNT];
+#ifdef PERF_COUNTERS_LINUX
+   static const struct{ unsigned int type; unsigned long long config; }
+      events[PERF_EVENT_COUNT] = {
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+   };
+   for(int e = 0; e < PERF_EVENT_COUNT; ++e){
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[e].type;
+      attr.config = events[e].config;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      fds[e] = (int)fd;
+      errors[e] = fd < 0 ? errno : 0;
+   }
+#else
+   for(int e = 0; e < PERF_EVENT_COUNT; ++e){
+      errors[e] = ENOSYS;
+   }
+#endif
+}
+
+// Counter e is usable if every thread opened it
+static inline int perfEventAvailable(const perfCounters *p, int e){
+   for(int t = 0; t < p->threads; ++t){
+      if(p->fds[t * PERF_EVENT_COUNT + e] < 0){
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Prints which counters were opened. Call after every worker opened its own.
+static inline void printPerfCounterStatus(const perfCounters *p){
+   if(!p->enabled){
+      return;
+   }
+   printf("Performance counters on %d threads:", p->threads);
+   for(int e = 0; e < PERF_EVENT_COUNT; ++e){
+      if(perfEventAvailable(p, e)){
+         printf(" %s", perfEventNames[e]);
+      }
+   }
+   printf("\n");
+   for(int e = 0; e < PERF_EVENT_COUNT; ++e){
+      if(!perfEventAvailable(p, e)){
+         int error = 0;
+         for(int t = 0; t < p->threads && error == 0; ++t){
+            error = p->errors[t * PERF_EVENT_COUNT + e];
+         }
+         printf("Performance counter %s unavailable: %s\n",
+                perfEventNames[e], strerror(error));
+      }
+   }
+}
+
+// Sums every counter over the threads, scaled for multiplexing
+static inline void perfReadSums(const perfCounters *p,
+                                double sums[PERF_EVENT_COUNT]){
+   for(int e = 0; e < PERF_EVENT_COUNT; ++e){
+      sums[e] = 0.0;
+   }
+   for(int t = 0; t < p->threads; ++t){
+      for(int e = 0; e < PERF_EVENT_COUNT; ++e){
+         int fd = p->fds[t * PERF_EVENT_COUNT + e];
+         unsigned long long data[3];   // Value, time enabled, time running
+         if(fd < 0 || read(fd, data, sizeof(data)) != sizeof(data)){
+            continue;
+         }
+         sums[e] += data[2] > 0 && data[2] < data[1] ?
+            (double)data[0] * data[1] / data[2] : (double)data[0];
+      }
+   }
+}
+
+static inline void perfPhaseBegin(perfCounters *p){
+   if(!p->enabled){
+      return;
+   }
+   perfReadSums(p, p->begin);
+   p->beginTime = nowNanoseconds();
+}
+
+static inline void perfPhaseEnd(perfCounters *p, int phase){
+   if(!p->enabled){
+      return;
+   }
+   long long endTime = nowNanoseconds();
+   double end[PERF_EVENT_COUNT];
+   perfReadSums(p, end);
+
+   perfSample *frame = &p->frame[phase];
+   perfSample *total = &p->total[phase];
+   for(int e = 0; e < PERF_EVENT_COUNT; ++e){
+      frame->value[e] = end[e] - p->begin[e];
+      total->value[e] += frame->value[e];
+   }
+   frame->nanoseconds = endTime - p->beginTime;
+   total->nanoseconds += frame->nanoseconds;
+}
+
+// numerator / denominator of s, NAN if a counter is missing
+static inline double perfRatio(const perfCounters *p, const perfSample *s,
+                               int numerator, int denominator){
+   if(!perfEventAvailable(p, numerator) ||
+      !perfEventAvailable(p, denominator) || s->value[denominator] <= 0.0){
+      return NAN;
+   }
+   return s->value[numerator] / s->value[denominator];
+}
+
+// Metrics of the sample s of phase, which covers frames frames
+static inline perfMetrics perfPhaseMetrics(const perfCounters *p, int phase,
+                                           const perfSample *s,
+                                           unsigned int frames){
+   // A phase that did not run, like graphics in batch mode without
+   // --batch-render, has no rates
+   double seconds = s->nanoseconds > 0 ? s->nanoseconds / 1e9 : NAN;
+   perfMetrics m;
+
+   m.ipc = perfRatio(p, s, PERF_INSTRUCTIONS, PERF_CYCLES);
+   m.cacheMissPercent = 100.0 * perfRatio(p, s, PERF_CACHE_MISSES,
+                                          PERF_CACHE_REFERENCES);
+   m.branchMissPercent = 100.0 * perfRatio(p, s, PERF_BRANCH_MISSES,
+                                           PERF_BRANCHES);
+   m.cpusBusy = perfEventAvailable(p, PERF_TASK_CLOCK) ?
+      s->value[PERF_TASK_CLOCK] / (seconds * 1e9) : NAN;
+   if(phase == PERF_PHASE_PHYSICS){
+      double updates = p->physicsUpdates * frames;
+      m.workRate = updates / seconds;
+      m.interactionRate = NAN;
+      m.gflops = updates * PERF_PHYSICS_FLOPS / seconds / 1e9;
+   } else {
+      double interactions = p->interactions * frames;
+      m.workRate = p->pixels * frames / seconds;
+      m.interactionRate = interactions / seconds;
+      m.gflops = interactions * PERF_GRAPHICS_FLOPS / seconds / 1e9;
+   }
+   return m;
+}
+
+// Prints prefix, value and suffix, or "-" for a NAN value
+static inline void printPerfValue(const char *prefix, double value,
+                                  int decimals, const char *suffix){
+   if(isnan(value)){
+      printf("%s-%s", prefix, suffix);
+   } else {
+      printf("%s%.*f%s", prefix, decimals, value, suffix);
+   }
+}
+
+// One line of counters and derived metrics of a phase; frames is the
+// number of frames s covers
+static inline void printPerfPhase(const perfCounters *p, const char *label,
+                                  int phase, const perfSample *s,
+                                  unsigned int frames){
+   perfMetrics m = perfPhaseMetrics(p, phase, s, frames);
+
+   printf("%s: ", label);
+   printPerfValue("", m.ipc, 2, " IPC");
+   printPerfValue(", ", m.cacheMissPercent, 1, "% cache misses");
+   printPerfValue(", ", m.branchMissPercent, 2, "% branch misses");
+   printPerfValue(", ", m.cpusBusy, 1, " CPUs busy");
+   if(phase == PERF_PHASE_PHYSICS){
+      printPerfValue(", ", m.workRate / 1e6, 1, " M updates/s");
+   } else {
+      printPerfValue(", ", m.workRate / 1e6, 1, " Mpixels/s");
+      printPerfValue(", ", m.interactionRate / 1e9, 2, " G interactions/s");
+   }
+   printPerfValue(", ", m.gflops, 2, " GFLOP/s\n");
+}
+
+// Prints the counters of the last frame
+static inline void printPerfFrame(perfCounters *p){
+   if(!p->enabled){
+      return;
+   }
+   ++p->frames;
+   printPerfPhase(p, "Counters physics", PERF_PHASE_PHYSICS,
+                  &p->frame[PERF_PHASE_PHYSICS], 1);
+   printPerfPhase(p, "Counters graphics", PERF_PHASE_GRAPHICS,
+                  &p->frame[PERF_PHASE_GRAPHICS], 1);
+}
+
+// Prints the counters of the whole run
+static inline void printPerfSummary(const perfCounters *p){
+   if(!p->enabled || p->frames == 0){
+      return;
+   }
+   printPerfPhase(p, "Counters summary physics", PERF_PHASE_PHYSICS,
+                  &p->total[PERF_PHASE_PHYSICS], p->frames);
+   printPerfPhase(p, "Counters summary graphics", PERF_PHASE_GRAPHICS,
+                  &p->total[PERF_PHASE_GRAPHICS], p->frames);
+}
+
+// Hands the metrics of the whole run to stats for --stats-json and
+// --stats-csv. Call before writeFrameStats().
+static inline void perfRecordStats(const perfCounters *p, frameStats *stats){
+   static const int slots[PERF_PHASE_COUNT] = {STATS_COUNTERS_PHYSICS,
+                                               STATS_COUNTERS_GRAPHICS};
+   if(!p->enabled || p->frames == 0){
+      return;
+   }
+   for(int phase = 0; phase < PERF_PHASE_COUNT; ++phase){
+      perfMetrics m = perfPhaseMetrics(p, phase, &p->total[phase], p->frames);
+      counterMetrics *target = &stats->counters[slots[phase]];
+      target->ipc = m.ipc;
+      target->cacheMissPercent = m.cacheMissPercent;
+      target->branchMissPercent = m.branchMissPercent;
+      target->cpusBusy = m.cpusBusy;
+      target->gflops = m.gflops;
+   }
+   stats->hasCounters = 1;
+}
+
+static inline void freePerfCounters(perfCounters *p){
+   if(p->fds != NULL){
+      for(int i = 0; i < p->threads * PERF_EVENT_COUNT; ++i){
+         if(p->fds[i] >= 0){
+            close(p->fds[i]);
+         }
+      }
+   }
+   free(p->fds);
+   free(p->errors);
+   p->fds = NULL;
+   p->errors = NULL;
+   p->enabled = 0;
+}
+
+#endif // COMMON_PERF_COUNTERS_H
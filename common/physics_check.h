@@ -0,0 +1,48 @@
+// Tolerance check of physics engines that are not bit-identical to the
+// double precision reference, shared by the backends.
+
+#ifndef COMMON_PHYSICS_CHECK_H
+#define COMMON_PHYSICS_CHECK_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stddef.h>
+
+// Largest position difference from the double reference, in pixels,
+// accepted by the physics check of the first frames. The satelites store
+// positions as floats, whose spacing is about 6e-5 px at 1024 px.
+#define PHYSICS_FLOAT_TOLERANCE 1e-3
+
+// Prints how far count satelites are from the reference and flags those
+// beyond PHYSICS_FLOAT_TOLERANCE. state and reference point to the
+// position x of the first satelite, followed by position y, velocity x and
+// velocity y; consecutive satelites are stride floats apart, so the
+// satelite arrays of every backend can be passed as they are.
+static inline void checkPhysicsTolerance(const float *state,
+                                         const float *reference, int count,
+                                         size_t stride){
+
+   double maxPosition = 0.0, maxVelocity = 0.0, sum = 0.0;
+   for(int i = 0; i < count; ++i){
+      const float *s = state + i * stride;
+      const float *r = reference + i * stride;
+      double dx = s[0] - r[0];
+      double dy = s[1] - r[1];
+      double dvx = s[2] - r[2];
+      double dvy = s[3] - r[3];
+      double position = sqrt(dx * dx + dy * dy);
+      double velocity = sqrt(dvx * dvx + dvy * dvy);
+      sum += position * position;
+      maxPosition = position > maxPosition ? position : maxPosition;
+      maxVelocity = velocity > maxVelocity ? velocity : maxVelocity;
+      if(!(position <= PHYSICS_FLOAT_TOLERANCE)){
+         printf("Incorrect satelite data of satelite: %d\n", i);
+         getchar();
+      }
+   }
+   printf("Float physics vs double: max position error %.3e px, "
+          "rms %.3e px, max velocity error %.3e\n", maxPosition,
+          sqrt(sum / count), maxVelocity);
+}
+
+#endif // COMMON_PHYSICS_CHECK_H
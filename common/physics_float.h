@@ -0,0 +1,225 @@
+// Single precision physics kernels with compensated summation.
+//
+// The reference engine needs double precision only because it adds
+// 100000 tiny steps per frame to the velocities and positions; the force
+// itself is fine in float. These kernels keep every state variable as an
+// unevaluated float sum hi + lo and add each step with Kahan's
+// compensation, which carries about 48 bits through the accumulation
+// while all arithmetic runs on floats: twice the lanes of the double
+// kernels per vector, and no double arithmetic at all.
+//
+// They take and return the double physicsState like the double kernels
+// (hi + lo on the way out), so they plug into the same frame loop. The
+// result is close to the reference but not bit-identical; the backends
+// check it against a tolerance instead (PHYSICS_FLOAT_TOLERANCE).
+//
+// Compensation only works as long as the compiler keeps the operation
+// order: no -ffast-math, no -fassociative-math.
+
+#ifndef COMMON_PHYSICS_FLOAT_H
+#define COMMON_PHYSICS_FLOAT_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "physics_simd.h"
+#include "physics_check.h" // PHYSICS_FLOAT_TOLERANCE
+
+// Splits the double state of satelites [begin, end) into hi + lo floats
+static inline void splitPhysicsState(const physicsState *state,
+                                     int begin, int end, float hi[4][16],
+                                     float lo[4][16]){
+   const double *source[4] = {state->x, state->y, state->vx, state->vy};
+   for(int k = 0; k < 4; ++k){
+      for(int i = begin; i < end; ++i){
+         hi[k][i - begin] = (float)source[k][i];
+         lo[k][i - begin] = (float)(source[k][i] - hi[k][i - begin]);
+      }
+   }
+}
+
+static inline void joinPhysicsState(physicsState *state, int begin, int end,
+                                    float hi[4][16], float lo[4][16]){
+   double *target[4] = {state->x, state->y, state->vx, state->vy};
+   for(int k = 0; k < 4; ++k){
+      for(int i = begin; i < end; ++i){
+         target[k][i] = (double)hi[k][i - begin] + (double)lo[k][i - begin];
+      }
+   }
+}
+
+// One compensated Euler step of one satelite. The position enters the
+// force with its low part, the velocity increment and the position
+// increment are Kahan sums into hi + lo.
+static inline void stepSateliteFloat(float *xh, float *xl, float *yh,
+                                     float *yl, float *vxh, float *vxl,
+                                     float *vyh, float *vyl,
+                                     float centerX, float centerY,
+                                     float gravity, float h){
+
+   float px = (*xh - centerX) + *xl;
+   float py = (*yh - centerY) + *yl;
+   float distSquared = px * px + py * py;
+   float dist = sqrtf(distSquared);
+   float accumulation = gravity / distSquared;
+
+   float dvx = -(accumulation * (px / dist) * h) + *vxl;
+   float dvy = -(accumulation * (py / dist) * h) + *vyl;
+   float vx = *vxh + dvx;
+   float vy = *vyh + dvy;
+   *vxl = dvx - (vx - *vxh);
+   *vyl = dvy - (vy - *vyh);
+   *vxh = vx;
+   *vyh = vy;
+
+   float dx = vx * h + (*vxl * h + *xl);
+   float dy = vy * h + (*vyl * h + *yl);
+   float x = *xh + dx;
+   float y = *yh + dy;
+   *xl = dx - (x - *xh);
+   *yl = dy - (y - *yh);
+   *xh = x;
+   *yh = y;
+}
+
+static void stepSatelitesFloatScalar(physicsState *state, int begin, int end,
+                                     const physicsParameters *p){
+
+   const float h = (float)(p->deltaTime / p->updatesPerFrame);
+   float hi[4][16], lo[4][16];
+
+   for(int chunk = begin; chunk < end; chunk += 16){
+      int chunkEnd = chunk + 16 < end ? chunk + 16 : end;
+      splitPhysicsState(state, chunk, chunkEnd, hi, lo);
+      for(int i = 0; i < chunkEnd - chunk; ++i){
+         for(int physicsUpdateIndex = 0; physicsUpdateIndex < p->updates;
+             ++physicsUpdateIndex){
+            stepSateliteFloat(&hi[0][i], &lo[0][i], &hi[1][i], &lo[1][i],
+                              &hi[2][i], &lo[2][i], &hi[3][i], &lo[3][i],
+                              (float)p->centerX, (float)p->centerY,
+                              (float)p->gravity, h);
+         }
+      }
+      joinPhysicsState(state, chunk, chunkEnd, hi, lo);
+   }
+}
+
+#ifdef PHYSICS_SIMD_X86
+
+// stepSateliteFloat() for a vector of satelites, same operation order
+#define PHYSICS_FLOAT_STEP(T, W)                                            \
+   {                                                                        \
+      T px = W##_add_ps(W##_sub_ps(xh, centerX), xl);                       \
+      T py = W##_add_ps(W##_sub_ps(yh, centerY), yl);                       \
+      T distSquared = W##_add_ps(W##_mul_ps(px, px), W##_mul_ps(py, py));   \
+      T dist = W##_sqrt_ps(distSquared);                                    \
+      T accumulation = W##_div_ps(gravity, distSquared);                    \
+      T dvx = W##_sub_ps(vxl, W##_mul_ps(W##_mul_ps(accumulation,           \
+                                 W##_div_ps(px, dist)), h));                \
+      T dvy = W##_sub_ps(vyl, W##_mul_ps(W##_mul_ps(accumulation,           \
+                                 W##_div_ps(py, dist)), h));                \
+      T vx = W##_add_ps(vxh, dvx);                                          \
+      T vy = W##_add_ps(vyh, dvy);                                          \
+      vxl = W##_sub_ps(dvx, W##_sub_ps(vx, vxh));                           \
+      vyl = W##_sub_ps(dvy, W##_sub_ps(vy, vyh));                           \
+      vxh = vx;                                                             \
+      vyh = vy;                                                             \
+      T dx = W##_add_ps(W##_mul_ps(vx, h),                                  \
+                        W##_add_ps(W##_mul_ps(vxl, h), xl));                \
+      T dy = W##_add_ps(W##_mul_ps(vy, h),                                  \
+                        W##_add_ps(W##_mul_ps(vyl, h), yl));                \
+      T x = W##_add_ps(xh, dx);                                             \
+      T y = W##_add_ps(yh, dy);                                             \
+      xl = W##_sub_ps(dx, W##_sub_ps(x, xh));                               \
+      yl = W##_sub_ps(dy, W##_sub_ps(y, yh));                               \
+      xh = x;                                                               \
+      yh = y;                                                               \
+   }
+
+// The kernel body for one vector width. The state is split into the
+// stack arrays once per frame and stays in registers for all steps.
+#define PHYSICS_FLOAT_KERNEL(T, W, WIDTH)                                   \
+   const T centerX = W##_set1_ps((float)p->centerX);                       \
+   const T centerY = W##_set1_ps((float)p->centerY);                       \
+   const T gravity = W##_set1_ps((float)p->gravity);                       \
+   const T h = W##_set1_ps((float)(p->deltaTime / p->updatesPerFrame));    \
+   float hi[4][16], lo[4][16];                                              \
+   int i = begin;                                                           \
+   for(; i + WIDTH <= end; i += WIDTH){                                     \
+      splitPhysicsState(state, i, i + WIDTH, hi, lo);                       \
+      T xh = W##_loadu_ps(hi[0]), xl = W##_loadu_ps(lo[0]);                 \
+      T yh = W##_loadu_ps(hi[1]), yl = W##_loadu_ps(lo[1]);                 \
+      T vxh = W##_loadu_ps(hi[2]), vxl = W##_loadu_ps(lo[2]);               \
+      T vyh = W##_loadu_ps(hi[3]), vyl = W##_loadu_ps(lo[3]);               \
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < p->updates;     \
+          ++physicsUpdateIndex){                                            \
+         PHYSICS_FLOAT_STEP(T, W)                                           \
+      }                                                                     \
+      W##_storeu_ps(hi[0], xh);                                             \
+      W##_storeu_ps(lo[0], xl);                                             \
+      W##_storeu_ps(hi[1], yh);                                             \
+      W##_storeu_ps(lo[1], yl);                                             \
+      W##_storeu_ps(hi[2], vxh);                                            \
+      W##_storeu_ps(lo[2], vxl);                                            \
+      W##_storeu_ps(hi[3], vyh);                                            \
+      W##_storeu_ps(lo[3], vyl);                                            \
+      joinPhysicsState(state, i, i + WIDTH, hi, lo);                        \
+   }
+
+// 8 satelites per instruction
+__attribute__((target("avx2")))
+static void stepSatelitesFloatAVX2(physicsState *state, int begin, int end,
+                                   const physicsParameters *p){
+   PHYSICS_FLOAT_KERNEL(__m256, _mm256, 8)
+   stepSatelitesFloatScalar(state, i, end, p);
+}
+
+// 16 satelites per instruction
+__attribute__((target("avx512f")))
+static void stepSatelitesFloatAVX512(physicsState *state, int begin, int end,
+                                     const physicsParameters *p){
+   PHYSICS_FLOAT_KERNEL(__m512, _mm512, 16)
+   stepSatelitesFloatAVX2(state, i, end, p);
+}
+
+#undef PHYSICS_FLOAT_KERNEL
+#undef PHYSICS_FLOAT_STEP
+
+#endif // PHYSICS_SIMD_X86
+
+// Picks the widest float kernel the CPU supports, PHYSICS_KERNEL forces
+// one like for selectPhysicsKernel()
+static inline physicsKernel selectFloatPhysicsKernel(void){
+
+   physicsKernel scalar = {stepSatelitesFloatScalar, 1, "float-scalar"};
+   const char *forced = getenv("PHYSICS_KERNEL");
+
+#ifdef PHYSICS_SIMD_X86
+   physicsKernel avx2 = {stepSatelitesFloatAVX2, 8, "float-avx2"};
+   physicsKernel avx512 = {stepSatelitesFloatAVX512, 16, "float-avx512"};
+
+   __builtin_cpu_init();
+   int hasAVX2 = __builtin_cpu_supports("avx2");
+   int hasAVX512 = __builtin_cpu_supports("avx512f");
+
+   if(forced != NULL && strcmp(forced, "scalar") == 0){
+      return scalar;
+   }
+   if(forced != NULL && strcmp(forced, "avx2") == 0 && hasAVX2){
+      return avx2;
+   }
+   if(hasAVX512){
+      return avx512;
+   }
+   if(hasAVX2){
+      return avx2;
+   }
+#else
+   (void)forced;
+#endif
+   return scalar;
+}
+
+#endif // COMMON_PHYSICS_FLOAT_H
@@ -0,0 +1,310 @@
+// Structure-of-arrays physics kernels shared by the CPU backends.
+//
+// The satelite state is kept in four separate aligned double arrays so the
+// per-step update can run 4 (AVX2) or 8 (AVX-512) satelites per
+// instruction. Every kernel performs exactly the same IEEE operations in
+// the same order as sequentialPhysicsEngine(): no FMA, no reciprocal
+// approximations. The results are therefore bit-identical to the
+// reference as long as the including file is built without -ffast-math
+// and without floating point contraction (the default for -std=c99).
+//
+// The including file must define _POSIX_C_SOURCE (200112L or newer) for
+// posix_memalign.
+
+#ifndef COMMON_PHYSICS_SIMD_H
+#define COMMON_PHYSICS_SIMD_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PHYSICS_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Alignment of the SoA arrays, one cache line and one AVX-512 register
+#define PHYSICS_ALIGNMENT 64
+
+// Constants of the integration, passed in so the kernels do not depend on
+// the macros of a particular backend
+typedef struct{
+   double centerX;          // Black hole position
+   double centerY;
+   double gravity;
+   double deltaTime;
+   double updatesPerFrame;  // Divisor of the time step, as a double
+   int updates;             // Number of Euler steps per frame
+} physicsParameters;
+
+// Structure-of-arrays satelite state used by the physics engine
+typedef struct{
+   double *x;
+   double *y;
+   double *vx;
+   double *vy;
+   int capacity;
+} physicsState;
+
+// Steps satelites [begin, end) of the state through one frame
+typedef void (*physicsKernelFunction)(physicsState *state, int begin,
+                                      int end, const physicsParameters *p);
+
+typedef struct{
+   physicsKernelFunction step;
+   int width;           // Satelites per vector, ranges should be multiples
+   const char *name;
+} physicsKernel;
+
+static inline void *allocateAligned(size_t size){
+   void *memory = NULL;
+   if(posix_memalign(&memory, PHYSICS_ALIGNMENT, size) != 0){
+      fprintf(stderr, "Failed to allocate %zu aligned bytes\n", size);
+      exit(EXIT_FAILURE);
+   }
+   return memory;
+}
+
+static inline void initPhysicsState(physicsState *state, int capacity){
+   // Rounded up to a full AVX-512 vector so kernels may use aligned loads
+   int padded = (capacity + 7) & ~7;
+   state->x = (double*)allocateAligned(sizeof(double) * padded);
+   state->y = (double*)allocateAligned(sizeof(double) * padded);
+   state->vx = (double*)allocateAligned(sizeof(double) * padded);
+   state->vy = (double*)allocateAligned(sizeof(double) * padded);
+   state->capacity = capacity;
+}
+
+static inline void freePhysicsState(physicsState *state){
+   free(state->x);
+   free(state->y);
+   free(state->vx);
+   free(state->vy);
+   state->x = state->y = state->vx = state->vy = NULL;
+   state->capacity = 0;
+}
+
+// Scalar kernel, the exact operation sequence of sequentialPhysicsEngine()
+static void stepSatelitesScalar(physicsState *state, int begin, int end,
+                                const physicsParameters *p){
+
+   for(int i = begin; i < end; ++i){
+      double x = state->x[i];
+      double y = state->y[i];
+      double vx = state->vx[i];
+      double vy = state->vy[i];
+
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < p->updates;
+          ++physicsUpdateIndex){
+
+         double px = x - p->centerX;
+         double py = y - p->centerY;
+         double distSquared = px * px + py * py;
+         double dist = sqrt(distSquared);
+
+         double nx = px / dist;
+         double ny = py / dist;
+         double accumulation = p->gravity / distSquared;
+
+         vx -= accumulation * nx * p->deltaTime / p->updatesPerFrame;
+         vy -= accumulation * ny * p->deltaTime / p->updatesPerFrame;
+
+         x += vx * p->deltaTime / p->updatesPerFrame;
+         y += vy * p->deltaTime / p->updatesPerFrame;
+      }
+
+      state->x[i] = x;
+      state->y[i] = y;
+      state->vx[i] = vx;
+      state->vy[i] = vy;
+   }
+}
+
+#ifdef PHYSICS_SIMD_X86
+
+// One Euler step for a vector of satelites. A macro so that the AVX2 and
+// AVX-512 kernels share the operation order, which must not change.
+#define PHYSICS_VECTOR_STEP(T, W, x, y, vx, vy)                             \
+   {                                                                        \
+      T px = W##_sub_pd(x, centerX);                                        \
+      T py = W##_sub_pd(y, centerY);                                        \
+      T distSquared = W##_add_pd(W##_mul_pd(px, px),                        \
+                                 W##_mul_pd(py, py));                       \
+      T dist = W##_sqrt_pd(distSquared);                                    \
+      T nx = W##_div_pd(px, dist);                                          \
+      T ny = W##_div_pd(py, dist);                                          \
+      T accumulation = W##_div_pd(gravity, distSquared);                    \
+      vx = W##_sub_pd(vx, W##_div_pd(W##_mul_pd(                            \
+              W##_mul_pd(accumulation, nx), deltaTime), updatesPerFrame));  \
+      vy = W##_sub_pd(vy, W##_div_pd(W##_mul_pd(                            \
+              W##_mul_pd(accumulation, ny), deltaTime), updatesPerFrame));  \
+      x = W##_add_pd(x, W##_div_pd(W##_mul_pd(vx, deltaTime),               \
+                                   updatesPerFrame));                       \
+      y = W##_add_pd(y, W##_div_pd(W##_mul_pd(vy, deltaTime),               \
+                                   updatesPerFrame));                       \
+   }
+
+// 4 satelites per instruction. Two vectors are stepped together so the
+// long sqrt/div dependency chains of one can hide the other's latency.
+__attribute__((target("avx2")))
+static void stepSatelitesAVX2(physicsState *state, int begin, int end,
+                              const physicsParameters *p){
+
+   const __m256d centerX = _mm256_set1_pd(p->centerX);
+   const __m256d centerY = _mm256_set1_pd(p->centerY);
+   const __m256d gravity = _mm256_set1_pd(p->gravity);
+   const __m256d deltaTime = _mm256_set1_pd(p->deltaTime);
+   const __m256d updatesPerFrame = _mm256_set1_pd(p->updatesPerFrame);
+   int i = begin;
+
+   for(; i + 8 <= end; i += 8){
+      __m256d x0 = _mm256_loadu_pd(&state->x[i]);
+      __m256d y0 = _mm256_loadu_pd(&state->y[i]);
+      __m256d vx0 = _mm256_loadu_pd(&state->vx[i]);
+      __m256d vy0 = _mm256_loadu_pd(&state->vy[i]);
+      __m256d x1 = _mm256_loadu_pd(&state->x[i + 4]);
+      __m256d y1 = _mm256_loadu_pd(&state->y[i + 4]);
+      __m256d vx1 = _mm256_loadu_pd(&state->vx[i + 4]);
+      __m256d vy1 = _mm256_loadu_pd(&state->vy[i + 4]);
+
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < p->updates;
+          ++physicsUpdateIndex){
+         PHYSICS_VECTOR_STEP(__m256d, _mm256, x0, y0, vx0, vy0)
+         PHYSICS_VECTOR_STEP(__m256d, _mm256, x1, y1, vx1, vy1)
+      }
+
+      _mm256_storeu_pd(&state->x[i], x0);
+      _mm256_storeu_pd(&state->y[i], y0);
+      _mm256_storeu_pd(&state->vx[i], vx0);
+      _mm256_storeu_pd(&state->vy[i], vy0);
+      _mm256_storeu_pd(&state->x[i + 4], x1);
+      _mm256_storeu_pd(&state->y[i + 4], y1);
+      _mm256_storeu_pd(&state->vx[i + 4], vx1);
+      _mm256_storeu_pd(&state->vy[i + 4], vy1);
+   }
+
+   for(; i + 4 <= end; i += 4){
+      __m256d x0 = _mm256_loadu_pd(&state->x[i]);
+      __m256d y0 = _mm256_loadu_pd(&state->y[i]);
+      __m256d vx0 = _mm256_loadu_pd(&state->vx[i]);
+      __m256d vy0 = _mm256_loadu_pd(&state->vy[i]);
+
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < p->updates;
+          ++physicsUpdateIndex){
+         PHYSICS_VECTOR_STEP(__m256d, _mm256, x0, y0, vx0, vy0)
+      }
+
+      _mm256_storeu_pd(&state->x[i], x0);
+      _mm256_storeu_pd(&state->y[i], y0);
+      _mm256_storeu_pd(&state->vx[i], vx0);
+      _mm256_storeu_pd(&state->vy[i], vy0);
+   }
+
+   stepSatelitesScalar(state, i, end, p);
+}
+
+// 8 satelites per instruction, otherwise the same as the AVX2 kernel
+__attribute__((target("avx512f")))
+static void stepSatelitesAVX512(physicsState *state, int begin, int end,
+                                const physicsParameters *p){
+
+   const __m512d centerX = _mm512_set1_pd(p->centerX);
+   const __m512d centerY = _mm512_set1_pd(p->centerY);
+   const __m512d gravity = _mm512_set1_pd(p->gravity);
+   const __m512d deltaTime = _mm512_set1_pd(p->deltaTime);
+   const __m512d updatesPerFrame = _mm512_set1_pd(p->updatesPerFrame);
+   int i = begin;
+
+   for(; i + 16 <= end; i += 16){
+      __m512d x0 = _mm512_loadu_pd(&state->x[i]);
+      __m512d y0 = _mm512_loadu_pd(&state->y[i]);
+      __m512d vx0 = _mm512_loadu_pd(&state->vx[i]);
+      __m512d vy0 = _mm512_loadu_pd(&state->vy[i]);
+      __m512d x1 = _mm512_loadu_pd(&state->x[i + 8]);
+      __m512d y1 = _mm512_loadu_pd(&state->y[i + 8]);
+      __m512d vx1 = _mm512_loadu_pd(&state->vx[i + 8]);
+      __m512d vy1 = _mm512_loadu_pd(&state->vy[i + 8]);
+
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < p->updates;
+          ++physicsUpdateIndex){
+         PHYSICS_VECTOR_STEP(__m512d, _mm512, x0, y0, vx0, vy0)
+         PHYSICS_VECTOR_STEP(__m512d, _mm512, x1, y1, vx1, vy1)
+      }
+
+      _mm512_storeu_pd(&state->x[i], x0);
+      _mm512_storeu_pd(&state->y[i], y0);
+      _mm512_storeu_pd(&state->vx[i], vx0);
+      _mm512_storeu_pd(&state->vy[i], vy0);
+      _mm512_storeu_pd(&state->x[i + 8], x1);
+      _mm512_storeu_pd(&state->y[i + 8], y1);
+      _mm512_storeu_pd(&state->vx[i + 8], vx1);
+      _mm512_storeu_pd(&state->vy[i + 8], vy1);
+   }
+
+   for(; i + 8 <= end; i += 8){
+      __m512d x0 = _mm512_loadu_pd(&state->x[i]);
+      __m512d y0 = _mm512_loadu_pd(&state->y[i]);
+      __m512d vx0 = _mm512_loadu_pd(&state->vx[i]);
+      __m512d vy0 = _mm512_loadu_pd(&state->vy[i]);
+
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < p->updates;
+          ++physicsUpdateIndex){
+         PHYSICS_VECTOR_STEP(__m512d, _mm512, x0, y0, vx0, vy0)
+      }
+
+      _mm512_storeu_pd(&state->x[i], x0);
+      _mm512_storeu_pd(&state->y[i], y0);
+      _mm512_storeu_pd(&state->vx[i], vx0);
+      _mm512_storeu_pd(&state->vy[i], vy0);
+   }
+
+   // Remaining satelites fall back to 4 wide and scalar
+   stepSatelitesAVX2(state, i, end, p);
+}
+
+#undef PHYSICS_VECTOR_STEP
+
+#endif // PHYSICS_SIMD_X86
+
+// Picks the widest kernel the CPU supports. PHYSICS_KERNEL=scalar|avx2|avx512
+// in the environment forces a specific kernel for comparisons.
+static inline physicsKernel selectPhysicsKernel(void){
+
+   physicsKernel scalar = {stepSatelitesScalar, 1, "scalar"};
+   const char *forced = getenv("PHYSICS_KERNEL");
+
+#ifdef PHYSICS_SIMD_X86
+   physicsKernel avx2 = {stepSatelitesAVX2, 4, "avx2"};
+   physicsKernel avx512 = {stepSatelitesAVX512, 8, "avx512"};
+
+   __builtin_cpu_init();
+   int hasAVX2 = __builtin_cpu_supports("avx2");
+   int hasAVX512 = __builtin_cpu_supports("avx512f");
+
+   if(forced != NULL){
+      if(strcmp(forced, "avx512") == 0 && hasAVX512){
+         return avx512;
+      }
+      if(strcmp(forced, "avx2") == 0 && hasAVX2){
+         return avx2;
+      }
+      if(strcmp(forced, "scalar") == 0){
+         return scalar;
+      }
+      fprintf(stderr, "PHYSICS_KERNEL=%s not available, using default\n",
+              forced);
+   }
+   if(hasAVX512){
+      return avx512;
+   }
+   if(hasAVX2){
+      return avx2;
+   }
+#else
+   (void)forced;
+#endif
+   return scalar;
+}
+
+#endif // COMMON_PHYSICS_SIMD_H
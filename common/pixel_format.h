@@ -0,0 +1,73 @@
+// Packed 8-bit RGBA framebuffer (--pixel-format rgba8).
+//
+// The float framebuffer stores 12 bytes per pixel. In rgba8 mode the
+// graphics engines quantize in the engine and store 4 bytes per pixel:
+// every channel is clamped to [0, 1], scaled by 255 and rounded to
+// nearest even, alpha is 255. glDrawPixels takes the buffer as
+// GL_RGBA/GL_UNSIGNED_BYTE and the error check quantizes the reference
+// the same way before comparing.
+//
+// The CPU engines still shade a span into a small float buffer that stays
+// in L1 and pack it with convertSpanRGBA8(); only the packed pixels reach
+// the framebuffer.
+
+#ifndef COMMON_PIXEL_FORMAT_H
+#define COMMON_PIXEL_FORMAT_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#define PIXEL_FORMAT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define PIXEL_FORMAT_FLOAT 0
+#define PIXEL_FORMAT_RGBA8 1
+
+static inline unsigned char quantizeChannel(float value){
+   value = value < 0.f ? 0.f : (value > 1.f ? 1.f : value);
+   return (unsigned char)lrintf(value * 255.f);
+}
+
+static inline unsigned char *allocateRGBA8(int pixelCount){
+   return (unsigned char*)malloc((size_t)pixelCount * 4);
+}
+
+// Packs count pixels of interleaved float RGB into RGBA8
+static inline void convertSpanRGBA8(const float *rgb, unsigned char *rgba,
+                                    int count){
+   int i = 0;
+#ifdef PIXEL_FORMAT_SSE2
+   // One pixel per iteration: the four floats loaded at a pixel are its
+   // red, green and blue plus the next pixel's red, so the last pixel is
+   // left to the scalar loop
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 one = _mm_set1_ps(1.f);
+   const __m128 scale = _mm_set1_ps(255.f);
+   for(; i + 1 < count; ++i){
+      __m128 value = _mm_loadu_ps(rgb + 3 * i);
+      value = _mm_min_ps(_mm_max_ps(value, zero), one);
+      __m128i words = _mm_cvtps_epi32(_mm_mul_ps(value, scale));
+      words = _mm_packs_epi32(words, words);
+      int packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+      unsigned int pixel = ((unsigned int)packed & 0x00FFFFFFu) | 0xFF000000u;
+      memcpy(rgba + 4 * i, &pixel, 4);
+   }
+#endif
+   for(; i < count; ++i){
+      rgba[4 * i] = quantizeChannel(rgb[3 * i]);
+      rgba[4 * i + 1] = quantizeChannel(rgb[3 * i + 1]);
+      rgba[4 * i + 2] = quantizeChannel(rgb[3 * i + 2]);
+      rgba[4 * i + 3] = 255;
+   }
+}
+
+// Maximum difference of a quantized channel from the quantized reference
+// that the error check accepts, for a float tolerance
+static inline int quantizedTolerance(double floatTolerance){
+   return (int)(floatTolerance * 255.0 + 0.5);
+}
+
+#endif // COMMON_PIXEL_FORMAT_H
@@ -0,0 +1,51 @@
+// Structure-of-arrays snapshot of the satelites for the graphics engines.
+//
+// The backends copy position and color out of their satelite structs once
+// per frame, so the shaders and spatial structures in common/ do not
+// depend on the struct layout of a particular backend.
+
+#ifndef COMMON_RENDER_STATE_H
+#define COMMON_RENDER_STATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct{
+   float *x;
+   float *y;
+   float *red;
+   float *green;
+   float *blue;
+   int count;
+} renderSatelites;
+
+static inline float *allocateRenderArray(int count){
+   // Padded to 16 floats so vector shaders can read whole registers
+   float *array = NULL;
+   size_t padded = ((size_t)count + 15) & ~(size_t)15;
+   if(posix_memalign((void**)&array, 64, sizeof(float) * padded) != 0){
+      fprintf(stderr, "Failed to allocate render snapshot\n");
+      exit(EXIT_FAILURE);
+   }
+   return array;
+}
+
+static inline void initRenderSatelites(renderSatelites *snapshot, int count){
+   snapshot->x = allocateRenderArray(count);
+   snapshot->y = allocateRenderArray(count);
+   snapshot->red = allocateRenderArray(count);
+   snapshot->green = allocateRenderArray(count);
+   snapshot->blue = allocateRenderArray(count);
+   snapshot->count = count;
+}
+
+static inline void freeRenderSatelites(renderSatelites *snapshot){
+   free(snapshot->x);
+   free(snapshot->y);
+   free(snapshot->red);
+   free(snapshot->green);
+   free(snapshot->blue);
+   snapshot->count = 0;
+}
+
+#endif // COMMON_RENDER_STATE_H
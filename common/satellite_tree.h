@@ -0,0 +1,570 @@
+// Quadtree over the satelites for sublinear pixel shading.
+//
+// The tree is rebuilt once per frame from a renderSatelites snapshot. The
+// graphics engine asks it once per tile (collectTreeTile) for two lists:
+//
+//  - The satelites that can be nearest to a pixel of the tile. Searching
+//    them gives the nearest satelite and the SATELITE_RADIUS hit of every
+//    pixel exactly, ties go to the lower satelite index.
+//
+//  - The sources of the 1/d^4 weighted sum of all satelite colors. Distant
+//    nodes are replaced by their centroid (Barnes-Hut) when
+//    size / distance < theta for every pixel of the tile. theta is an
+//    opening angle, not an error bound: the first order error of the
+//    monopole cancels around the centroid, so the relative error of a
+//    node's weight is about 10 * theta^2 in the worst case, and far nodes
+//    carry little of the total weight. theta = 0 makes the sum exact.
+//
+// shadeTreeSpan() then colors the pixels of a row with flat loops over the
+// two lists, like the brute force shaders do over all satelites.
+//
+// The N-body physics mode reuses the tree for the Barnes-Hut gravity
+// between the satelites (treeAcceleration).
+
+#ifndef COMMON_SATELLITE_TREE_H
+#define COMMON_SATELLITE_TREE_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "render_state.h"
+
+// Nodes with at most this many satelites are not split further
+#define TREE_LEAF_SIZE 4
+// Guards against unbounded depth when satelites share a position
+#define TREE_MAX_DEPTH 24
+// Pending nodes of a traversal: 3 siblings per level plus the root
+#define TREE_STACK_SIZE (3 * TREE_MAX_DEPTH + 4)
+
+typedef struct{
+   float x0, y0, size;      // Square covered by the node
+   float centerX, centerY;  // Centroid of the satelites
+   float red, green, blue;  // Sum of the satelite colors
+   int count;
+   int begin, end;          // Satelites order[begin..end)
+   int firstChild;          // Four consecutive children, -1 for leaves
+} treeNode;
+
+typedef struct{
+   treeNode *nodes;
+   int nodeCount;
+   int nodeCapacity;
+   int *order;              // Satelite indices grouped by node
+   int orderCapacity;
+} sateliteTree;
+
+static inline void initSateliteTree(sateliteTree *tree){
+   tree->nodes = NULL;
+   tree->nodeCount = 0;
+   tree->nodeCapacity = 0;
+   tree->order = NULL;
+   tree->orderCapacity = 0;
+}
+
+static inline void freeSateliteTree(sateliteTree *tree){
+   free(tree->nodes);
+   free(tree->order);
+   initSateliteTree(tree);
+}
+
+static inline int allocateTreeNodes(sateliteTree *tree, int count){
+   if(tree->nodeCount + count > tree->nodeCapacity){
+      int capacity = tree->nodeCapacity ? tree->nodeCapacity * 2 : 64;
+      while(capacity < tree->nodeCount + count){
+         capacity *= 2;
+      }
+      tree->nodes = (treeNode*)realloc(tree->nodes,
+                                       sizeof(treeNode) * capacity);
+      if(tree->nodes == NULL){
+         fprintf(stderr, "Failed to grow satelite tree\n");
+         exit(EXIT_FAILURE);
+      }
+      tree->nodeCapacity = capacity;
+   }
+   tree->nodeCount += count;
+   return tree->nodeCount - count;
+}
+
+// Moves the indices in order[begin..end) whose coordinate is below split
+// to the front and returns the first index of the rest
+static inline int partitionTreeOrder(int *order, int begin, int end,
+                                     const float *coordinate, float split){
+   int i = begin;
+   int j = end - 1;
+   while(i <= j){
+      if(coordinate[order[i]] < split){
+         ++i;
+      } else {
+         int tmp = order[i];
+         order[i] = order[j];
+         order[j] = tmp;
+         --j;
+      }
+   }
+   return i;
+}
+
+static void buildTreeNode(sateliteTree *tree, const renderSatelites *s,
+                          int nodeIndex, int depth){
+
+   treeNode node = tree->nodes[nodeIndex];
+   node.count = node.end - node.begin;
+   node.red = node.green = node.blue = 0.f;
+   node.centerX = node.centerY = 0.f;
+   node.firstChild = -1;
+
+   // Aggregates for the far field approximation
+   for(int k = node.begin; k < node.end; ++k){
+      int j = tree->order[k];
+      node.centerX += s->x[j];
+      node.centerY += s->y[j];
+      node.red += s->red[j];
+      node.green += s->green[j];
+      node.blue += s->blue[j];
+   }
+   if(node.count > 0){
+      node.centerX /= node.count;
+      node.centerY /= node.count;
+   }
+
+   if(node.count > TREE_LEAF_SIZE && depth < TREE_MAX_DEPTH){
+      float half = node.size * 0.5f;
+      float splitX = node.x0 + half;
+      float splitY = node.y0 + half;
+
+      // Split into bottom/top, then each half into left/right
+      int middle = partitionTreeOrder(tree->order, node.begin, node.end,
+                                      s->y, splitY);
+      int bottomMiddle = partitionTreeOrder(tree->order, node.begin, middle,
+                                            s->x, splitX);
+      int topMiddle = partitionTreeOrder(tree->order, middle, node.end,
+                                         s->x, splitX);
+      int bounds[5] = {node.begin, bottomMiddle, middle, topMiddle, node.end};
+
+      node.firstChild = allocateTreeNodes(tree, 4);
+      for(int c = 0; c < 4; ++c){
+         treeNode *child = &tree->nodes[node.firstChild + c];
+         child->x0 = node.x0 + ((c & 1) ? half : 0.f);
+         child->y0 = node.y0 + ((c & 2) ? half : 0.f);
+         child->size = half;
+         child->begin = bounds[c];
+         child->end = bounds[c + 1];
+      }
+      tree->nodes[nodeIndex] = node;
+      for(int c = 0; c < 4; ++c){
+         buildTreeNode(tree, s, node.firstChild + c, depth + 1);
+      }
+      return;
+   }
+   tree->nodes[nodeIndex] = node;
+}
+
+// Rebuilds the tree for the current satelite positions
+static inline void buildSateliteTree(sateliteTree *tree,
+                                     const renderSatelites *s){
+
+   if(tree->orderCapacity < s->count){
+      tree->order = (int*)realloc(tree->order, sizeof(int) * s->count);
+      if(tree->order == NULL){
+         fprintf(stderr, "Failed to allocate satelite tree\n");
+         exit(EXIT_FAILURE);
+      }
+      tree->orderCapacity = s->count;
+   }
+
+   float minX = INFINITY, minY = INFINITY;
+   float maxX = -INFINITY, maxY = -INFINITY;
+   for(int j = 0; j < s->count; ++j){
+      tree->order[j] = j;
+      minX = fminf(minX, s->x[j]);
+      minY = fminf(minY, s->y[j]);
+      maxX = fmaxf(maxX, s->x[j]);
+      maxY = fmaxf(maxY, s->y[j]);
+   }
+
+   tree->nodeCount = 0;
+   int root = allocateTreeNodes(tree, 1);
+   treeNode *node = &tree->nodes[root];
+   // Slightly enlarged so the maximum coordinates fall inside the square
+   node->x0 = minX;
+   node->y0 = minY;
+   node->size = fmaxf(maxX - minX, maxY - minY) * 1.0001f + 1.f;
+   node->begin = 0;
+   node->end = s->count;
+   buildTreeNode(tree, s, root, 0);
+}
+
+// Pixels of a tile row shaded per pass over the tile lists
+#define TREE_SPAN_CHUNK 64
+// Squared distances within this factor of the shortest one may round to
+// the same distance; it is a few float steps wider than needed
+#define TREE_TIE_FACTOR (1.0f + 0x1p-20f)
+
+// What the pixels of one tile need from the tree, collected once per tile
+// so the per pixel loops are flat and run across neighbouring pixels:
+//  - sources: the satelites near the tile and the far field nodes, a node
+//    at its centroid with its satelite count and color sums,
+//  - nearest: the satelites that can be the nearest one of some pixel of
+//    the tile, in ascending index order.
+typedef struct{
+   float *x, *y;
+   float *count;
+   float *red, *green, *blue;
+   int sourceCount;
+   int *nearest;
+   int nearestCount;
+} treeTile;
+
+// A tile holds at most capacity sources, the sources cover disjoint sets
+// of satelites
+static inline void initTreeTile(treeTile *tile, int capacity){
+   tile->x = allocateRenderArray(capacity);
+   tile->y = allocateRenderArray(capacity);
+   tile->count = allocateRenderArray(capacity);
+   tile->red = allocateRenderArray(capacity);
+   tile->green = allocateRenderArray(capacity);
+   tile->blue = allocateRenderArray(capacity);
+   tile->nearest = (int*)malloc(sizeof(int) * capacity);
+   if(tile->nearest == NULL){
+      fprintf(stderr, "Failed to allocate tree tile\n");
+      exit(EXIT_FAILURE);
+   }
+   tile->sourceCount = 0;
+   tile->nearestCount = 0;
+}
+
+static inline void freeTreeTile(treeTile *tile){
+   free(tile->x);
+   free(tile->y);
+   free(tile->count);
+   free(tile->red);
+   free(tile->green);
+   free(tile->blue);
+   free(tile->nearest);
+}
+
+static inline void addTreeSource(treeTile *tile, float x, float y,
+                                 float count, float red, float green,
+                                 float blue){
+   int k = tile->sourceCount++;
+   tile->x[k] = x;
+   tile->y[k] = y;
+   tile->count[k] = count;
+   tile->red[k] = red;
+   tile->green[k] = green;
+   tile->blue[k] = blue;
+}
+
+// Larger of two numbers, a compare the compiler inlines unlike fmaxf()
+static inline float treeMax(float a, float b){
+   return a > b ? a : b;
+}
+
+// Squared distance from a point to the pixel centers [x0, x1] x [y0, y1],
+// 0 inside
+static inline float treeRectDistance2(float x0, float y0, float x1, float y1,
+                                      float px, float py){
+   float dx = treeMax(treeMax(x0 - px, 0.f), px - x1);
+   float dy = treeMax(treeMax(y0 - py, 0.f), py - y1);
+   return dx * dx + dy * dy;
+}
+
+// Fills tile with the lists of the pixels [x0, x1) x [y0, y1).
+//
+// A node becomes a far field source when size < theta * distance holds for
+// the pixel of the tile nearest to its centroid, so it holds for every
+// pixel and the tile sees at most the error of a per pixel traversal.
+//
+// A satelite is a nearest candidate unless its closest pixel of the tile
+// is farther than the farthest pixel of some other satelite, by more than
+// TREE_TIE_FACTOR. Rounding is monotonic, so a dropped satelite is farther
+// than that one at every pixel, also after rounding the distance, and the
+// candidates give the nearest satelite of the reference engine.
+static inline void collectTreeTile(treeTile *tile, const sateliteTree *tree,
+                                   const renderSatelites *s, float theta,
+                                   int x0, int y0, int x1, int y1){
+
+   const float left = (float)x0, bottom = (float)y0;
+   const float right = (float)(x1 - 1), top = (float)(y1 - 1);
+
+   float bound = INFINITY;
+   for(int j = 0; j < s->count; ++j){
+      float dx = treeMax(fabsf(left - s->x[j]), fabsf(right - s->x[j]));
+      float dy = treeMax(fabsf(bottom - s->y[j]), fabsf(top - s->y[j]));
+      float far2 = dx * dx + dy * dy;
+      bound = far2 < bound ? far2 : bound;
+   }
+   bound *= TREE_TIE_FACTOR;
+   tile->nearestCount = 0;
+   for(int j = 0; j < s->count; ++j){
+      if(treeRectDistance2(left, bottom, right, top, s->x[j], s->y[j])
+         <= bound){
+         tile->nearest[tile->nearestCount++] = j;
+      }
+   }
+
+   float theta2 = theta * theta;
+   int stack[TREE_STACK_SIZE];
+   int stackTop = 0;
+   stack[stackTop++] = 0;
+   tile->sourceCount = 0;
+
+   while(stackTop > 0){
+      const treeNode *node = &tree->nodes[stack[--stackTop]];
+      if(node->count == 0){
+         continue;
+      }
+
+      float dist2 = treeRectDistance2(left, bottom, right, top,
+                                      node->centerX, node->centerY);
+      if(node->count > 1 && node->size * node->size < theta2 * dist2){
+         addTreeSource(tile, node->centerX, node->centerY,
+                       (float)node->count, node->red, node->green,
+                       node->blue);
+      } else if(node->firstChild < 0){
+         for(int k = node->begin; k < node->end; ++k){
+            int j = tree->order[k];
+            addTreeSource(tile, s->x[j], s->y[j], 1.f, s->red[j],
+                          s->green[j], s->blue[j]);
+         }
+      } else {
+         for(int c = 0; c < 4; ++c){
+            stack[stackTop++] = node->firstChild + c;
+         }
+      }
+   }
+}
+
+// The next float up of a non-negative finite x
+static inline float treeNextFloat(float x){
+   uint32_t bits;
+   memcpy(&bits, &x, sizeof(bits));
+   ++bits;
+   memcpy(&x, &bits, sizeof(x));
+   return x;
+}
+
+// Smallest squared distance whose square root is not below radius, so the
+// hit test of the reference needs no square root per pixel
+static inline float treeHitLimit(float radius){
+   float limit = radius * radius;
+   while(limit > 0.f && sqrtf(nextafterf(limit, 0.f)) >= radius){
+      limit = nextafterf(limit, 0.f);
+   }
+   while(sqrtf(limit) < radius){
+      limit = treeNextFloat(limit);
+   }
+   return limit;
+}
+
+// Nearest satelite of the pixel like the reference engine: the lowest
+// candidate index among those at the shortest rounded distance. Only used
+// for the rare pixels where two candidates are that close.
+static inline int treeNearestTie(const treeTile *tile,
+                                 const renderSatelites *s, float px,
+                                 float py){
+   float shortest = INFINITY;
+   int nearest = 0;
+   for(int k = 0; k < tile->nearestCount; ++k){
+      int j = tile->nearest[k];
+      float dx = px - s->x[j];
+      float dy = py - s->y[j];
+      float distance = sqrtf(dx * dx + dy * dy);
+      if(distance < shortest){
+         shortest = distance;
+         nearest = j;
+      }
+   }
+   return nearest;
+}
+
+// Colors pixels [begin, end) of row from the lists of its tile, like the
+// pixel shaders in shader_simd.h. The loops run over up to TREE_SPAN_CHUNK
+// pixels for one source, so the compiler vectorizes them for the target of
+// the caller. The nearest satelite is searched by the squared distance;
+// pixels where a lower candidate index comes within TREE_TIE_FACTOR of it
+// are searched again with the rounded distance of the reference.
+__attribute__((always_inline))
+static inline void shadeTreeSpanBody(const treeTile *tile,
+                                     const renderSatelites *s, float radius,
+                                     int row, int begin, int end, float *out){
+
+   float red[TREE_SPAN_CHUNK], green[TREE_SPAN_CHUNK];
+   float blue[TREE_SPAN_CHUNK], weights[TREE_SPAN_CHUNK];
+   float shortest[TREE_SPAN_CHUNK];
+   int nearest[TREE_SPAN_CHUNK], tie[TREE_SPAN_CHUNK];
+   const float py = (float)row;
+   const float hitLimit = treeHitLimit(radius);
+
+   for(int chunk = begin; chunk < end; chunk += TREE_SPAN_CHUNK){
+      int width = end - chunk < TREE_SPAN_CHUNK ? end - chunk
+                                                : TREE_SPAN_CHUNK;
+      for(int c = 0; c < width; ++c){
+         red[c] = green[c] = blue[c] = weights[c] = 0.f;
+         shortest[c] = INFINITY;
+         nearest[c] = 0;
+         tie[c] = 0;
+      }
+
+      for(int k = 0; k < tile->sourceCount; ++k){
+         const float sx = tile->x[k];
+         const float dy = py - tile->y[k];
+         const float count = tile->count[k];
+         const float sourceRed = tile->red[k];
+         const float sourceGreen = tile->green[k];
+         const float sourceBlue = tile->blue[k];
+         for(int c = 0; c < width; ++c){
+            float dx = (float)(chunk + c) - sx;
+            float dist2 = dx * dx + dy * dy;
+            float weight = 1.0f / (dist2 * dist2);
+            weights[c] += count * weight;
+            red[c] += sourceRed * weight;
+            green[c] += sourceGreen * weight;
+            blue[c] += sourceBlue * weight;
+         }
+      }
+
+      for(int k = 0; k < tile->nearestCount; ++k){
+         const int j = tile->nearest[k];
+         const float sx = s->x[j];
+         const float dy = py - s->y[j];
+         for(int c = 0; c < width; ++c){
+            float dx = (float)(chunk + c) - sx;
+            float dist2 = dx * dx + dy * dy;
+            int closer = dist2 < shortest[c];
+            shortest[c] = closer ? dist2 : shortest[c];
+            nearest[c] = closer ? j : nearest[c];
+         }
+      }
+      if(tile->nearestCount > 1){
+         for(int k = 0; k < tile->nearestCount; ++k){
+            const int j = tile->nearest[k];
+            const float sx = s->x[j];
+            const float dy = py - s->y[j];
+            for(int c = 0; c < width; ++c){
+               float dx = (float)(chunk + c) - sx;
+               float dist2 = dx * dx + dy * dy;
+               tie[c] |= j < nearest[c] &&
+                         dist2 <= shortest[c] * TREE_TIE_FACTOR;
+            }
+         }
+         for(int c = 0; c < width; ++c){
+            if(tie[c]){
+               nearest[c] = treeNearestTie(tile, s, (float)(chunk + c), py);
+            }
+         }
+      }
+
+      for(int c = 0; c < width; ++c){
+         int hit = shortest[c] < hitLimit;
+         int j = nearest[c];
+         red[c] = hit ? 1.0f : s->red[j] + red[c] / weights[c] * 3.0f;
+         green[c] = hit ? 1.0f : s->green[j] + green[c] / weights[c] * 3.0f;
+         blue[c] = hit ? 1.0f : s->blue[j] + blue[c] / weights[c] * 3.0f;
+      }
+      for(int c = 0; c < width; ++c, out += 3){
+         out[0] = red[c];
+         out[1] = green[c];
+         out[2] = blue[c];
+      }
+   }
+}
+
+typedef void (*treeSpanFunction)(const treeTile *tile,
+                                 const renderSatelites *s, float radius,
+                                 int row, int begin, int end, float *out);
+
+static void shadeTreeSpan(const treeTile *tile, const renderSatelites *s,
+                          float radius, int row, int begin, int end,
+                          float *out){
+   shadeTreeSpanBody(tile, s, radius, row, begin, end, out);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("avx2,fma")))
+static void shadeTreeSpanAVX2(const treeTile *tile, const renderSatelites *s,
+                              float radius, int row, int begin, int end,
+                              float *out){
+   shadeTreeSpanBody(tile, s, radius, row, begin, end, out);
+}
+
+__attribute__((target("avx512f")))
+static void shadeTreeSpanAVX512(const treeTile *tile,
+                                const renderSatelites *s, float radius,
+                                int row, int begin, int end, float *out){
+   shadeTreeSpanBody(tile, s, radius, row, begin, end, out);
+}
+#endif
+
+// Tree span shader for the instruction set of the selected pixel shader
+// (pixelShader.name of shader_simd.h)
+static inline treeSpanFunction selectTreeSpanShader(const char *shaderName){
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+   if(strcmp(shaderName, "avx512") == 0){
+      return shadeTreeSpanAVX512;
+   }
+   if(strcmp(shaderName, "avx2") == 0){
+      return shadeTreeSpanAVX2;
+   }
+#else
+   (void)shaderName;
+#endif
+   return shadeTreeSpan;
+}
+
+// Softened gravitational pull of all satelites on the point (px, py), per
+// unit of satelite G m, with the same opening criterion as
+// collectTreeTile(). A satelite at the point itself adds nothing.
+static inline void treeAcceleration(const sateliteTree *tree,
+                                    const renderSatelites *s,
+                                    double px, double py, float theta,
+                                    double softening2,
+                                    double *ax, double *ay){
+
+   double sumX = 0.0, sumY = 0.0;
+   float theta2 = theta * theta;
+   int stack[TREE_STACK_SIZE];
+   int top = 0;
+   stack[top++] = 0;
+
+   while(top > 0){
+      const treeNode *node = &tree->nodes[stack[--top]];
+      if(node->count == 0){
+         continue;
+      }
+
+      double dx = node->centerX - px;
+      double dy = node->centerY - py;
+      double dist2 = dx * dx + dy * dy;
+
+      if(node->count > 1 && node->size * node->size < theta2 * dist2){
+         // Far field: the node's total mass at its centroid
+         double inverse = 1.0 / sqrt(dist2 + softening2);
+         double scale = node->count * inverse * inverse * inverse;
+         sumX += dx * scale;
+         sumY += dy * scale;
+      } else if(node->firstChild < 0){
+         for(int k = node->begin; k < node->end; ++k){
+            int j = tree->order[k];
+            double sx = s->x[j] - px;
+            double sy = s->y[j] - py;
+            double inverse = 1.0 / sqrt(sx * sx + sy * sy + softening2);
+            double scale = inverse * inverse * inverse;
+            sumX += sx * scale;
+            sumY += sy * scale;
+         }
+      } else {
+         for(int c = 0; c < 4; ++c){
+            stack[top++] = node->firstChild + c;
+         }
+      }
+   }
+
+   *ax = sumX;
+   *ay = sumY;
+}
+
+#endif // COMMON_SATELLITE_TREE_H
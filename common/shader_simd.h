@@ -0,0 +1,335 @@
+// Vectorized pixel shaders shared by the CPU backends.
+//
+// A shader colors the pixels [begin, end) of one row from a renderSatelites
+// snapshot. The vector kernels put 8 (AVX2) or 16 (AVX-512) neighbouring
+// pixels in the lanes of a register and walk the satelites once:
+//
+//  - a lane that comes within the satelite radius is marked in a hit mask
+//    and ends up white; the loop stops early once every lane has hit,
+//  - the nearest satelite is tracked with a masked compare and blend, with
+//    a strict compare so ties keep the lower satelite index,
+//  - both compare the correctly rounded distance computed like the
+//    reference engine, so pixels on the satelite rim and ties between
+//    satelites come out exactly as there,
+//  - the 1/d^4 weight comes from the reciprocal square root refined by one
+//    Newton step and the color sums use FMA.
+//
+// The vector results are therefore not bit-identical to the reference
+// engine, but the relative error of a weight is about 1e-6, far below
+// ALLOWED_FP_ERROR. The scalar shader uses the hit, nearest-satelite and
+// weight logic of the reference in a single pass over the satelites, so it
+// sums color * weight and divides by the total weight once instead of per
+// satelite; it is close to the reference but not bit-identical either.
+//
+// The vector shaders have a copy for DEFAULT_SATELITE_COUNT satelites with
+// a compile-time loop bound, used whenever the snapshot has that many.
+//
+// Output pixels are written as consecutive red, green, blue floats, which
+// is the layout of the color struct of every backend.
+
+#ifndef COMMON_SHADER_SIMD_H
+#define COMMON_SHADER_SIMD_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h" // DEFAULT_SATELITE_COUNT
+#include "render_state.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHADER_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Colors pixels [begin, end) of row; out points to the red value of the
+// pixel at column begin
+typedef void (*pixelShaderFunction)(const renderSatelites *s, float radius,
+                                    int row, int begin, int end, float *out);
+
+typedef struct{
+   pixelShaderFunction shade;
+   const char *name;
+} pixelShader;
+
+// Scalar shader, the hit, nearest-satelite and weight logic of
+// sequentialGraphicsEngine() in one pass over the satelites
+static void shadeSpanScalar(const renderSatelites *s, float radius,
+                            int row, int begin, int end, float *out){
+
+   for(int column = begin; column < end; ++column, out += 3){
+      float red = 0.f, green = 0.f, blue = 0.f;
+      float nearestRed = 0.f, nearestGreen = 0.f, nearestBlue = 0.f;
+      float shortestDistance = INFINITY;
+      float weights = 0.f;
+      int hitsSatellite = 0;
+
+      for(int j = 0; j < s->count; ++j){
+         float dx = (float)column - s->x[j];
+         float dy = (float)row - s->y[j];
+         float distance = sqrtf(dx * dx + dy * dy);
+         if(distance < radius){
+            hitsSatellite = 1;
+            break;
+         }
+         float weight = 1.0f / (distance*distance*distance*distance);
+         weights += weight;
+         if(distance < shortestDistance){
+            shortestDistance = distance;
+            nearestRed = s->red[j];
+            nearestGreen = s->green[j];
+            nearestBlue = s->blue[j];
+         }
+         red += s->red[j] * weight;
+         green += s->green[j] * weight;
+         blue += s->blue[j] * weight;
+      }
+
+      if(hitsSatellite){
+         out[0] = out[1] = out[2] = 1.0f;
+      } else {
+         out[0] = nearestRed + red / weights * 3.0f;
+         out[1] = nearestGreen + green / weights * 3.0f;
+         out[2] = nearestBlue + blue / weights * 3.0f;
+      }
+   }
+}
+
+#ifdef SHADER_SIMD_X86
+
+// Writes the first count lanes of three color vectors as interleaved pixels
+static inline void storeShadedPixels(const float *red, const float *green,
+                                     const float *blue, int count,
+                                     float *out){
+   for(int lane = 0; lane < count; ++lane){
+      out[3 * lane] = red[lane];
+      out[3 * lane + 1] = green[lane];
+      out[3 * lane + 2] = blue[lane];
+   }
+}
+
+// 8 pixels per instruction. Always inlined into shadeSpanAVX2() so the
+// default satelite count becomes a constant loop bound.
+__attribute__((target("avx2,fma"), always_inline))
+static inline void shadeSpanAVX2Count(const renderSatelites *s, float radius,
+                                      int row, int begin, int end, float *out,
+                                      int count){
+
+   const __m256 lanes = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+   const __m256 radiusV = _mm256_set1_ps(radius);
+   const __m256 py = _mm256_set1_ps((float)row);
+   const __m256 half = _mm256_set1_ps(0.5f);
+   const __m256 threeHalves = _mm256_set1_ps(1.5f);
+   const __m256 three = _mm256_set1_ps(3.0f);
+   const __m256 one = _mm256_set1_ps(1.0f);
+
+   for(int column = begin; column < end; column += 8, out += 24){
+      __m256 px = _mm256_add_ps(_mm256_set1_ps((float)column), lanes);
+      __m256 shortest = _mm256_set1_ps(INFINITY);
+      __m256 nearestRed = _mm256_setzero_ps();
+      __m256 nearestGreen = _mm256_setzero_ps();
+      __m256 nearestBlue = _mm256_setzero_ps();
+      __m256 red = _mm256_setzero_ps();
+      __m256 green = _mm256_setzero_ps();
+      __m256 blue = _mm256_setzero_ps();
+      __m256 weights = _mm256_setzero_ps();
+      __m256 hit = _mm256_setzero_ps();
+
+      for(int j = 0; j < count; ++j){
+         __m256 dx = _mm256_sub_ps(px, _mm256_set1_ps(s->x[j]));
+         __m256 dy = _mm256_sub_ps(py, _mm256_set1_ps(s->y[j]));
+         __m256 dist2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+         __m256 distance = _mm256_sqrt_ps(dist2);
+
+         hit = _mm256_or_ps(hit, _mm256_cmp_ps(distance, radiusV, _CMP_LT_OQ));
+         if(_mm256_movemask_ps(hit) == 0xFF){
+            break;
+         }
+
+         // 1/d^4, the lanes that already hit are blended away below
+         __m256 r = _mm256_rsqrt_ps(dist2);
+         r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(half, dist2),
+                                               _mm256_mul_ps(r, r),
+                                               threeHalves));
+         __m256 r2 = _mm256_mul_ps(r, r);
+         __m256 weight = _mm256_mul_ps(r2, r2);
+
+         weights = _mm256_add_ps(weights, weight);
+         red = _mm256_fmadd_ps(_mm256_set1_ps(s->red[j]), weight, red);
+         green = _mm256_fmadd_ps(_mm256_set1_ps(s->green[j]), weight, green);
+         blue = _mm256_fmadd_ps(_mm256_set1_ps(s->blue[j]), weight, blue);
+
+         __m256 closer = _mm256_cmp_ps(distance, shortest, _CMP_LT_OQ);
+         shortest = _mm256_blendv_ps(shortest, distance, closer);
+         nearestRed = _mm256_blendv_ps(nearestRed,
+                                       _mm256_set1_ps(s->red[j]), closer);
+         nearestGreen = _mm256_blendv_ps(nearestGreen,
+                                         _mm256_set1_ps(s->green[j]), closer);
+         nearestBlue = _mm256_blendv_ps(nearestBlue,
+                                        _mm256_set1_ps(s->blue[j]), closer);
+      }
+
+      __m256 scale = _mm256_div_ps(three, weights);
+      red = _mm256_blendv_ps(_mm256_fmadd_ps(red, scale, nearestRed), one, hit);
+      green = _mm256_blendv_ps(_mm256_fmadd_ps(green, scale, nearestGreen),
+                               one, hit);
+      blue = _mm256_blendv_ps(_mm256_fmadd_ps(blue, scale, nearestBlue),
+                              one, hit);
+
+      float lanesRed[8], lanesGreen[8], lanesBlue[8];
+      _mm256_storeu_ps(lanesRed, red);
+      _mm256_storeu_ps(lanesGreen, green);
+      _mm256_storeu_ps(lanesBlue, blue);
+      storeShadedPixels(lanesRed, lanesGreen, lanesBlue,
+                        end - column < 8 ? end - column : 8, out);
+   }
+}
+
+__attribute__((target("avx2,fma")))
+static void shadeSpanAVX2(const renderSatelites *s, float radius,
+                          int row, int begin, int end, float *out){
+   if(s->count == DEFAULT_SATELITE_COUNT){
+      shadeSpanAVX2Count(s, radius, row, begin, end, out,
+                         DEFAULT_SATELITE_COUNT);
+   } else {
+      shadeSpanAVX2Count(s, radius, row, begin, end, out, s->count);
+   }
+}
+
+// 16 pixels per instruction with mask registers, otherwise the same as the
+// AVX2 shader
+__attribute__((target("avx512f"), always_inline))
+static inline void shadeSpanAVX512Count(const renderSatelites *s,
+                                        float radius, int row, int begin,
+                                        int end, float *out, int count){
+
+   const __m512 lanes = _mm512_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f,
+                                       7.f, 8.f, 9.f, 10.f, 11.f, 12.f, 13.f,
+                                       14.f, 15.f);
+   const __m512 radiusV = _mm512_set1_ps(radius);
+   const __m512 py = _mm512_set1_ps((float)row);
+   const __m512 half = _mm512_set1_ps(0.5f);
+   const __m512 threeHalves = _mm512_set1_ps(1.5f);
+   const __m512 three = _mm512_set1_ps(3.0f);
+   const __m512 one = _mm512_set1_ps(1.0f);
+
+   for(int column = begin; column < end; column += 16, out += 48){
+      __m512 px = _mm512_add_ps(_mm512_set1_ps((float)column), lanes);
+      __m512 shortest = _mm512_set1_ps(INFINITY);
+      __m512 nearestRed = _mm512_setzero_ps();
+      __m512 nearestGreen = _mm512_setzero_ps();
+      __m512 nearestBlue = _mm512_setzero_ps();
+      __m512 red = _mm512_setzero_ps();
+      __m512 green = _mm512_setzero_ps();
+      __m512 blue = _mm512_setzero_ps();
+      __m512 weights = _mm512_setzero_ps();
+      __mmask16 hit = 0;
+
+      for(int j = 0; j < count; ++j){
+         __m512 dx = _mm512_sub_ps(px, _mm512_set1_ps(s->x[j]));
+         __m512 dy = _mm512_sub_ps(py, _mm512_set1_ps(s->y[j]));
+         __m512 dist2 = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+         __m512 distance = _mm512_sqrt_ps(dist2);
+
+         hit |= _mm512_cmp_ps_mask(distance, radiusV, _CMP_LT_OQ);
+         if(hit == 0xFFFF){
+            break;
+         }
+
+         __m512 r = _mm512_rsqrt14_ps(dist2);
+         r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, dist2),
+                                               _mm512_mul_ps(r, r),
+                                               threeHalves));
+         __m512 r2 = _mm512_mul_ps(r, r);
+         __m512 weight = _mm512_mul_ps(r2, r2);
+
+         weights = _mm512_add_ps(weights, weight);
+         red = _mm512_fmadd_ps(_mm512_set1_ps(s->red[j]), weight, red);
+         green = _mm512_fmadd_ps(_mm512_set1_ps(s->green[j]), weight, green);
+         blue = _mm512_fmadd_ps(_mm512_set1_ps(s->blue[j]), weight, blue);
+
+         __mmask16 closer = _mm512_cmp_ps_mask(distance, shortest, _CMP_LT_OQ);
+         shortest = _mm512_mask_blend_ps(closer, shortest, distance);
+         nearestRed = _mm512_mask_blend_ps(closer, nearestRed,
+                                           _mm512_set1_ps(s->red[j]));
+         nearestGreen = _mm512_mask_blend_ps(closer, nearestGreen,
+                                             _mm512_set1_ps(s->green[j]));
+         nearestBlue = _mm512_mask_blend_ps(closer, nearestBlue,
+                                            _mm512_set1_ps(s->blue[j]));
+      }
+
+      __m512 scale = _mm512_div_ps(three, weights);
+      red = _mm512_mask_blend_ps(hit, _mm512_fmadd_ps(red, scale, nearestRed),
+                                 one);
+      green = _mm512_mask_blend_ps(hit,
+                                   _mm512_fmadd_ps(green, scale, nearestGreen),
+                                   one);
+      blue = _mm512_mask_blend_ps(hit,
+                                  _mm512_fmadd_ps(blue, scale, nearestBlue),
+                                  one);
+
+      float lanesRed[16], lanesGreen[16], lanesBlue[16];
+      _mm512_storeu_ps(lanesRed, red);
+      _mm512_storeu_ps(lanesGreen, green);
+      _mm512_storeu_ps(lanesBlue, blue);
+      storeShadedPixels(lanesRed, lanesGreen, lanesBlue,
+                        end - column < 16 ? end - column : 16, out);
+   }
+}
+
+__attribute__((target("avx512f")))
+static void shadeSpanAVX512(const renderSatelites *s, float radius,
+                            int row, int begin, int end, float *out){
+   if(s->count == DEFAULT_SATELITE_COUNT){
+      shadeSpanAVX512Count(s, radius, row, begin, end, out,
+                           DEFAULT_SATELITE_COUNT);
+   } else {
+      shadeSpanAVX512Count(s, radius, row, begin, end, out, s->count);
+   }
+}
+
+#endif // SHADER_SIMD_X86
+
+// Picks the widest shader the CPU supports. PIXEL_SHADER=scalar|avx2|avx512
+// in the environment forces a specific shader for comparisons.
+static inline pixelShader selectPixelShader(void){
+
+   pixelShader scalar = {shadeSpanScalar, "scalar"};
+   const char *forced = getenv("PIXEL_SHADER");
+
+#ifdef SHADER_SIMD_X86
+   pixelShader avx2 = {shadeSpanAVX2, "avx2"};
+   pixelShader avx512 = {shadeSpanAVX512, "avx512"};
+
+   __builtin_cpu_init();
+   int hasAVX2 = __builtin_cpu_supports("avx2") &&
+                 __builtin_cpu_supports("fma");
+   int hasAVX512 = __builtin_cpu_supports("avx512f");
+
+   if(forced != NULL){
+      if(strcmp(forced, "avx512") == 0 && hasAVX512){
+         return avx512;
+      }
+      if(strcmp(forced, "avx2") == 0 && hasAVX2){
+         return avx2;
+      }
+      if(strcmp(forced, "scalar") == 0){
+         return scalar;
+      }
+      fprintf(stderr, "PIXEL_SHADER=%s not available, using default\n",
+              forced);
+   }
+   if(hasAVX512){
+      return avx512;
+   }
+   if(hasAVX2){
+      return avx2;
+   }
+#else
+   (void)forced;
+#endif
+   return scalar;
+}
+
+#endif // COMMON_SHADER_SIMD_H
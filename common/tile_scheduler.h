@@ -0,0 +1,132 @@
+// Work-stealing tile scheduler for the CPU graphics engines.
+//
+// The frame is cut into tiles of tileSize x tileSize pixels, numbered row
+// by row. Every worker starts with a contiguous range of tile indices, so
+// in the common case it renders one horizontal band of the frame. A
+// worker that runs out of tiles steals the upper half of the range of
+// another worker, which balances frames where some regions finish early
+// (pixels near satelites) and others do the full satelite loop.
+//
+// Each range is a single 64-bit word {begin, end} updated with
+// compare-and-swap, so owners and thieves never take a lock.
+
+#ifndef COMMON_TILE_SCHEDULER_H
+#define COMMON_TILE_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// One range per cache line so workers do not share lines
+typedef struct{
+   uint64_t range;
+   char padding[64 - sizeof(uint64_t)];
+} tileQueue;
+
+typedef struct{
+   tileQueue *queues;
+   int workers;
+   int tileSize;
+   int tilesX;
+   int tilesY;
+   int tileCount;
+} tileScheduler;
+
+static inline uint64_t packTileRange(uint32_t begin, uint32_t end){
+   return ((uint64_t)end << 32) | begin;
+}
+
+static inline void initTileScheduler(tileScheduler *scheduler, int workers,
+                                     int tileSize, int width, int height){
+   if(posix_memalign((void**)&scheduler->queues, 64,
+                     sizeof(tileQueue) * workers) != 0){
+      fprintf(stderr, "Failed to allocate tile queues\n");
+      exit(EXIT_FAILURE);
+   }
+   scheduler->workers = workers;
+   scheduler->tileSize = tileSize;
+   scheduler->tilesX = (width + tileSize - 1) / tileSize;
+   scheduler->tilesY = (height + tileSize - 1) / tileSize;
+   scheduler->tileCount = scheduler->tilesX * scheduler->tilesY;
+}
+
+static inline void freeTileScheduler(tileScheduler *scheduler){
+   free(scheduler->queues);
+   scheduler->queues = NULL;
+}
+
+// Hands every worker its home range of the indices [0, count) for a new
+// frame. Must not run while workers are still taking tiles.
+static inline void resetTileSchedulerCount(tileScheduler *scheduler,
+                                           int count){
+   for(int w = 0; w < scheduler->workers; ++w){
+      uint32_t begin = (uint32_t)((long long)w * count / scheduler->workers);
+      uint32_t end = (uint32_t)((long long)(w + 1) * count /
+                                scheduler->workers);
+      __atomic_store_n(&scheduler->queues[w].range,
+                       packTileRange(begin, end), __ATOMIC_RELAXED);
+   }
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// resetTileScheduler() for all tiles of the frame
+static inline void resetTileScheduler(tileScheduler *scheduler){
+   resetTileSchedulerCount(scheduler, scheduler->tileCount);
+}
+
+// Returns the next tile for worker, or -1 once the whole frame is taken
+static inline int nextTile(tileScheduler *scheduler, int worker){
+
+   uint64_t *own = &scheduler->queues[worker].range;
+
+   // Take from the front of the own range
+   uint64_t range = __atomic_load_n(own, __ATOMIC_ACQUIRE);
+   for(;;){
+      uint32_t begin = (uint32_t)range;
+      uint32_t end = (uint32_t)(range >> 32);
+      if(begin >= end){
+         break;
+      }
+      if(__atomic_compare_exchange_n(own, &range,
+                                     packTileRange(begin + 1, end), 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+         return (int)begin;
+      }
+   }
+
+   // Steal the upper half of the next non-empty range
+   for(int k = 1; k < scheduler->workers; ++k){
+      uint64_t *victim =
+         &scheduler->queues[(worker + k) % scheduler->workers].range;
+      range = __atomic_load_n(victim, __ATOMIC_ACQUIRE);
+      for(;;){
+         uint32_t begin = (uint32_t)range;
+         uint32_t end = (uint32_t)(range >> 32);
+         if(begin >= end){
+            break;
+         }
+         uint32_t middle = begin + (end - begin) / 2;
+         if(__atomic_compare_exchange_n(victim, &range,
+                                        packTileRange(begin, middle), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            // Keep the rest of the stolen half for ourselves
+            __atomic_store_n(own, packTileRange(middle + 1, end),
+                             __ATOMIC_RELEASE);
+            return (int)middle;
+         }
+      }
+   }
+   return -1;
+}
+
+// Pixel bounds of a tile, clipped to the frame
+static inline void tileBounds(const tileScheduler *scheduler, int tile,
+                              int width, int height,
+                              int *x0, int *y0, int *x1, int *y1){
+   *x0 = (tile % scheduler->tilesX) * scheduler->tileSize;
+   *y0 = (tile / scheduler->tilesX) * scheduler->tileSize;
+   *x1 = *x0 + scheduler->tileSize < width ? *x0 + scheduler->tileSize : width;
+   *y1 = *y0 + scheduler->tileSize < height ? *y0 + scheduler->tileSize : height;
+}
+
+#endif // COMMON_TILE_SCHEDULER_H
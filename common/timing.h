@@ -0,0 +1,24 @@
+// Timing helpers shared by all backends.
+//
+// The including file must define _POSIX_C_SOURCE (199309L or newer) before
+// its first system header so that clock_gettime is visible with -std=c99.
+
+#ifndef COMMON_TIMING_H
+#define COMMON_TIMING_H
+
+#include <time.h>
+
+// Monotonic clock in nanoseconds. Unaffected by wall clock adjustments,
+// so differences between two calls are always valid frame times.
+static inline long long nowNanoseconds(void){
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Converts a nanosecond interval to milliseconds for printing
+static inline double nanosecondsToMilliseconds(long long nanoseconds){
+   return nanoseconds / 1000000.0;
+}
+
+#endif // COMMON_TIMING_H
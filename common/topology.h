@@ -0,0 +1,282 @@
+// CPU topology discovery and thread placement for the CPU backends.
+//
+// discoverTopology() reads the online CPUs, their cores and NUMA nodes
+// from sysfs, without hwloc, and orders them for placement: one hardware
+// thread of every core first, grouped by NUMA node, then the SMT
+// siblings. Worker w is pinned to cpus[w % cpuCount], so consecutive
+// workers, which render neighbouring bands of the frame, share a node.
+// CPUs outside the affinity mask of the process (taskset, cgroups) are
+// left out.
+//
+// firstTouchRows() lets every worker write the rows of its home band of
+// tiles once, so the kernel places those pages on the worker's node
+// before the first frame. It only has an effect on buffers that nobody
+// wrote yet, which is the case for the large malloc() of the frame buffer.
+//
+// On other systems than Linux the topology is a single node with the CPUs
+// reported by sysconf() and pinning does nothing. The backends have to
+// define _GNU_SOURCE before their first include for sched_setaffinity().
+
+#ifndef COMMON_TOPOLOGY_H
+#define COMMON_TOPOLOGY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#define TOPOLOGY_LINUX 1
+#endif
+
+#include "tile_scheduler.h"
+
+// Highest CPU and node number looked at
+#define TOPOLOGY_MAX_CPUS 4096
+#define TOPOLOGY_MAX_NODES 1024
+
+typedef struct{
+   int *cpus;       // Online CPUs in placement order
+   int *nodes;      // NUMA node of every entry of cpus
+   int cpuCount;
+   int coreCount;   // Physical cores, the first coreCount entries of cpus
+   int nodeCount;
+} cpuTopology;
+
+// Reads a whole small sysfs file into buffer, returns 0 on failure
+static inline int readSysfsFile(const char *path, char *buffer, size_t size){
+   FILE *file = fopen(path, "r");
+   if(file == NULL){
+      return 0;
+   }
+   size_t length = fread(buffer, 1, size - 1, file);
+   fclose(file);
+   buffer[length] = '\0';
+   return length > 0;
+}
+
+static inline int readSysfsInt(const char *path, int fallback){
+   char buffer[32];
+   return readSysfsFile(path, buffer, sizeof(buffer)) ?
+      atoi(buffer) : fallback;
+}
+
+// Sets member[i] for every i of a list like "0-3,8,10-11" below limit
+static inline void parseCpuList(const char *list, unsigned char *member,
+                                int limit){
+   while(*list != '\0' && *list != '\n'){
+      char *end;
+      long first = strtol(list, &end, 10);
+      long last = first;
+      if(end == list){
+         return;
+      }
+      if(*end == '-'){
+         list = end + 1;
+         last = strtol(list, &end, 10);
+      }
+      for(long i = first; i <= last && i < limit; ++i){
+         if(i >= 0){
+            member[i] = 1;
+         }
+      }
+      list = *end == ',' ? end + 1 : end;
+   }
+}
+
+// Placement key of one CPU, compared field by field
+typedef struct{
+   int sibling;   // 0 for the first hardware thread of its core
+   int node;
+   int package;
+   int core;
+   int cpu;
+} topologyEntry;
+
+static int compareTopologyEntries(const void *a, const void *b){
+   const topologyEntry *x = (const topologyEntry*)a;
+   const topologyEntry *y = (const topologyEntry*)b;
+   if(x->sibling != y->sibling) return x->sibling - y->sibling;
+   if(x->node != y->node) return x->node - y->node;
+   if(x->package != y->package) return x->package - y->package;
+   if(x->core != y->core) return x->core - y->core;
+   return x->cpu - y->cpu;
+}
+
+static inline void discoverTopology(cpuTopology *t){
+
+   unsigned char *online = (unsigned char*)calloc(TOPOLOGY_MAX_CPUS, 1);
+   int *nodeOf = (int*)calloc(TOPOLOGY_MAX_CPUS, sizeof(int));
+   topologyEntry *entries =
+      (topologyEntry*)malloc(sizeof(topologyEntry) * TOPOLOGY_MAX_CPUS);
+   if(online == NULL || nodeOf == NULL || entries == NULL){
+      fprintf(stderr, "Failed to allocate the CPU topology\n");
+      exit(EXIT_FAILURE);
+   }
+   char buffer[4096];
+   char path[128];
+   int count = 0;
+   t->nodeCount = 1;
+
+#ifdef TOPOLOGY_LINUX
+   if(readSysfsFile("/sys/devices/system/cpu/online", buffer,
+                    sizeof(buffer))){
+      parseCpuList(buffer, online, TOPOLOGY_MAX_CPUS);
+   }
+   cpu_set_t allowed;
+   int haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+   // Node of every CPU from the cpulist of every node
+   unsigned char *nodeMembers = (unsigned char*)malloc(TOPOLOGY_MAX_CPUS);
+   if(nodeMembers == NULL){
+      fprintf(stderr, "Failed to allocate the CPU topology\n");
+      exit(EXIT_FAILURE);
+   }
+   int highestNode = -1;
+   for(int node = 0; node < TOPOLOGY_MAX_NODES; ++node){
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+               node);
+      if(!readSysfsFile(path, buffer, sizeof(buffer))){
+         continue;
+      }
+      memset(nodeMembers, 0, TOPOLOGY_MAX_CPUS);
+      parseCpuList(buffer, nodeMembers, TOPOLOGY_MAX_CPUS);
+      for(int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; ++cpu){
+         if(nodeMembers[cpu]){
+            nodeOf[cpu] = node;
+         }
+      }
+      highestNode = node;
+   }
+   free(nodeMembers);
+   if(highestNode >= 0){
+      t->nodeCount = highestNode + 1;
+   }
+
+   for(int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; ++cpu){
+      if(!online[cpu] ||
+         (haveMask && cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &allowed))){
+         continue;
+      }
+      topologyEntry *e = &entries[count++];
+      e->cpu = cpu;
+      e->node = nodeOf[cpu];
+      snprintf(path, sizeof(path),
+               "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+               cpu);
+      e->package = readSysfsInt(path, 0);
+      snprintf(path, sizeof(path),
+               "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+      e->core = readSysfsInt(path, cpu);
+      e->sibling = 0;
+   }
+#endif
+
+   // No sysfs: one node with the CPUs sysconf() knows about
+   if(count == 0){
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      count = cpus > 0 ? (int)(cpus < TOPOLOGY_MAX_CPUS ? cpus :
+                               TOPOLOGY_MAX_CPUS) : 1;
+      for(int cpu = 0; cpu < count; ++cpu){
+         topologyEntry e = {0, 0, 0, cpu, cpu};
+         entries[cpu] = e;
+      }
+      t->nodeCount = 1;
+   }
+
+   // Every hardware thread after the first of its core is a sibling
+   int cores = 0;
+   for(int i = 0; i < count; ++i){
+      for(int k = 0; k < i; ++k){
+         if(entries[k].package == entries[i].package &&
+            entries[k].core == entries[i].core){
+            entries[i].sibling = 1;
+            break;
+         }
+      }
+      cores += !entries[i].sibling;
+   }
+   qsort(entries, count, sizeof(topologyEntry), compareTopologyEntries);
+
+   t->cpus = (int*)malloc(sizeof(int) * count);
+   t->nodes = (int*)malloc(sizeof(int) * count);
+   if(t->cpus == NULL || t->nodes == NULL){
+      fprintf(stderr, "Failed to allocate the CPU topology\n");
+      exit(EXIT_FAILURE);
+   }
+   for(int i = 0; i < count; ++i){
+      t->cpus[i] = entries[i].cpu;
+      t->nodes[i] = entries[i].node;
+   }
+   t->cpuCount = count;
+   t->coreCount = cores;
+
+   free(online);
+   free(nodeOf);
+   free(entries);
+}
+
+static inline void freeTopology(cpuTopology *t){
+   free(t->cpus);
+   free(t->nodes);
+   t->cpus = NULL;
+   t->nodes = NULL;
+}
+
+static inline void printTopology(const cpuTopology *t, int threads,
+                                 int pinned){
+   printf("Topology: %d CPUs, %d cores, %d NUMA nodes; %d threads%s\n",
+          t->cpuCount, t->coreCount, t->nodeCount, threads,
+          pinned ? " pinned to cores" : "");
+}
+
+// Pins the calling thread to the CPU of worker, returns 0 on success
+static inline int pinWorker(const cpuTopology *t, int worker){
+#ifdef TOPOLOGY_LINUX
+   int cpu = t->cpus[worker % t->cpuCount];
+   if(cpu >= CPU_SETSIZE){
+      return -1;
+   }
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   return sched_setaffinity(0, sizeof(set), &set);
+#else
+   (void)t;
+   (void)worker;
+   return 0;
+#endif
+}
+
+// Rows of the home band of worker: the tile rows from the one of the
+// first tile resetTileScheduler() hands it to the one of the next
+// worker's first tile. The bands of all workers cover the frame once.
+static inline void homeBandRows(const tileScheduler *scheduler, int worker,
+                                int height, int *rowBegin, int *rowEnd){
+   int begin = (int)((long long)worker * scheduler->tileCount /
+                     scheduler->workers);
+   int end = (int)((long long)(worker + 1) * scheduler->tileCount /
+                   scheduler->workers);
+   *rowBegin = begin / scheduler->tilesX * scheduler->tileSize;
+   *rowEnd = end / scheduler->tilesX * scheduler->tileSize;
+   *rowBegin = *rowBegin < height ? *rowBegin : height;
+   *rowEnd = *rowEnd < height ? *rowEnd : height;
+   if(worker == scheduler->workers - 1){
+      *rowEnd = height;
+   }
+}
+
+// Writes zeros to the home band rows of worker in a buffer with rowBytes
+// bytes per row. Run on every worker after pinning it.
+static inline void firstTouchRows(const tileScheduler *scheduler, int worker,
+                                  void *buffer, size_t rowBytes, int height){
+   int rowBegin, rowEnd;
+   homeBandRows(scheduler, worker, height, &rowBegin, &rowEnd);
+   if(rowEnd > rowBegin){
+      memset((char*)buffer + rowBytes * rowBegin, 0,
+             rowBytes * (rowEnd - rowBegin));
+   }
+}
+
+#endif // COMMON_TOPOLOGY_H
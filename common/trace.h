@@ -0,0 +1,165 @@
+// Per-thread tracing of the hot paths (--trace FILE).
+//
+// Built with -DPARALLEL_TRACE, the backends record the begin and end of
+// every work item (physics chunk, render tile, OpenCL enqueue and wait)
+// into one ring buffer per thread and write them as Chrome trace_event
+// JSON on exit, for chrome://tracing or https://ui.perfetto.dev. Without
+// PARALLEL_TRACE the macros expand to nothing and --trace only prints a
+// warning.
+//
+// A ring is written only by its own thread, which passes its worker
+// number, so recording takes no lock and no atomic: a timestamp read and
+// a store into the thread's own cache lines. When a ring is full the
+// oldest events are overwritten. The rings are read only by traceFinish()
+// after the workers are idle.
+//
+//    TRACE_BEGIN(tileStart);
+//    ...render the tile...
+//    TRACE_END(worker, "tile", tile, tileStart);
+//
+// Timestamps come from the monotonic clock of timing.h, not rdtsc, so
+// they need no calibration and agree with the frame times.
+
+#ifndef COMMON_TRACE_H
+#define COMMON_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timing.h"
+
+#ifdef PARALLEL_TRACE
+
+// Events kept per thread, the last ones win
+#ifndef TRACE_EVENTS_PER_THREAD
+#define TRACE_EVENTS_PER_THREAD 65536
+#endif
+
+typedef struct{
+   long long begin;
+   long long end;
+   const char *name;   // String literal, not copied
+   int argument;       // Tile, chunk or frame number
+} traceEvent;
+
+// One ring per thread, on its own cache lines
+typedef struct{
+   traceEvent *events;
+   unsigned long long recorded;
+   char padding[64 - sizeof(traceEvent*) - sizeof(unsigned long long)];
+} traceRing;
+
+typedef struct{
+   traceRing *rings;
+   int threads;
+   const char *path;
+   long long start;
+} traceState;
+
+static traceState tracer = {NULL, 0, NULL, 0};
+
+#define TRACE_BEGIN(variable) long long variable = nowNanoseconds()
+#define TRACE_END(thread, name, argument, begin) \
+   traceRecord((thread), (name), (argument), (begin))
+
+static inline void traceRecord(int thread, const char *name, int argument,
+                               long long begin){
+   if(tracer.rings == NULL || thread < 0 || thread >= tracer.threads){
+      return;
+   }
+   traceRing *ring = &tracer.rings[thread];
+   traceEvent *event =
+      &ring->events[ring->recorded++ % TRACE_EVENTS_PER_THREAD];
+   event->begin = begin;
+   event->end = nowNanoseconds();
+   event->name = name;
+   event->argument = argument;
+}
+
+// Starts tracing threads workers into path, nothing for a NULL path
+static inline void traceStart(const char *path, int threads){
+   if(path == NULL){
+      return;
+   }
+   if(posix_memalign((void**)&tracer.rings, 64,
+                     sizeof(traceRing) * threads) != 0){
+      fprintf(stderr, "Failed to allocate the trace buffers\n");
+      exit(EXIT_FAILURE);
+   }
+   for(int t = 0; t < threads; ++t){
+      tracer.rings[t].events =
+         (traceEvent*)malloc(sizeof(traceEvent) * TRACE_EVENTS_PER_THREAD);
+      if(tracer.rings[t].events == NULL){
+         fprintf(stderr, "Failed to allocate the trace buffers\n");
+         exit(EXIT_FAILURE);
+      }
+      tracer.rings[t].recorded = 0;
+   }
+   tracer.threads = threads;
+   tracer.path = path;
+   tracer.start = nowNanoseconds();
+}
+
+// Writes the recorded events as Chrome trace_event JSON and frees the
+// rings. Call when no thread records any more.
+static inline void traceFinish(void){
+   if(tracer.rings == NULL){
+      return;
+   }
+   FILE *file = fopen(tracer.path, "w");
+   if(file == NULL){
+      fprintf(stderr, "Failed to open trace file %s\n", tracer.path);
+   } else {
+      unsigned long long written = 0, dropped = 0;
+      fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+      for(int t = 0; t < tracer.threads; ++t){
+         fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+                       "\"pid\":1,\"tid\":%d,\"args\":{\"name\":"
+                       "\"worker %d\"}}", t == 0 ? "" : ",\n", t, t);
+      }
+      for(int t = 0; t < tracer.threads; ++t){
+         traceRing *ring = &tracer.rings[t];
+         unsigned long long first = ring->recorded > TRACE_EVENTS_PER_THREAD ?
+            ring->recorded - TRACE_EVENTS_PER_THREAD : 0;
+         dropped += first;
+         for(unsigned long long i = first; i < ring->recorded; ++i){
+            const traceEvent *e = &ring->events[i % TRACE_EVENTS_PER_THREAD];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                          "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"args\":{\"id\":%d}}",
+                    e->name, t, (e->begin - tracer.start) / 1000.0,
+                    (e->end - e->begin) / 1000.0, e->argument);
+            ++written;
+         }
+      }
+      fprintf(file, "\n]}\n");
+      fclose(file);
+      printf("Trace: %llu events written to %s, %llu overwritten\n",
+             written, tracer.path, dropped);
+   }
+   for(int t = 0; t < tracer.threads; ++t){
+      free(tracer.rings[t].events);
+   }
+   free(tracer.rings);
+   tracer.rings = NULL;
+}
+
+#else
+
+#define TRACE_BEGIN(variable)
+#define TRACE_END(thread, name, argument, begin)
+
+static inline void traceStart(const char *path, int threads){
+   (void)threads;
+   if(path != NULL){
+      fprintf(stderr, "--trace needs a build with -DPARALLEL_TRACE, "
+                      "not tracing\n");
+   }
+}
+
+static inline void traceFinish(void){
+}
+
+#endif // PARALLEL_TRACE
+
+#endif // COMMON_TRACE_H
@@ -21,6 +21,8 @@ VERSION 20.0 - relax physic correctness check
 // no optimization:   gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL
 // most optimization: gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL -O3
 
+// clock_gettime is POSIX, not part of -std=c99
+#define _POSIX_C_SOURCE 200809L
 
 #ifdef _WIN32
 #include <windows.h>
@@ -29,13 +31,31 @@ VERSION 20.0 - relax physic correctness check
 #include <math.h> // INFINITY
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h> // mkdir
+#include <unistd.h> // getpid
 
 #define CL_TARGET_OPENCL_VERSION 120
 #include <CL/opencl.h> // OpenCL
 #include <assert.h> // assert
 #include "parallel.h" // Header file
-
-// Window handling includes
+#include "../common/options.h" // Command line options
+#include "../common/timing.h" // nowNanoseconds
+#include "../common/frame_stats.h" // Benchmark statistics
+#include "../common/pixel_format.h" // Packed RGBA8 framebuffer
+#include "../common/physics_check.h" // --physics-precision float check
+#include "../common/shader_simd.h" // Host side rows of --hybrid
+#include "../common/trace.h" // Host side enqueue and wait tracing
+
+// Runtime problem size (--width, --height, --satellites, --substeps)
+#define WINDOW_HEIGHT (options.windowHeight)
+#define WINDOW_WIDTH (options.windowWidth)
+#define SATELITE_COUNT (options.sateliteCount)
+#define PHYSICSUPDATESPERFRAME (options.physicsUpdatesPerFrame)
+
+// Window handling includes, left out of headless-only builds
+// (-DPARALLEL_HEADLESS) so they build without OpenGL and GLUT
+#ifndef PARALLEL_HEADLESS
 #ifndef __APPLE__
 #include <GL/gl.h>
 #include <GL/glut.h>
@@ -43,14 +63,26 @@ VERSION 20.0 - relax physic correctness check
 #include <OpenGL/gl.h>
 #include <GLUT/glut.h>
 #endif
+#endif
 
 
 // Is used to find out frame times
-int previousFrameTimeSinceStart = 0;
-int previousFinishTime = 0;
+long long previousFrameTimeSinceStart = 0;
+long long previousFinishTime = 0;
 unsigned int frameNumber = 0;
 unsigned int seed = 0;
 
+// Command line options (see common/options.h)
+simulationOptions options;
+
+// Accumulated frame timings for the headless summary, in nanoseconds
+// Per frame timings for --stats-json and --stats-csv
+frameStats frameStatistics;
+
+long long totalFrameTime = 0;
+long long totalPhysicsTime = 0;
+long long totalGraphicsTime = 0;
+
 
 // Pixel buffer which is rendered to the screen
 color* pixels;
@@ -63,9 +95,16 @@ satelite* satelites;
 satelite* backupSatelites;
 
 
-#define TOTAL_PIXEL_SIZE sizeof(color) * SIZE
+// Framebuffer format (--pixel-format). In PIXEL_FORMAT_RGBA8 the Graphics
+// Engine writes pixelsRGBA8 instead of pixels, a third of the bytes.
+int pixelFormat = PIXEL_FORMAT_FLOAT;
+unsigned char *pixelsRGBA8 = NULL;
+#define HOST_PIXELS (pixelFormat == PIXEL_FORMAT_RGBA8 ? \
+    (void*)pixelsRGBA8 : (void*)pixels)
+
+#define TOTAL_PIXEL_SIZE (pixelFormat == PIXEL_FORMAT_RGBA8 ? \
+    (size_t)4 * SIZE : sizeof(color) * SIZE)
 #define TOTAL_SATELLITE_SIZE sizeof(satelite) * SATELITE_COUNT
-#define MAX_SOURCE_SIZE (0x100000)
 
 
 
@@ -89,22 +128,99 @@ cl_kernel graphicsKernel = NULL;
 cl_int err;
 cl_event k_events;
 
+// Work-group sizes of the Graphics Engine (rows, columns) and of the
+// Physics Engine, 0 = chosen by the runtime. See setLocalSize().
 size_t local_size[2];
+size_t physics_local_size = 0;
+#define PHYSICS_LOCAL_SIZE (physics_local_size ? &physics_local_size : NULL)
+#define WORK_GROUP_TUNING_RUNS 2
 
-const char* option = "-I parallel.h -cl-fast-relaxed-math"; 
-
+cl_device_id physicsDevice = NULL;
+cl_device_id graphicsDevice = NULL;
 
+#define PHYSICS_KERNEL_NAME \
+    (floatPhysics ? "physicsEngineKernelFloat" : "physicsEngineKernel")
+#define GRAPHICS_KERNEL_NAME (pixelFormat == PIXEL_FORMAT_RGBA8 ? \
+    "graphicsEngineKernelRGBA8" : "graphicsEngineKernel")
 
+const char* option = "-I parallel.h -cl-fast-relaxed-math"; 
 
-// Take workgroup size from user
-void setLocalSize() {
+// Float physics (--physics-precision float) with the compensated kernel
+// physicsEngineKernelFloat, checked against the double reference with a
+// tolerance like in the OpenMP backend (see common/physics_check.h). The
+// programs are then built without -cl-fast-relaxed-math.
+int floatPhysics = 0;
+const char* preciseOption = "-I parallel.h";
+
+// Graphics kernel variant (--cl-graphics). local builds the programs with
+// -D GRAPHICS_LOCAL_TILES, whose kernels stage the satelites in local
+// memory and shade GRAPHICS_PIXELS_PER_ITEM pixels of a row per work-item.
+#define GRAPHICS_PIXELS_PER_ITEM 4
+int localGraphics = 0;
+
+// Program binary cache (--cl-cache DIR, off disables it). Built programs
+// are stored as DIR/<key hash>.bin and loaded with
+// clCreateProgramWithBinary on later starts. The key holds the device,
+// driver, the hash of parallel.cl and parallel.h and the build options,
+// which specialize the kernels for the problem size, so any change
+// builds from source again. The default DIR is
+// $XDG_CACHE_HOME/satellites-opencl or ~/.cache/satellites-opencl.
+#define PROGRAM_CACHE_MAGIC "satellites-opencl-binary 1\n"
+int programCacheEnabled = 1;
+const char *programCacheDir = NULL;
+unsigned long long programSourceHash = 0;
+
+// Single context mode (--single-context). Physics and graphics run on one
+// device in one context and share the satelite buffer, so satelites only
+// go back to the host as a small non-blocking copy. The kernels are
+// chained with events. Pixels are rendered into two pinned buffers in
+// turn, and the non-blocking map of one overlaps the next frame. Outside
+// the checked first frames the window is therefore one frame behind.
+int singleContextMode = 0;
+
+// Device of the Graphics Engine and of the single context (--cl-device)
+cl_device_type graphicsDeviceType = CL_DEVICE_TYPE_GPU;
+cl_mem pinnedPixelsBuffers[2] = {NULL, NULL};
+void *mappedPixels[2] = {NULL, NULL};
+cl_event pixelsMapped[2] = {NULL, NULL};
+cl_event physicsDone = NULL;
+cl_event graphicsDone = NULL;
+cl_event satelitesRead = NULL;
+int currentPixelsBuffer = 0;
+int pendingPixelsBuffer = -1;   // Mapped buffer not yet copied to pixels
+
+// N-body physics (--nbody direct): satelite-satelite gravity with the
+// tiled all-pairs kernel, nbodySteps kick-drift substeps a frame. The
+// substeps ping-pong between the satelite buffer and nbodySatelitesBuffer.
+// The defaults are those of common/nbody.h, whose CPU kernels are not
+// used here.
+#define NBODY_LOCAL_SIZE 64
+int nbodyMode = 0;
+int nbodySteps = 100;
+double nbodyMass = 1e-4;
+double nbodySoftening = 1.0;
+cl_kernel nbodyKernel = NULL;
+cl_mem nbodySatelitesBuffer = NULL;
+
+// Hybrid rendering (--hybrid). The Graphics Engine kernel renders the top
+// hybridRows rows into a device buffer, and OpenMP threads render the
+// rest on the host with the SIMD shaders of the CPU backends, at the same
+// time. After every frame the split moves towards the rows per second
+// both sides reached, smoothed over the frames, so they finish together.
+// hybridRows is a multiple of the work-group rows. The kernel is timed
+// with event profiling from enqueue to the end of its read.
+#define HYBRID_SMOOTHING 0.5
+#define HYBRID_SPAN 256
+int hybridRendering = 0;
+int hybridRows = 0;
+double hybridRateCL = 0.0;    // Rows per nanosecond
+double hybridRateHost = 0.0;
+double hybridRowsSum = 0.0;   // For the average split on exit
+unsigned int hybridFrames = 0;
+renderSatelites hybridSnapshot;
+pixelShader hybridShader;
 
-   printf("Enter the WG x-size: ");
-   assert(scanf("%zu", &local_size[0]) > 0);
-   printf("Enter the WG y-size: ");
-   assert(scanf("%zu", &local_size[1]) > 0);
 
-}
 
 
 // Get the ID of the desired device type.
@@ -141,39 +257,211 @@ cl_device_id getDeviceID(cl_device_type device_type) {
 } 
 
 
-// Setup the CL properties for the Physics Engine
-void setupPhysics(char* source_str, size_t source_size) {
+// 64-bit FNV-1a hash of size bytes, continuing from hash
+unsigned long long hashBytes(unsigned long long hash, const void *data,
+                             size_t size) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+#define HASH_SEED 14695981039346656037ULL
 
-    // CPU performs physics engine better
-    cl_device_id cpuID = getDeviceID(CL_DEVICE_TYPE_CPU);
+// Reads a whole file into a null terminated buffer, NULL on failure
+char *readWholeFile(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    char *data = NULL;
+    long length = -1;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        length = ftell(f);
+    }
+    if (length >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = (char*)malloc(length + 1);
+    }
+    if (data != NULL && fread(data, 1, length, f) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (data != NULL) {
+        data[length] = '\0';
+        *size = length;
+    }
+    return data;
+}
 
-    // Create context for Physics Engine
-    physicsContext = clCreateContext(NULL, 1, &cpuID, NULL, NULL, &err);
-    assert(err == CL_SUCCESS);
+// Creates dir and its parent, existing ones are fine
+int makeCacheDirectory(const char *dir) {
+    char parent[1024];
+    snprintf(parent, sizeof(parent), "%s", dir);
+    char *slash = strrchr(parent, '/');
+    if (slash != NULL && slash != parent) {
+        *slash = '\0';
+        mkdir(parent, 0755);
+    }
+    return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
 
-    // Create command queue for Physics Engine
-    physicsCommandQueue = clCreateCommandQueue(physicsContext, cpuID, 0, &err);
-    assert(err == CL_SUCCESS);
+// Fills in the cache key and file of a program for device, 0 when the
+// cache is off or has no directory
+int programCacheEntry(cl_device_id deviceID, const char *buildOptions,
+                      char *key, size_t keySize, char *path, size_t pathSize) {
 
-    // Create buffer for satellites in Physics Engine
-    physicsSatelitesBuffer = clCreateBuffer(physicsContext, CL_MEM_USE_HOST_PTR, 
-                    TOTAL_SATELLITE_SIZE, satelites, &err);
+    if (!programCacheEnabled) {
+        return 0;
+    }
+    char dir[1024];
+    const char *base;
+    if (programCacheDir != NULL) {
+        snprintf(dir, sizeof(dir), "%s", programCacheDir);
+    } else if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base != '\0') {
+        snprintf(dir, sizeof(dir), "%s/satellites-opencl", base);
+    } else if ((base = getenv("HOME")) != NULL && *base != '\0') {
+        snprintf(dir, sizeof(dir), "%s/.cache/satellites-opencl", base);
+    } else {
+        return 0;
+    }
+    if (!makeCacheDirectory(dir)) {
+        return 0;
+    }
 
-    clFinish(physicsCommandQueue);
+    char name[256], vendor[256], driver[256], version[256];
+    clGetDeviceInfo(deviceID, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    clGetDeviceInfo(deviceID, CL_DEVICE_VENDOR, sizeof(vendor), vendor, NULL);
+    clGetDeviceInfo(deviceID, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    clGetDeviceInfo(deviceID, CL_DEVICE_VERSION, sizeof(version), version, NULL);
+    snprintf(key, keySize, "%s|%s|%s|%s|%016llx|%s", name, vendor, driver,
+             version, programSourceHash, buildOptions);
+    snprintf(path, pathSize, "%s/%016llx.bin", dir,
+             hashBytes(HASH_SEED, key, strlen(key)));
+    return 1;
+}
+
+// Loads and builds a cached program binary, NULL if there is none for key
+cl_program loadCachedProgram(cl_context context, cl_device_id deviceID,
+                             const char *path, const char *key,
+                             const char *buildOptions) {
+
+    size_t size;
+    char *data = readWholeFile(path, &size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    // The file starts with the magic and the full key, the hash in the
+    // file name could collide
+    size_t headerSize = strlen(PROGRAM_CACHE_MAGIC) + strlen(key) + 1;
+    cl_program program = NULL;
+    if (size > headerSize &&
+        strncmp(data, PROGRAM_CACHE_MAGIC, strlen(PROGRAM_CACHE_MAGIC)) == 0 &&
+        strncmp(data + strlen(PROGRAM_CACHE_MAGIC), key, strlen(key)) == 0 &&
+        data[headerSize - 1] == '\n') {
+        const unsigned char *binary = (const unsigned char*)data + headerSize;
+        size_t binarySize = size - headerSize;
+        cl_int binaryStatus;
+        program = clCreateProgramWithBinary(context, 1, &deviceID,
+                    &binarySize, &binary, &binaryStatus, &err);
+        if (err != CL_SUCCESS || binaryStatus != CL_SUCCESS ||
+            clBuildProgram(program, 1, &deviceID, buildOptions,
+                           NULL, NULL) != CL_SUCCESS) {
+            if (program != NULL) {
+                clReleaseProgram(program);
+            }
+            program = NULL;
+        }
+    }
+    free(data);
+    return program;
+}
+
+// Writes the binary of a built program to the cache, through a temporary
+// file so concurrent runs never read half a binary
+void storeCachedProgram(cl_program program, const char *path,
+                        const char *key) {
+
+    size_t binarySize = 0;
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                sizeof(binarySize), &binarySize, NULL);
+    if (err != CL_SUCCESS || binarySize == 0) {
+        return;
+    }
+    unsigned char *binary = (unsigned char*)malloc(binarySize);
+    assert(binary != NULL);
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                sizeof(binary), &binary, NULL);
+
+    char temporary[1100];
+    snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+    FILE *f = err == CL_SUCCESS ? fopen(temporary, "wb") : NULL;
+    if (f != NULL) {
+        int written = fputs(PROGRAM_CACHE_MAGIC, f) >= 0 &&
+                      fprintf(f, "%s\n", key) > 0 &&
+                      fwrite(binary, 1, binarySize, f) == binarySize;
+        if (fclose(f) == 0 && written && rename(temporary, path) == 0) {
+            printf("Kernel binary cached in %s\n", path);
+        } else {
+            remove(temporary);
+        }
+    }
+    free(binary);
+}
+
+
+// Options of clBuildProgram for the selected kernels and problem size
+void programBuildOptions(char *buildOptions, size_t size) {
+    snprintf(buildOptions, size, "%s%s"
+             " -D SPECIALIZED_WINDOW_WIDTH=%d -D SPECIALIZED_WINDOW_HEIGHT=%d"
+             " -D SPECIALIZED_SATELITE_COUNT=%d"
+             " -D SPECIALIZED_PHYSICSUPDATESPERFRAME=%d",
+             floatPhysics ? preciseOption : option,
+             localGraphics ? " -D GRAPHICS_LOCAL_TILES" : "",
+             WINDOW_WIDTH, WINDOW_HEIGHT, SATELITE_COUNT,
+             PHYSICSUPDATESPERFRAME);
+}
+
+
+// Builds the kernel source for device, prints the build log on failure.
+// The problem size is passed as -D options, so the kernels are
+// specialized for it and the satelite loops have constant trip counts.
+// Built programs go to the binary cache and are loaded from there later.
+cl_program buildProgram(cl_context context, cl_device_id deviceID,
+                        char* source_str, size_t source_size) {
+
+    long long buildStart = nowNanoseconds();
+    char buildOptions[512];
+    programBuildOptions(buildOptions, sizeof(buildOptions));
+
+    char cacheKey[2048];
+    char cachePath[1100];
+    int cacheable = programCacheEntry(deviceID, buildOptions,
+                cacheKey, sizeof(cacheKey), cachePath, sizeof(cachePath));
+    if (cacheable) {
+        cl_program program = loadCachedProgram(context, deviceID, cachePath,
+                    cacheKey, buildOptions);
+        if (program != NULL) {
+            printf("Kernels loaded from %s in %.1fms\n", cachePath,
+                   nanosecondsToMilliseconds(nowNanoseconds() - buildStart));
+            return program;
+        }
+    }
 
     // Create program from source string
-    physicsProgram = clCreateProgramWithSource(physicsContext, 1, (const char **)&source_str,
+    cl_program program = clCreateProgramWithSource(context, 1, (const char **)&source_str,
                     (const size_t *)&source_size, &err);
     assert(err == CL_SUCCESS);
 
     // Build the program and print error if exist
-    err = clBuildProgram(physicsProgram, 1, &cpuID, option, NULL, NULL);
+    err = clBuildProgram(program, 1, &deviceID, buildOptions, NULL, NULL);
     if (err != CL_SUCCESS) {
         char* buffErr;
         cl_int errCode;
         size_t logLen;
 
-        errCode = clGetProgramBuildInfo(physicsProgram, cpuID,
+        errCode = clGetProgramBuildInfo(program, deviceID,
                     CL_PROGRAM_BUILD_LOG, 0, NULL, &logLen);
         if (errCode) {
             printf("clGetProgramBuildInfo failed at line %d\n", errCode);
@@ -186,7 +474,7 @@ void setupPhysics(char* source_str, size_t source_size) {
             exit(-2);
         }
 
-        errCode = clGetProgramBuildInfo(physicsProgram, cpuID,
+        errCode = clGetProgramBuildInfo(program, deviceID,
                     CL_PROGRAM_BUILD_LOG, logLen, buffErr, NULL);
         if (errCode) {
             printf("clGetProgramBuildInfo failed at line %d\n", __LINE__);
@@ -198,14 +486,151 @@ void setupPhysics(char* source_str, size_t source_size) {
         fprintf(stderr, "clBuildProgram failed\n");
         exit(EXIT_FAILURE);
     }
+    if (cacheable) {
+        storeCachedProgram(program, cachePath, cacheKey);
+    }
+    printf("Kernels built from source in %.1fms\n",
+           nanosecondsToMilliseconds(nowNanoseconds() - buildStart));
+    return program;
+}
 
-    // Create Physics Engine kernel
-    physicsKernel = clCreateKernel(physicsProgram, "physicsEngineKernel", &err);
 
-    // Set argument for Physics Engine kernel
-    err = clSetKernelArg(physicsKernel, 0, sizeof(cl_mem), (void*)&physicsSatelitesBuffer);
+// Creates the Physics Engine kernel working on satelitesBuffer
+void createPhysicsKernel(cl_mem satelitesBuffer) {
+
+    physicsKernel = clCreateKernel(physicsProgram, PHYSICS_KERNEL_NAME, &err);
+    assert(err == CL_SUCCESS);
+
+    // Set arguments for Physics Engine kernel
+    cl_int windowWidth = WINDOW_WIDTH;
+    cl_int windowHeight = WINDOW_HEIGHT;
+    cl_int physicsUpdatesPerFrame = PHYSICSUPDATESPERFRAME;
+    err = clSetKernelArg(physicsKernel, 0, sizeof(cl_mem), (void*)&satelitesBuffer);
+    err |= clSetKernelArg(physicsKernel, 1, sizeof(cl_int), &windowWidth);
+    err |= clSetKernelArg(physicsKernel, 2, sizeof(cl_int), &windowHeight);
+    err |= clSetKernelArg(physicsKernel, 3, sizeof(cl_int), &physicsUpdatesPerFrame);
+    assert(err == CL_SUCCESS);
+}
+
+
+// Creates the Graphics Engine kernel, the pixel buffer is argument 1
+void createGraphicsKernel(cl_mem satelitesBuffer, cl_mem pixelBuffer) {
+
+    graphicsKernel = clCreateKernel(graphicsProgram, GRAPHICS_KERNEL_NAME, &err);
+    assert(err == CL_SUCCESS);
+
+    // Set arguments for Graphics Engine kernel
+    cl_int windowWidth = WINDOW_WIDTH;
+    cl_int sateliteCount = SATELITE_COUNT;
+    err = clSetKernelArg(graphicsKernel, 0, sizeof(cl_mem), (void *)&satelitesBuffer);
+    err |= clSetKernelArg(graphicsKernel, 1, sizeof(cl_mem), (void *)&pixelBuffer);
+    err |= clSetKernelArg(graphicsKernel, 2, sizeof(cl_int), &windowWidth);
+    err |= clSetKernelArg(graphicsKernel, 3, sizeof(cl_int), &sateliteCount);
+    assert(err == CL_SUCCESS);
+}
+
+
+// Creates the N-body kernel and its second satelite buffer in the
+// physics context. The buffers are set per substep.
+void setupNbody() {
+
+    nbodySatelitesBuffer = clCreateBuffer(physicsContext, CL_MEM_READ_WRITE,
+                    TOTAL_SATELLITE_SIZE, NULL, &err);
+    assert(err == CL_SUCCESS);
+
+    nbodyKernel = clCreateKernel(physicsProgram, "nbodyPhysicsEngineKernel", &err);
+    assert(err == CL_SUCCESS);
+
+    cl_int sateliteCount = SATELITE_COUNT;
+    cl_int windowWidth = WINDOW_WIDTH;
+    cl_int windowHeight = WINDOW_HEIGHT;
+    cl_float sateliteGravity = GRAVITY * nbodyMass;
+    cl_float softening2 = nbodySoftening * nbodySoftening;
+    cl_float deltaTime = (double)DELTATIME / nbodySteps;
+    err = clSetKernelArg(nbodyKernel, 2, sizeof(cl_float) * 4 * NBODY_LOCAL_SIZE, NULL);
+    err |= clSetKernelArg(nbodyKernel, 3, sizeof(cl_int), &sateliteCount);
+    err |= clSetKernelArg(nbodyKernel, 4, sizeof(cl_int), &windowWidth);
+    err |= clSetKernelArg(nbodyKernel, 5, sizeof(cl_int), &windowHeight);
+    err |= clSetKernelArg(nbodyKernel, 6, sizeof(cl_float), &sateliteGravity);
+    err |= clSetKernelArg(nbodyKernel, 7, sizeof(cl_float), &softening2);
+    err |= clSetKernelArg(nbodyKernel, 8, sizeof(cl_float), &deltaTime);
+    assert(err == CL_SUCCESS);
+}
+
+
+// Enqueues the N-body substeps of one frame. The first waits for
+// waitList, done signals the last command, which leaves the result in
+// physicsSatelitesBuffer.
+void enqueueNbodyPhysics(cl_uint waitCount, const cl_event *waitList,
+                         cl_event *done) {
+
+    size_t local_size_nbody = NBODY_LOCAL_SIZE;
+    size_t global_size = (SATELITE_COUNT + NBODY_LOCAL_SIZE - 1) /
+        NBODY_LOCAL_SIZE * NBODY_LOCAL_SIZE;
+    cl_mem buffers[2] = {physicsSatelitesBuffer, nbodySatelitesBuffer};
+
+    for (int step = 0; step < nbodySteps; ++step) {
+        int last = step == nbodySteps - 1;
+        err = clSetKernelArg(nbodyKernel, 0, sizeof(cl_mem), &buffers[step % 2]);
+        err |= clSetKernelArg(nbodyKernel, 1, sizeof(cl_mem), &buffers[1 - step % 2]);
+        err |= clEnqueueNDRangeKernel(physicsCommandQueue, nbodyKernel,
+                    1, NULL, &global_size, &local_size_nbody,
+                    step == 0 ? waitCount : 0, step == 0 ? waitList : NULL,
+                    last && nbodySteps % 2 == 0 ? done : NULL);
+        assert(err == CL_SUCCESS);
+    }
+
+    // An odd number of substeps ends in the second buffer
+    if (nbodySteps % 2 == 1) {
+        err = clEnqueueCopyBuffer(physicsCommandQueue, nbodySatelitesBuffer,
+                    physicsSatelitesBuffer, 0, 0, TOTAL_SATELLITE_SIZE,
+                    0, NULL, done);
+        assert(err == CL_SUCCESS);
+    }
+}
+
+
+// Global size of the Graphics Engine for the work-group size local
+void graphicsGlobalSize(const size_t local[2], size_t global[2]) {
+    global[0] = WINDOW_HEIGHT;
+    global[1] = WINDOW_WIDTH;
+    if (localGraphics) {
+        // Work-items of a row, rounded up to whole work-groups. The kernel
+        // leaves out the pixels past the right edge.
+        size_t items = (WINDOW_WIDTH + GRAPHICS_PIXELS_PER_ITEM - 1) /
+                    GRAPHICS_PIXELS_PER_ITEM;
+        global[1] = (items + local[1] - 1) / local[1] * local[1];
+    }
+}
+
+
+// Setup the CL properties for the Physics Engine
+void setupPhysics(char* source_str, size_t source_size) {
+
+    // CPU performs physics engine better
+    cl_device_id cpuID = getDeviceID(CL_DEVICE_TYPE_CPU);
+    physicsDevice = cpuID;
+
+    // Create context for Physics Engine
+    physicsContext = clCreateContext(NULL, 1, &cpuID, NULL, NULL, &err);
     assert(err == CL_SUCCESS);
 
+    // Create command queue for Physics Engine
+    physicsCommandQueue = clCreateCommandQueue(physicsContext, cpuID, 0, &err);
+    assert(err == CL_SUCCESS);
+
+    // Create buffer for satellites in Physics Engine
+    physicsSatelitesBuffer = clCreateBuffer(physicsContext, CL_MEM_USE_HOST_PTR, 
+                    TOTAL_SATELLITE_SIZE, satelites, &err);
+
+    clFinish(physicsCommandQueue);
+
+    // Build the program for the CPU
+    physicsProgram = buildProgram(physicsContext, cpuID, source_str, source_size);
+
+    // Create Physics Engine kernel
+    createPhysicsKernel(physicsSatelitesBuffer);
+
     clFinish(physicsCommandQueue);
 
 }
@@ -215,14 +640,17 @@ void setupPhysics(char* source_str, size_t source_size) {
 void setupGraphics(char* source_str, size_t source_size) {
 
     // GPU performs graphics engine better
-    cl_device_id gpuID = getDeviceID(CL_DEVICE_TYPE_GPU);
+    cl_device_id gpuID = getDeviceID(graphicsDeviceType);
+    graphicsDevice = gpuID;
 
     // Create context for Graphics Engine
     graphicsContext = clCreateContext(NULL, 1, &gpuID, NULL, NULL, &err);
     assert(err == CL_SUCCESS);
 
-    // Create command queue for Graphics Engine
-    graphicsCommandQueue = clCreateCommandQueue(graphicsContext, gpuID, 0, &err);
+    // Create command queue for Graphics Engine, hybrid rendering times
+    // its commands
+    graphicsCommandQueue = clCreateCommandQueue(graphicsContext, gpuID,
+                hybridRendering ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
     assert(err == CL_SUCCESS);
 
     // Create buffer for satellites and pixels in Graphics Engine
@@ -230,59 +658,345 @@ void setupGraphics(char* source_str, size_t source_size) {
                     TOTAL_SATELLITE_SIZE, satelites, &err);
     assert(err == CL_SUCCESS);
 
-    pixelsBuffer = clCreateBuffer(graphicsContext, CL_MEM_USE_HOST_PTR, 
-                    TOTAL_PIXEL_SIZE, pixels, &err); 
-    assert(err == CL_SUCCESS); 
+    // Hybrid rendering writes the host rows while the kernel runs, so the
+    // device gets a buffer of its own instead of the host pixels
+    if (hybridRendering) {
+        pixelsBuffer = clCreateBuffer(graphicsContext, CL_MEM_WRITE_ONLY,
+                        TOTAL_PIXEL_SIZE, NULL, &err);
+    } else {
+        pixelsBuffer = clCreateBuffer(graphicsContext, CL_MEM_USE_HOST_PTR,
+                        TOTAL_PIXEL_SIZE, HOST_PIXELS, &err);
+    }
+    assert(err == CL_SUCCESS);
 
     clFinish(graphicsCommandQueue);
 
-    // Create program from source string
-    graphicsProgram = clCreateProgramWithSource(graphicsContext, 1, (const char **)&source_str,
-                    (const size_t *)&source_size, &err);
+    // Build the program for the GPU
+    graphicsProgram = buildProgram(graphicsContext, gpuID, source_str, source_size);
+
+    // Create Graphics Engine kernel
+    createGraphicsKernel(graphicsSatelitesBuffer, pixelsBuffer);
+
+    clFinish(graphicsCommandQueue);
+
+}
+
+
+// Setup one context, queues and buffers for both engines
+void setupSingleContext(char* source_str, size_t source_size) {
+
+    cl_device_id gpuID = getDeviceID(graphicsDeviceType);
+    physicsDevice = gpuID;
+    graphicsDevice = gpuID;
+
+    physicsContext = clCreateContext(NULL, 1, &gpuID, NULL, NULL, &err);
     assert(err == CL_SUCCESS);
+    graphicsContext = physicsContext;
 
-    // Build the program and print error if exist
-    err = clBuildProgram(graphicsProgram, 1, &gpuID, option, NULL, NULL);
-    if (err != CL_SUCCESS) {
-        char* buffErr;
-        cl_int errCode;
-        size_t logLen;
+    // Two in-order queues so the satelite copy and the pixel map of one
+    // frame can overlap the kernels of the other engine
+    physicsCommandQueue = clCreateCommandQueue(physicsContext, gpuID, 0, &err);
+    assert(err == CL_SUCCESS);
+    graphicsCommandQueue = clCreateCommandQueue(graphicsContext, gpuID, 0, &err);
+    assert(err == CL_SUCCESS);
 
-        errCode = clGetProgramBuildInfo(graphicsProgram, gpuID,
-                    CL_PROGRAM_BUILD_LOG, 0, NULL, &logLen);
-        if (errCode) {
-            printf("clGetProgramBuildInfo failed at line %d\n", errCode);
-            exit(-1);
-        }
+    // The satelites live on the device, physics output is graphics input
+    physicsSatelitesBuffer = clCreateBuffer(physicsContext,
+                    CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                    TOTAL_SATELLITE_SIZE, satelites, &err);
+    assert(err == CL_SUCCESS);
+    graphicsSatelitesBuffer = physicsSatelitesBuffer;
+
+    // Pinned host memory for the pixels, mapped instead of copied
+    for (int b = 0; b < 2; ++b) {
+        pinnedPixelsBuffers[b] = clCreateBuffer(graphicsContext,
+                    CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                    TOTAL_PIXEL_SIZE, NULL, &err);
+        assert(err == CL_SUCCESS);
+    }
 
-        buffErr = malloc(logLen);
-        if (!buffErr) {
-            printf("Malloc failed at line %d\n", __LINE__);
-            exit(-2);
+    physicsProgram = buildProgram(physicsContext, gpuID, source_str, source_size);
+    graphicsProgram = physicsProgram;
+
+    createPhysicsKernel(physicsSatelitesBuffer);
+    createGraphicsKernel(graphicsSatelitesBuffer, pinnedPixelsBuffers[0]);
+
+}
+
+
+// Copies a mapped pixel buffer to the pixels and unmaps it. The unmap is
+// ordered before the next kernel that writes the buffer by the in-order
+// graphics queue.
+void finishPixels(int b) {
+
+    TRACE_BEGIN(mapStart);
+    err = clWaitForEvents(1, &pixelsMapped[b]);
+    assert(err == CL_SUCCESS);
+    TRACE_END(0, "pixels map wait", b, mapStart);
+    clReleaseEvent(pixelsMapped[b]);
+    pixelsMapped[b] = NULL;
+
+    memcpy(HOST_PIXELS, mappedPixels[b], TOTAL_PIXEL_SIZE);
+
+    err = clEnqueueUnmapMemObject(graphicsCommandQueue, pinnedPixelsBuffers[b],
+                mappedPixels[b], 0, NULL, NULL);
+    assert(err == CL_SUCCESS);
+    mappedPixels[b] = NULL;
+}
+
+
+// Parses a work-group size "RxC" (dims 2) or "N" (dims 1), 0 on failure
+int parseLocalSize(const char *value, size_t local[2], int dims) {
+    char *end;
+    local[0] = strtoul(value, &end, 10);
+    if (end == value) {
+        return 0;
+    }
+    if (dims == 2) {
+        if (*end != 'x') {
+            return 0;
+        }
+        value = end + 1;
+        local[1] = strtoul(value, &end, 10);
+        if (end == value) {
+            return 0;
         }
+    }
+    return *end == '\0' || *end == '\n';
+}
 
-        errCode = clGetProgramBuildInfo(graphicsProgram, gpuID,
-                    CL_PROGRAM_BUILD_LOG, logLen, buffErr, NULL);
-        if (errCode) {
-            printf("clGetProgramBuildInfo failed at line %d\n", __LINE__);
-            exit(-3);
+
+// Whether the Graphics Engine can run with work-group size local. The
+// plain kernels cover the window exactly, so local has to divide it; the
+// local memory kernel rounds its columns up to whole work-groups.
+int graphicsLocalSizeLegal(const size_t local[2], size_t maxGroup,
+                           const size_t maxItems[3]) {
+    return local[0] > 0 && local[1] > 0 &&
+           local[0] <= maxItems[0] && local[1] <= maxItems[1] &&
+           local[0] * local[1] <= maxGroup &&
+           WINDOW_HEIGHT % local[0] == 0 &&
+           (localGraphics || WINDOW_WIDTH % local[1] == 0);
+}
+
+
+// Best time in nanoseconds of WORK_GROUP_TUNING_RUNS launches after a
+// warm-up launch, -1 if the runtime rejects the work-group size
+long long timeLaunches(cl_command_queue queue, cl_kernel kernel, cl_uint dims,
+                       const size_t *global, const size_t *local) {
+    long long best = -1;
+    clFinish(queue);
+    for (int run = 0; run <= WORK_GROUP_TUNING_RUNS; ++run) {
+        long long start = nowNanoseconds();
+        if (clEnqueueNDRangeKernel(queue, kernel, dims, NULL, global, local,
+                    0, NULL, NULL) != CL_SUCCESS || clFinish(queue) != CL_SUCCESS) {
+            return -1;
+        }
+        long long time = nowNanoseconds() - start;
+        if (run > 0 && (best < 0 || time < best)) {
+            best = time;
         }
+    }
+    return best;
+}
 
-        fprintf(stderr, "Build log: \n%s\n", buffErr); //Be careful with  the fprint
-        free(buffErr);
-        fprintf(stderr, "clBuildProgram failed\n");
+
+// File of the tuned work-group size of kernel on device, next to the
+// program binaries. 0 when the cache is off.
+int workGroupCachePath(cl_device_id deviceID, const char *kernelName,
+                       char *path, size_t pathSize) {
+    char buildOptions[512], key[2048], binaryPath[1100];
+    programBuildOptions(buildOptions, sizeof(buildOptions));
+    if (!programCacheEntry(deviceID, buildOptions, key, sizeof(key),
+                           binaryPath, sizeof(binaryPath))) {
+        return 0;
+    }
+    binaryPath[strlen(binaryPath) - strlen(".bin")] = '\0';
+    snprintf(path, pathSize, "%s.%s.worksize", binaryPath, kernelName);
+    return 1;
+}
+
+int loadWorkGroupSize(const char *path, size_t local[2], int dims) {
+    size_t size;
+    char *data = readWholeFile(path, &size);
+    int loaded = data != NULL && parseLocalSize(data, local, dims);
+    free(data);
+    return loaded;
+}
+
+void storeWorkGroupSize(const char *path, const size_t local[2], int dims) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return;
+    }
+    if (dims == 2) {
+        fprintf(f, "%zux%zu\n", local[0], local[1]);
+    } else {
+        fprintf(f, "%zu\n", local[0]);
+    }
+    fclose(f);
+}
+
+
+// Times the Graphics Engine with every legal power of two work-group
+// size whose item count is a multiple of the preferred one and keeps the
+// fastest. The kernel only writes pixels, which the first frame renders
+// again.
+void tuneGraphicsLocalSize() {
+
+    size_t maxGroup, multiple, maxItems[3];
+    err = clGetKernelWorkGroupInfo(graphicsKernel, graphicsDevice,
+                CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxGroup), &maxGroup, NULL);
+    err |= clGetKernelWorkGroupInfo(graphicsKernel, graphicsDevice,
+                CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                sizeof(multiple), &multiple, NULL);
+    err |= clGetDeviceInfo(graphicsDevice, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                sizeof(maxItems), maxItems, NULL);
+    assert(err == CL_SUCCESS);
+
+    // Without a size that fills the preferred multiple take any legal one
+    long long bestTime = -1;
+    for (int pass = 0; pass < 2 && bestTime < 0; ++pass) {
+        for (size_t rows = 1; rows <= maxGroup; rows *= 2) {
+            for (size_t columns = 1; rows * columns <= maxGroup; columns *= 2) {
+                size_t local[2] = {rows, columns};
+                if (!graphicsLocalSizeLegal(local, maxGroup, maxItems) ||
+                    (pass == 0 && (rows * columns) % multiple != 0)) {
+                    continue;
+                }
+                size_t global[2];
+                graphicsGlobalSize(local, global);
+                long long time = timeLaunches(graphicsCommandQueue,
+                            graphicsKernel, 2, global, local);
+                if (time >= 0 && (bestTime < 0 || time < bestTime)) {
+                    bestTime = time;
+                    local_size[0] = rows;
+                    local_size[1] = columns;
+                }
+            }
+        }
+    }
+    if (bestTime < 0) {
+        fprintf(stderr, "No work-group size works for the Graphics Engine\n");
         exit(EXIT_FAILURE);
-    }   
+    }
+}
 
-    // Create Graphics Engine kernel
-    graphicsKernel = clCreateKernel(graphicsProgram, "graphicsEngineKernel", &err);
 
-    // Set arguments for Graphics Engine kernel
-    err = clSetKernelArg(graphicsKernel, 0, sizeof(cl_mem), (void *)&graphicsSatelitesBuffer);
-    err = clSetKernelArg(graphicsKernel, 1, sizeof(cl_mem), (void *)&pixelsBuffer);
+// Times the Physics Engine with the runtime's choice and every power of
+// two work-group size that divides the satelite count. The launches step
+// a scratch copy of the satelites.
+void tunePhysicsLocalSize() {
+
+    size_t maxGroup, maxItems[3];
+    err = clGetKernelWorkGroupInfo(physicsKernel, physicsDevice,
+                CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxGroup), &maxGroup, NULL);
+    err |= clGetDeviceInfo(physicsDevice, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                sizeof(maxItems), maxItems, NULL);
     assert(err == CL_SUCCESS);
 
-    clFinish(graphicsCommandQueue);
+    cl_mem scratch = clCreateBuffer(physicsContext,
+                CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                TOTAL_SATELLITE_SIZE, satelites, &err);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(physicsKernel, 0, sizeof(cl_mem), (void*)&scratch);
+    assert(err == CL_SUCCESS);
+
+    size_t global = SATELITE_COUNT;
+    long long bestTime = timeLaunches(physicsCommandQueue, physicsKernel, 1,
+                &global, NULL);
+    physics_local_size = 0;
+    for (size_t local = 1; local <= maxGroup && local <= maxItems[0]; local *= 2) {
+        if (SATELITE_COUNT % local != 0) {
+            continue;
+        }
+        long long time = timeLaunches(physicsCommandQueue, physicsKernel, 1,
+                    &global, &local);
+        if (time >= 0 && (bestTime < 0 || time < bestTime)) {
+            bestTime = time;
+            physics_local_size = local;
+        }
+    }
+
+    err = clSetKernelArg(physicsKernel, 0, sizeof(cl_mem),
+                (void*)&physicsSatelitesBuffer);
+    assert(err == CL_SUCCESS);
+    clReleaseMemObject(scratch);
+}
+
+
+// Chooses the work-group sizes of the engines. The environment variables
+// GRAPHICS_LOCAL_SIZE (rows x columns, e.g. 8x8) and PHYSICS_LOCAL_SIZE
+// (0 = the runtime's choice) override them. Otherwise the sizes tuned
+// for the device, kernel and problem size are loaded from the program
+// cache, or tuned now and stored there.
+void setLocalSize() {
+
+    long long tuneStart = nowNanoseconds();
+    char path[1200];
+    const char *value;
+    const char *graphicsSource = "tuned";
+    size_t maxGroup, maxItems[3];
+    err = clGetKernelWorkGroupInfo(graphicsKernel, graphicsDevice,
+                CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxGroup), &maxGroup, NULL);
+    err |= clGetDeviceInfo(graphicsDevice, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                sizeof(maxItems), maxItems, NULL);
+    assert(err == CL_SUCCESS);
+
+    int cached = workGroupCachePath(graphicsDevice, GRAPHICS_KERNEL_NAME,
+                path, sizeof(path));
+    if ((value = getenv("GRAPHICS_LOCAL_SIZE")) != NULL && *value != '\0') {
+        if (!parseLocalSize(value, local_size, 2) ||
+            !graphicsLocalSizeLegal(local_size, maxGroup, maxItems)) {
+            fprintf(stderr, "Invalid GRAPHICS_LOCAL_SIZE for this device and "
+                            "window: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        graphicsSource = "from GRAPHICS_LOCAL_SIZE";
+    } else if (cached && loadWorkGroupSize(path, local_size, 2) &&
+               graphicsLocalSizeLegal(local_size, maxGroup, maxItems)) {
+        graphicsSource = "cached";
+    } else {
+        tuneGraphicsLocalSize();
+        if (cached) {
+            storeWorkGroupSize(path, local_size, 2);
+        }
+    }
+
+    // The N-body kernel has its own fixed work-group size
+    const char *physicsSource = "tuned";
+    size_t physicsLocal[2] = {0, 0};
+    cached = workGroupCachePath(physicsDevice, PHYSICS_KERNEL_NAME,
+                path, sizeof(path));
+    if (nbodyMode) {
+        physicsSource = "N-body";
+    } else if ((value = getenv("PHYSICS_LOCAL_SIZE")) != NULL && *value != '\0') {
+        if (!parseLocalSize(value, physicsLocal, 1) ||
+            (physicsLocal[0] != 0 && SATELITE_COUNT % physicsLocal[0] != 0)) {
+            fprintf(stderr, "Invalid PHYSICS_LOCAL_SIZE: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        physics_local_size = physicsLocal[0];
+        physicsSource = "from PHYSICS_LOCAL_SIZE";
+    } else if (cached && loadWorkGroupSize(path, physicsLocal, 1) &&
+               (physicsLocal[0] == 0 || SATELITE_COUNT % physicsLocal[0] == 0)) {
+        physics_local_size = physicsLocal[0];
+        physicsSource = "cached";
+    } else {
+        tunePhysicsLocalSize();
+        physicsLocal[0] = physics_local_size;
+        if (cached) {
+            storeWorkGroupSize(path, physicsLocal, 1);
+        }
+    }
+
+    printf("Work-group sizes: graphics %zux%zu (%s), physics ",
+           local_size[0], local_size[1], graphicsSource);
+    if (physics_local_size) {
+        printf("%zu (%s)", physics_local_size, physicsSource);
+    } else {
+        printf("runtime default (%s)", physicsSource);
+    }
+    printf(" in %.1fms\n", nanosecondsToMilliseconds(nowNanoseconds() - tuneStart));
 
 }
 
@@ -291,26 +1005,62 @@ void setupGraphics(char* source_str, size_t source_size) {
 void init(){
 
     // Read source code from file
-    FILE *f;
     char *source_str;
     size_t source_size;
 
-    f = fopen("parallel.cl", "r");
-    if (!f) {
+    source_str = readWholeFile("parallel.cl", &source_size);
+    if (source_str == NULL) {
         fprintf(stderr, "Failed to load kernel.\n");
         exit(1);
     }
-    source_str = (char*)malloc(MAX_SOURCE_SIZE);
-    source_size = fread(source_str, 1, MAX_SOURCE_SIZE, f);
-    fclose(f);
+
+    // The program cache key covers the included header too
+    size_t header_size;
+    char *header_str = readWholeFile("parallel.h", &header_size);
+    programSourceHash = hashBytes(HASH_SEED, source_str, source_size);
+    if (header_str != NULL) {
+        programSourceHash = hashBytes(programSourceHash, header_str,
+                                      header_size);
+        free(header_str);
+    }
+
+    if (pixelFormat == PIXEL_FORMAT_RGBA8) {
+        pixelsRGBA8 = allocateRGBA8(SIZE);
+    }
+
+    // The host drives both queues from one thread
+    traceStart(options.traceFile, 1);
+    if (localGraphics) {
+        printf("Graphics kernel: local memory satelite tiles, %d pixels "
+               "per work-item\n", GRAPHICS_PIXELS_PER_ITEM);
+    }
    
     // Set up engines
-    setupPhysics(source_str, source_size);
-    setupGraphics(source_str, source_size);
+    if (singleContextMode) {
+        setupSingleContext(source_str, source_size);
+    } else {
+        setupPhysics(source_str, source_size);
+        setupGraphics(source_str, source_size);
+    }
+    free(source_str);
+    if (nbodyMode) {
+        setupNbody();
+        printf("N-body: direct, %d steps per frame\n", nbodySteps);
+    }
     
     // Set workgroup size in Graphics Engine
     setLocalSize();
 
+    // Hybrid rendering starts from an even split of the work-group rows
+    if (hybridRendering) {
+        hybridShader = selectPixelShader();
+        initRenderSatelites(&hybridSnapshot, SATELITE_COUNT);
+        int groups = WINDOW_HEIGHT / (int)local_size[0];
+        hybridRows = (groups + 1) / 2 * (int)local_size[0];
+        printf("Hybrid rendering: OpenCL + OpenMP rows, shader %s\n",
+               hybridShader.name);
+    }
+
 }
 
 
@@ -324,16 +1074,170 @@ void parallelPhysicsEngine(){
     // Total number of satellites
     size_t global_size = SATELITE_COUNT;
 
+    TRACE_BEGIN(enqueueStart);
+    if (singleContextMode) {
+        // Must not overwrite the satelites the previous frame renders
+        cl_uint waitCount = graphicsDone != NULL;
+        if (physicsDone != NULL) {
+            clReleaseEvent(physicsDone);
+        }
+        if (nbodyMode) {
+            enqueueNbodyPhysics(waitCount, waitCount ? &graphicsDone : NULL,
+                                &physicsDone);
+        } else {
+            err = clEnqueueNDRangeKernel(physicsCommandQueue, physicsKernel,
+                        1, NULL, &global_size, PHYSICS_LOCAL_SIZE,
+                        waitCount, waitCount ? &graphicsDone : NULL, &physicsDone);
+            assert(err == CL_SUCCESS);
+        }
+
+        // Small copy for the host side checks, waited for in the graphics
+        // engine unless the check below needs it right away
+        err = clEnqueueReadBuffer(physicsCommandQueue, physicsSatelitesBuffer,
+                    CL_FALSE, 0, TOTAL_SATELLITE_SIZE, satelites, 0, NULL,
+                    &satelitesRead);
+        assert(err == CL_SUCCESS);
+        clFlush(physicsCommandQueue);
+        TRACE_END(0, "physics enqueue", (int)frameNumber, enqueueStart);
+
+        if (frameNumber < 2) {
+            TRACE_BEGIN(readStart);
+            clWaitForEvents(1, &satelitesRead);
+            TRACE_END(0, "satelites read wait", (int)frameNumber, readStart);
+        }
+        return;
+    }
+
     // Execute the Physics Engine kernel
-    err = clEnqueueNDRangeKernel(physicsCommandQueue, physicsKernel, 
-                1, NULL, &global_size, NULL, 0, NULL, NULL);
+    if (nbodyMode) {
+        enqueueNbodyPhysics(0, NULL, &k_events);
+    } else {
+        err = clEnqueueNDRangeKernel(physicsCommandQueue, physicsKernel,
+                    1, NULL, &global_size, PHYSICS_LOCAL_SIZE, 0, NULL, &k_events);
+    }
+    TRACE_END(0, "physics enqueue", (int)frameNumber, enqueueStart);
 
     // Wait for finishing in the first frames, after this 
     // Graphics Engine can take data simultaneously.
     if (frameNumber < 2) {
+      TRACE_BEGIN(finishStart);
       clFinish(physicsCommandQueue);
+      TRACE_END(0, "physics wait", (int)frameNumber, finishStart);
+    }
+
+}
+
+
+// Renders rows [begin, end) on the host with hybridShader
+void renderHostRows(int begin, int end) {
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int row = begin; row < end; ++row) {
+        if (pixelFormat == PIXEL_FORMAT_RGBA8) {
+            // Packed a span at a time from a float span
+            float span[3 * HYBRID_SPAN];
+            for (int x0 = 0; x0 < WINDOW_WIDTH; x0 += HYBRID_SPAN) {
+                int x1 = x0 + HYBRID_SPAN < WINDOW_WIDTH ?
+                         x0 + HYBRID_SPAN : WINDOW_WIDTH;
+                hybridShader.shade(&hybridSnapshot, SATELITE_RADIUS, row,
+                                   x0, x1, span);
+                convertSpanRGBA8(span,
+                                 &pixelsRGBA8[4 * ((size_t)row * WINDOW_WIDTH + x0)],
+                                 x1 - x0);
+            }
+        } else {
+            hybridShader.shade(&hybridSnapshot, SATELITE_RADIUS, row,
+                               0, WINDOW_WIDTH,
+                               &pixels[(size_t)row * WINDOW_WIDTH].red);
+        }
+    }
+}
+
+
+// Moves the split towards the measured rates of the last frame
+void updateHybridSplit(int rowsCL, long long timeCL, long long timeHost) {
+
+    int rowsHost = WINDOW_HEIGHT - rowsCL;
+    if (rowsCL > 0 && timeCL > 0) {
+        double rate = (double)rowsCL / timeCL;
+        hybridRateCL = hybridRateCL > 0.0 ? HYBRID_SMOOTHING * hybridRateCL +
+                       (1.0 - HYBRID_SMOOTHING) * rate : rate;
+    }
+    if (rowsHost > 0 && timeHost > 0) {
+        double rate = (double)rowsHost / timeHost;
+        hybridRateHost = hybridRateHost > 0.0 ? HYBRID_SMOOTHING * hybridRateHost +
+                         (1.0 - HYBRID_SMOOTHING) * rate : rate;
+    }
+    if (hybridRateCL <= 0.0 || hybridRateHost <= 0.0) {
+        return;
+    }
+
+    // Whole work-groups, and both sides keep at least one so their rates
+    // stay measured
+    int group = local_size[0];
+    int groups = WINDOW_HEIGHT / group;
+    int groupsCL = (int)(groups * hybridRateCL /
+                         (hybridRateCL + hybridRateHost) + 0.5);
+    if (groups >= 2) {
+        groupsCL = groupsCL < 1 ? 1 : groupsCL > groups - 1 ? groups - 1 : groupsCL;
+    }
+    hybridRows = groupsCL * group;
+}
+
+
+// Hybrid Graphics Engine: kernel rows and host rows at the same time
+void renderHybrid() {
+
+    int rowsCL = hybridRows;
+    size_t rowBytes = TOTAL_PIXEL_SIZE / WINDOW_HEIGHT;
+    cl_event kernelDone = NULL, readDone = NULL;
+
+    TRACE_BEGIN(kernelStart);
+    if (rowsCL > 0) {
+        size_t global_size[2];
+        graphicsGlobalSize(local_size, global_size);
+        global_size[0] = rowsCL;
+        err = clEnqueueNDRangeKernel(graphicsCommandQueue, graphicsKernel,
+                    2, NULL, global_size, local_size, 0, NULL, &kernelDone);
+        err |= clEnqueueReadBuffer(graphicsCommandQueue, pixelsBuffer, CL_FALSE,
+                    0, rowBytes * rowsCL, HOST_PIXELS, 0, NULL, &readDone);
+        assert(err == CL_SUCCESS);
+        clFlush(graphicsCommandQueue);
+    }
+
+    // The host rows meanwhile
+    long long hostStart = nowNanoseconds();
+    for (int j = 0; j < SATELITE_COUNT; ++j) {
+        hybridSnapshot.x[j] = satelites[j].position.x;
+        hybridSnapshot.y[j] = satelites[j].position.y;
+        hybridSnapshot.red[j] = satelites[j].identifier.red;
+        hybridSnapshot.green[j] = satelites[j].identifier.green;
+        hybridSnapshot.blue[j] = satelites[j].identifier.blue;
     }
+    renderHostRows(rowsCL, WINDOW_HEIGHT);
+    long long timeHost = nowNanoseconds() - hostStart;
+    TRACE_END(0, "hybrid host rows", WINDOW_HEIGHT - rowsCL, hostStart);
+
+    long long timeCL = 0;
+    if (rowsCL > 0) {
+        err = clWaitForEvents(1, &readDone);
+        assert(err == CL_SUCCESS);
+        cl_ulong queued, end;
+        err = clGetEventProfilingInfo(kernelDone, CL_PROFILING_COMMAND_QUEUED,
+                    sizeof(queued), &queued, NULL);
+        err |= clGetEventProfilingInfo(readDone, CL_PROFILING_COMMAND_END,
+                    sizeof(end), &end, NULL);
+        if (err == CL_SUCCESS && end > queued) {
+            timeCL = end - queued;
+        }
+        clReleaseEvent(kernelDone);
+        clReleaseEvent(readDone);
+    }
+    TRACE_END(0, "hybrid kernel rows", rowsCL, kernelStart);
 
+    hybridRowsSum += rowsCL;
+    ++hybridFrames;
+    updateHybridSplit(rowsCL, timeCL, timeHost);
 }
 
 
@@ -342,53 +1246,191 @@ void parallelPhysicsEngine(){
 // Decides the color for each pixel.
 void parallelGraphicsEngine(){
 
+    // Total number of pixels
+    size_t global_size[2];
+    graphicsGlobalSize(local_size, global_size);
+
+    if (singleContextMode) {
+        int b = currentPixelsBuffer;
+
+        // Render straight from the physics output
+        TRACE_BEGIN(enqueueStart);
+        err = clSetKernelArg(graphicsKernel, 1, sizeof(cl_mem),
+                    (void *)&pinnedPixelsBuffers[b]);
+        if (graphicsDone != NULL) {
+            clReleaseEvent(graphicsDone);
+        }
+        err |= clEnqueueNDRangeKernel(graphicsCommandQueue, graphicsKernel,
+                    2, NULL, global_size, local_size, 1, &physicsDone,
+                    &graphicsDone);
+        assert(err == CL_SUCCESS);
+
+        mappedPixels[b] = clEnqueueMapBuffer(graphicsCommandQueue,
+                    pinnedPixelsBuffers[b], CL_FALSE, CL_MAP_READ, 0,
+                    TOTAL_PIXEL_SIZE, 0, NULL, &pixelsMapped[b], &err);
+        assert(err == CL_SUCCESS);
+        clFlush(graphicsCommandQueue);
+        TRACE_END(0, "graphics enqueue", (int)frameNumber, enqueueStart);
+
+        TRACE_BEGIN(readStart);
+        clWaitForEvents(1, &satelitesRead);
+        clReleaseEvent(satelitesRead);
+        satelitesRead = NULL;
+        TRACE_END(0, "satelites read wait", (int)frameNumber, readStart);
+
+        if (frameNumber < 2) {
+            // The error check needs this frame's pixels
+            finishPixels(b);
+        } else {
+            // Show the previous frame, this one maps while the next runs
+            if (pendingPixelsBuffer >= 0) {
+                finishPixels(pendingPixelsBuffer);
+            }
+            pendingPixelsBuffer = b;
+        }
+        currentPixelsBuffer = 1 - b;
+        return;
+    }
+
     // Wait for Physics Engine
+    TRACE_BEGIN(physicsWaitStart);
     err = clWaitForEvents(1, &k_events);
-
-    // Total number of pixels
-    size_t global_size[2] = {WINDOW_HEIGHT, WINDOW_WIDTH};
+    clReleaseEvent(k_events);
+    TRACE_END(0, "physics wait", (int)frameNumber, physicsWaitStart);
 
     // Write satellite data to buffer
+    TRACE_BEGIN(writeStart);
     err = clEnqueueWriteBuffer(graphicsCommandQueue, graphicsSatelitesBuffer,
                 CL_TRUE, 0, TOTAL_SATELLITE_SIZE, satelites, 0, NULL, NULL);
     clFinish(graphicsCommandQueue);
+    TRACE_END(0, "satelites write", (int)frameNumber, writeStart);
+
+    if (hybridRendering) {
+        renderHybrid();
+        return;
+    }
 
     // Execute the Graphics Engine kernel
+    TRACE_BEGIN(kernelStart);
     err = clEnqueueNDRangeKernel(graphicsCommandQueue, graphicsKernel, 
                 2, NULL, global_size, local_size, 0, NULL, NULL);
     clFinish(graphicsCommandQueue);
+    TRACE_END(0, "graphics kernel", (int)frameNumber, kernelStart);
 
     // Read pixel data from buffer
+    TRACE_BEGIN(readStart);
     err = clEnqueueReadBuffer(graphicsCommandQueue, pixelsBuffer, CL_TRUE,
-                0, TOTAL_PIXEL_SIZE, pixels, 0, NULL, NULL);
+                0, TOTAL_PIXEL_SIZE, HOST_PIXELS, 0, NULL, NULL);
     clFlush(graphicsCommandQueue);
     clFinish(graphicsCommandQueue);
+    TRACE_END(0, "pixels read", (int)frameNumber, readStart);
+
+}
 
+
+// Physics check of --physics-precision float: prints how far the
+// satelites are from the double reference in backupSatelites and flags
+// those beyond PHYSICS_FLOAT_TOLERANCE
+void physicsToleranceCheck() {
+    checkPhysicsTolerance(&satelites[0].position.x,
+                          &backupSatelites[0].position.x, SATELITE_COUNT,
+                          sizeof(satelite) / sizeof(float));
 }
 
 
 // ## You may add your own destrcution routines here ##
 void destroy(){
 
-    // Release OpenCL properties
+    if (singleContextMode) {
+        // Let the last frame finish and drop its mapping
+        if (pendingPixelsBuffer >= 0) {
+            finishPixels(pendingPixelsBuffer);
+        }
+        clFinish(graphicsCommandQueue);
+        clFinish(physicsCommandQueue);
+        if (physicsDone != NULL) {
+            clReleaseEvent(physicsDone);
+        }
+        if (graphicsDone != NULL) {
+            clReleaseEvent(graphicsDone);
+        }
+        clReleaseMemObject(pinnedPixelsBuffers[0]);
+        clReleaseMemObject(pinnedPixelsBuffers[1]);
+    }
+
+    // Release OpenCL properties, shared objects only once
     clReleaseMemObject(physicsSatelitesBuffer);
-    clReleaseMemObject(graphicsSatelitesBuffer);
-    clReleaseMemObject(pixelsBuffer);
+    if (graphicsSatelitesBuffer != physicsSatelitesBuffer) {
+        clReleaseMemObject(graphicsSatelitesBuffer);
+    }
+    if (pixelsBuffer != NULL) {
+        clReleaseMemObject(pixelsBuffer);
+    }
 
     clReleaseCommandQueue(physicsCommandQueue);
     clReleaseCommandQueue(graphicsCommandQueue);
 
     clReleaseKernel(physicsKernel);
     clReleaseKernel(graphicsKernel);
+    if (nbodyMode) {
+        clReleaseKernel(nbodyKernel);
+        clReleaseMemObject(nbodySatelitesBuffer);
+    }
    
     clReleaseProgram(physicsProgram);
-    clReleaseProgram(graphicsProgram);
+    if (graphicsProgram != physicsProgram) {
+        clReleaseProgram(graphicsProgram);
+    }
    
     clReleaseContext(physicsContext);
-    clReleaseContext(graphicsContext);   
+    if (graphicsContext != physicsContext) {
+        clReleaseContext(graphicsContext);
+    }
+    if (hybridRendering) {
+        if (hybridFrames > 0) {
+            printf("Hybrid rendering: OpenCL rendered %.1f%% of the rows "
+                   "on average\n",
+                   100.0 * hybridRowsSum / hybridFrames / WINDOW_HEIGHT);
+        }
+        freeRenderSatelites(&hybridSnapshot);
+    }
+    free(pixelsRGBA8);
+    traceFinish();
 
 }
 
+// errorCheck() in the quantized domain of --pixel-format rgba8, called by
+// compute() with ALLOWED_FP_ERROR
+void errorCheckRGBA8(double allowedError) {
+
+    const int tolerance = quantizedTolerance(allowedError);
+    for (unsigned int i = 0; i < SIZE; ++i) {
+        const unsigned char *pixel = &pixelsRGBA8[4 * i];
+        if (abs(quantizeChannel(correctPixels[i].red) - pixel[0]) > tolerance ||
+            abs(quantizeChannel(correctPixels[i].green) - pixel[1]) > tolerance ||
+            abs(quantizeChannel(correctPixels[i].blue) - pixel[2]) > tolerance) {
+            printf("Buggy pixel at (x=%i, y=%i). Press enter to continue.\n",
+                   i % WINDOW_WIDTH, i / WINDOW_WIDTH);
+            getchar();
+            return;
+        }
+    }
+    printf("Error check passed!\n");
+}
+
+#ifndef PARALLEL_HEADLESS
+// Draws the framebuffer of the selected --pixel-format, called by render()
+void drawPixels() {
+
+    if (pixelFormat == PIXEL_FORMAT_RGBA8) {
+        glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE,
+                     pixelsRGBA8);
+    } else {
+        glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
+    }
+}
+#endif
+
 
 
 
@@ -468,8 +1510,10 @@ void sequentialPhysicsEngine(satelite *s){
 
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELITE_COUNT];
-   doublevector tmpVelocity[SATELITE_COUNT];
+   doublevector *tmpPosition =
+      (doublevector*)malloc(sizeof(doublevector) * SATELITE_COUNT);
+   doublevector *tmpVelocity =
+      (doublevector*)malloc(sizeof(doublevector) * SATELITE_COUNT);
 
    for (int i = 0; i < SATELITE_COUNT; ++i) {
        tmpPosition[i].x = s[i].position.x;
@@ -525,6 +1569,9 @@ void sequentialPhysicsEngine(satelite *s){
        s[i].velocity.x = tmpVelocity[i].x;
        s[i].velocity.y = tmpVelocity[i].y;
    }
+
+   free(tmpPosition);
+   free(tmpVelocity);
 }
 
 // Just some value that barely passes for OpenCL example program
@@ -545,7 +1592,7 @@ void errorCheck(){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 void compute(void){
-   int timeSinceStart = glutGet(GLUT_ELAPSED_TIME);
+   long long timeSinceStart = nowNanoseconds();
    previousFrameTimeSinceStart = timeSinceStart;
 
    // Error check during first frames
@@ -554,7 +1601,8 @@ void compute(void){
       sequentialPhysicsEngine(backupSatelites);
    }
    parallelPhysicsEngine();
-   if (frameNumber < 2) {
+   // The reference engine has no satelite-satelite gravity
+   if (frameNumber < 2 && !nbodyMode && !floatPhysics) {
       for (int i = 0; i < SATELITE_COUNT; i++) {
          if (memcmp (&satelites[i], &backupSatelites[i], sizeof(satelite))) {
             printf("Incorrect satelite data of satelite: %d\n", i);
@@ -562,32 +1610,49 @@ void compute(void){
          }
       }
    }
+   if (frameNumber < 2 && floatPhysics) {
+      physicsToleranceCheck();
+   }
 
-   int sateliteMovementMoment = glutGet(GLUT_ELAPSED_TIME);
-   int sateliteMovementTime = sateliteMovementMoment  - timeSinceStart;
+   long long sateliteMovementMoment = nowNanoseconds();
+   long long sateliteMovementTime = sateliteMovementMoment  - timeSinceStart;
 
    // Decides the colors for the pixels
    parallelGraphicsEngine();
 
-   int pixelColoringMoment = glutGet(GLUT_ELAPSED_TIME);
-   int pixelColoringTime =  pixelColoringMoment - sateliteMovementMoment;
+   long long pixelColoringMoment = nowNanoseconds();
+   long long pixelColoringTime =  pixelColoringMoment - sateliteMovementMoment;
 
    // Sequential code is used to check possible errors in the parallel version
    if(frameNumber < 2){
       sequentialGraphicsEngine();
-      errorCheck();
+      pixelFormat == PIXEL_FORMAT_RGBA8 ? errorCheckRGBA8(ALLOWED_FP_ERROR) : errorCheck();
    }
 
-   int finishTime = glutGet(GLUT_ELAPSED_TIME);
+   long long finishTime = nowNanoseconds();
    // Print timings
-   int totalTime = finishTime - previousFinishTime;
+   long long totalTime = finishTime - previousFinishTime;
    previousFinishTime = finishTime;
 
-   printf("Total frametime: %ims, satelite moving: %ims, space coloring: %ims.\n",
-      totalTime, sateliteMovementTime, pixelColoringTime);
+   totalFrameTime += totalTime;
+   totalPhysicsTime += sateliteMovementTime;
+   totalGraphicsTime += pixelColoringTime;
+   if(frameNumber >= STATS_SKIPPED_FRAMES){
+      recordFrame(&frameStatistics, sateliteMovementTime, pixelColoringTime,
+                  totalTime);
+   }
+
+   printf("Total frametime: %.3fms, satelite moving: %.3fms, space coloring: %.3fms.\n",
+      nanosecondsToMilliseconds(totalTime),
+      nanosecondsToMilliseconds(sateliteMovementTime),
+      nanosecondsToMilliseconds(pixelColoringTime));
 
    // Render the frame
-   glutPostRedisplay();
+#ifndef PARALLEL_HEADLESS
+   if(!options.headless){
+      glutPostRedisplay();
+   }
+#endif
 }
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
@@ -667,22 +1732,209 @@ void fixedDestroy(void){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 // Renders pixels-buffer to the window 
+#ifndef PARALLEL_HEADLESS
 void render(void){
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-   glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
+   drawPixels();
    glutSwapBuffers();
    frameNumber++;
 }
+#endif
+
+// Runs the engines in a tight loop without a window and prints a summary.
+// Used for benchmarking on machines without a display.
+void runHeadless(void){
+   initFrameStats(&frameStatistics);
+   previousFrameTimeSinceStart = nowNanoseconds();
+   previousFinishTime = previousFrameTimeSinceStart;
+
+   for(frameNumber = 0; frameNumber < options.frames; ++frameNumber){
+      compute();
+   }
+
+   printf("Headless summary: %u frames, average frametime: %.3fms, "
+          "satelite moving: %.3fms, space coloring: %.3fms, %.2f FPS.\n",
+      options.frames,
+      nanosecondsToMilliseconds(totalFrameTime) / options.frames,
+      nanosecondsToMilliseconds(totalPhysicsTime) / options.frames,
+      nanosecondsToMilliseconds(totalGraphicsTime) / options.frames,
+      options.frames * 1000.0 / nanosecondsToMilliseconds(totalFrameTime));
+
+   writeFrameStats(&frameStatistics, "opencl", 0, &options);
+   freeFrameStats(&frameStatistics);
+}
+
+// Options of this backend for printUsage()
+void printBackendUsage(FILE *stream){
+   fprintf(stream,
+      "  --single-context run physics and graphics on one device\n"
+      "  --hybrid         split the frame rows between OpenCL and OpenMP\n"
+      "  --cl-device D    graphics device: gpu (default) or cpu\n"
+      "  --pixel-format F framebuffer: float (default) or rgba8\n"
+      "  --cl-graphics K  graphics kernel: plain (default) or local\n"
+      "  --cl-cache DIR   kernel binary cache directory, off disables it\n"
+      "  --physics-precision P  physics in double (default) or compensated float\n"
+      "  --nbody M        satelite gravity: off (default) or direct\n"
+      "  --nbody-steps N  N-body substeps per frame (default 100)\n"
+      "  --nbody-mass M   satelite mass relative to the black hole (default 1e-4)\n"
+      "  --nbody-softening E  softening length in pixels (default 1)\n");
+}
+
+// Parses the command line into options and the seed
+void parseArguments(int argc, char** argv){
+   initOptions(&options);
+   options.backendUsage = printBackendUsage;
+
+   for(int i = 1; i < argc; ++i){
+      if(parseCommonOption(&options, argc, argv, &i)){
+         continue;
+      }
+      if(strcmp(argv[i], "--single-context") == 0){
+         singleContextMode = 1;
+         continue;
+      }
+      if(strcmp(argv[i], "--hybrid") == 0){
+         hybridRendering = 1;
+         continue;
+      }
+      if(strcmp(argv[i], "--cl-device") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "gpu") == 0){
+            graphicsDeviceType = CL_DEVICE_TYPE_GPU;
+         } else if(strcmp(argv[i], "cpu") == 0){
+            graphicsDeviceType = CL_DEVICE_TYPE_CPU;
+         } else {
+            fprintf(stderr, "Unknown OpenCL device type: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--pixel-format") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "float") == 0){
+            pixelFormat = PIXEL_FORMAT_FLOAT;
+         } else if(strcmp(argv[i], "rgba8") == 0){
+            pixelFormat = PIXEL_FORMAT_RGBA8;
+         } else {
+            fprintf(stderr, "Unknown pixel format: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--cl-graphics") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "plain") == 0){
+            localGraphics = 0;
+         } else if(strcmp(argv[i], "local") == 0){
+            localGraphics = 1;
+         } else {
+            fprintf(stderr, "Unknown graphics kernel: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--cl-cache") == 0){
+         parsePathValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "off") == 0){
+            programCacheEnabled = 0;
+         } else {
+            programCacheDir = argv[i];
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--physics-precision") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "double") == 0){
+            floatPhysics = 0;
+         } else if(strcmp(argv[i], "float") == 0){
+            floatPhysics = 1;
+         } else {
+            fprintf(stderr, "Unknown physics precision: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "off") == 0){
+            nbodyMode = 0;
+         } else if(strcmp(argv[i], "direct") == 0 ||
+                   strcmp(argv[i], "auto") == 0){
+            nbodyMode = 1;
+         } else {
+            fprintf(stderr, "Unknown N-body mode: %s (the OpenCL backend "
+                            "has off and direct)\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody-steps") == 0){
+         nbodySteps = parseSizeValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody-mass") == 0){
+         nbodyMass = parseDoubleValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody-softening") == 0){
+         nbodySoftening = parseDoubleValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      printUsage(stderr, &options, argv[0]);
+      exit(EXIT_FAILURE);
+   }
+   if(hybridRendering && singleContextMode){
+      fprintf(stderr, "--hybrid cannot be combined with --single-context\n");
+      exit(EXIT_FAILURE);
+   }
+   if(floatPhysics && nbodyMode){
+      fprintf(stderr, "--physics-precision float cannot be combined with --nbody\n");
+      exit(EXIT_FAILURE);
+   }
+   if(nbodyMode && nbodySoftening <= 0.0){
+      fprintf(stderr, "--nbody-softening must be positive\n");
+      exit(EXIT_FAILURE);
+   }
+
+#ifdef PARALLEL_HEADLESS
+   // There is no window to run in
+   options.headless = 1;
+#endif
+   if(options.headless && options.frames == 0){
+      fprintf(stderr, "--frames must be at least 1\n");
+      exit(EXIT_FAILURE);
+   }
+   seed = options.seed;
+}
 
 // DO NOT EDIT THIS FUNCTION
 // Inits glut and start mainloop
 int main(int argc, char** argv){
 
-   if(argc > 1){
-     seed = atoi(argv[1]);
+   parseArguments(argc, argv);
+   if(seed != 0){
      printf("Using seed: %i\n", seed);
    }
 
+   if(options.headless){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      init();
+      runHeadless();
+      return 0;
+   }
+
+#ifndef PARALLEL_HEADLESS
    // Init glut window
    glutInit(&argc, argv);
    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
@@ -690,8 +1942,8 @@ int main(int argc, char** argv){
    glutCreateWindow("Parallelization excercise");
    glutDisplayFunc(render);
    atexit(fixedDestroy);
-   previousFrameTimeSinceStart = glutGet(GLUT_ELAPSED_TIME);
-   previousFinishTime = glutGet(GLUT_ELAPSED_TIME);
+   previousFrameTimeSinceStart = nowNanoseconds();
+   previousFinishTime = previousFrameTimeSinceStart;
    glEnable(GL_DEPTH_TEST);
    glClearColor(0.0, 0.0, 0.0, 1.0);
    fixedInit(seed);
@@ -702,4 +1954,6 @@ int main(int argc, char** argv){
 
    // Start main loop
    glutMainLoop();
+#endif
+   return 0;
 }
\ No newline at end of file
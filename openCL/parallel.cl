@@ -1,121 +1,485 @@
-#include "parallel.h"
-
-
-__kernel void physicsEngineKernel(__global satelite* satelites) {
-
-    // Get current satellite ID
-    size_t globalId = get_global_id(0);
-
-    // double precision required for accumulation inside this routine,
-    // but float storage is ok outside these loops.	
-    __private doublevector tmpPosition;
-	__private doublevector tmpVelocity;
-	tmpPosition.x = satelites[globalId].position.x;
-    tmpPosition.y = satelites[globalId].position.y;
-    tmpVelocity.x = satelites[globalId].velocity.x;
-    tmpVelocity.y = satelites[globalId].velocity.y;   
-
-    // Physics iteration loop
-    for(int physicsUpdateIndex = 0; 
-        physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
-      ++physicsUpdateIndex){
-
-        // Distance to the blackhole (bit ugly code because C-struct cannot have member functions)
-        doublevector positionToBlackHole = {.x = tmpPosition.x -
-            HORIZONTAL_CENTER, .y = tmpPosition.y - VERTICAL_CENTER};
-        double distToBlackHoleSquared =
-            positionToBlackHole.x * positionToBlackHole.x +
-            positionToBlackHole.y * positionToBlackHole.y;
-        double distToBlackHole = sqrt(distToBlackHoleSquared);
-
-        // Gravity force
-        doublevector normalizedDirection = {
-            .x = positionToBlackHole.x / distToBlackHole,
-            .y = positionToBlackHole.y / distToBlackHole};
-        double accumulation = GRAVITY / distToBlackHoleSquared;
-
-        // Delta time is used to make velocity same despite different FPS
-        // Update velocity based on force
-        tmpVelocity.x -= accumulation * normalizedDirection.x *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
-        tmpVelocity.y -= accumulation * normalizedDirection.y *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
-
-        // Update position based on velocity
-        tmpPosition.x +=
-            tmpVelocity.x * DELTATIME / PHYSICSUPDATESPERFRAME;
-        tmpPosition.y +=
-            tmpVelocity.y * DELTATIME / PHYSICSUPDATESPERFRAME;
-
-    }   
-
-    // double precision required for accumulation inside this routine,
-    // but float storage is ok outside these loops.
-    // copy back the float storage.
-    satelites[globalId].position.x = tmpPosition.x;
-    satelites[globalId].position.y = tmpPosition.y;
-    satelites[globalId].velocity.x = tmpVelocity.x;
-    satelites[globalId].velocity.y = tmpVelocity.y;
-
-}
-
-
-__kernel void graphicsEngineKernel(__global satelite* satelites,
-                                   __global color* pixels) {
-	
-    // Get global x,y coordinates
-    size_t globalId_x = get_global_id(1);
-    size_t globalId_y = get_global_id(0);
-
-    // Row wise ordering
-    __private floatvector pixel = { .x = globalId_x, .y = globalId_y};
-
-    // This color is used for coloring the pixel
-    __private color renderColor = { .red = 0.f, .green = 0.f, .blue = 0.f };
-    __private color incrementColor = { .red = 0.f, .green = 0.f, .blue = 0.f };
-
-    // Find closest satelite
-    float shortestDistance = INFINITY;
-
-    float weights = 0.f;
-    int hitsSatellite = 0;
-
-    // Graphics satelite loop: Find the closest satellite.
-    for (int j = 0; j < SATELITE_COUNT; ++j) {
-
-        floatvector difference = { .x = pixel.x - satelites[j].position.x,
-                                    .y = pixel.y - satelites[j].position.y };
-        float distance = sqrt(difference.x * difference.x +
-                              difference.y * difference.y);
-
-        
-        float weight = 1.0f / (distance * distance * distance * distance);
-        weights += weight;            
-        if (distance < shortestDistance) {
-            shortestDistance = distance;
-            renderColor = satelites[j].identifier;
-        }            
-        incrementColor.red += satelites[j].identifier.red * weight;
-        incrementColor.green += satelites[j].identifier.green * weight;
-        incrementColor.blue += satelites[j].identifier.blue * weight;
-        
-    }
-
-    // Calculate the color based on distance to every satelite.
-    if (shortestDistance < SATELITE_RADIUS) {
-
-        renderColor.red = 1.0f;
-        renderColor.green = 1.0f;
-        renderColor.blue = 1.0f;        
-
-    } else {
-        
-        renderColor.red   += incrementColor.red / weights * 3.0f;                                                      
-        renderColor.green += incrementColor.green / weights * 3.0f;                             	 
-        renderColor.blue  += incrementColor.blue / weights * 3.0f;
-
-    }
-
-    pixels[globalId_x + WINDOW_WIDTH * globalId_y] = renderColor;
-   
-} 
+#include "parallel.h"
+
+// Problem size comes in as kernel arguments, unless the host specializes
+// the program for it with -D SPECIALIZED_... options. The arguments are
+// then unused and the loops have constant trip counts.
+#ifdef SPECIALIZED_WINDOW_WIDTH
+#define WINDOW_WIDTH SPECIALIZED_WINDOW_WIDTH
+#else
+#define WINDOW_WIDTH windowWidth
+#endif
+#ifdef SPECIALIZED_WINDOW_HEIGHT
+#define WINDOW_HEIGHT SPECIALIZED_WINDOW_HEIGHT
+#else
+#define WINDOW_HEIGHT windowHeight
+#endif
+#ifdef SPECIALIZED_SATELITE_COUNT
+#define SATELITE_COUNT SPECIALIZED_SATELITE_COUNT
+#else
+#define SATELITE_COUNT sateliteCount
+#endif
+#ifdef SPECIALIZED_PHYSICSUPDATESPERFRAME
+#define PHYSICSUPDATESPERFRAME SPECIALIZED_PHYSICSUPDATESPERFRAME
+#else
+#define PHYSICSUPDATESPERFRAME physicsUpdatesPerFrame
+#endif
+
+
+__kernel void physicsEngineKernel(__global satelite* satelites,
+                                  int windowWidth, int windowHeight,
+                                  int physicsUpdatesPerFrame) {
+
+    // Get current satellite ID
+    size_t globalId = get_global_id(0);
+
+    // double precision required for accumulation inside this routine,
+    // but float storage is ok outside these loops.	
+    __private doublevector tmpPosition;
+	__private doublevector tmpVelocity;
+	tmpPosition.x = satelites[globalId].position.x;
+    tmpPosition.y = satelites[globalId].position.y;
+    tmpVelocity.x = satelites[globalId].velocity.x;
+    tmpVelocity.y = satelites[globalId].velocity.y;   
+
+    // Physics iteration loop
+    for(int physicsUpdateIndex = 0; 
+        physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
+      ++physicsUpdateIndex){
+
+        // Distance to the blackhole (bit ugly code because C-struct cannot have member functions)
+        doublevector positionToBlackHole = {.x = tmpPosition.x -
+            HORIZONTAL_CENTER, .y = tmpPosition.y - VERTICAL_CENTER};
+        double distToBlackHoleSquared =
+            positionToBlackHole.x * positionToBlackHole.x +
+            positionToBlackHole.y * positionToBlackHole.y;
+        double distToBlackHole = sqrt(distToBlackHoleSquared);
+
+        // Gravity force
+        doublevector normalizedDirection = {
+            .x = positionToBlackHole.x / distToBlackHole,
+            .y = positionToBlackHole.y / distToBlackHole};
+        double accumulation = GRAVITY / distToBlackHoleSquared;
+
+        // Delta time is used to make velocity same despite different FPS
+        // Update velocity based on force
+        tmpVelocity.x -= accumulation * normalizedDirection.x *
+            DELTATIME / PHYSICSUPDATESPERFRAME;
+        tmpVelocity.y -= accumulation * normalizedDirection.y *
+            DELTATIME / PHYSICSUPDATESPERFRAME;
+
+        // Update position based on velocity
+        tmpPosition.x +=
+            tmpVelocity.x * DELTATIME / PHYSICSUPDATESPERFRAME;
+        tmpPosition.y +=
+            tmpVelocity.y * DELTATIME / PHYSICSUPDATESPERFRAME;
+
+    }   
+
+    // double precision required for accumulation inside this routine,
+    // but float storage is ok outside these loops.
+    // copy back the float storage.
+    satelites[globalId].position.x = tmpPosition.x;
+    satelites[globalId].position.y = tmpPosition.y;
+    satelites[globalId].velocity.x = tmpVelocity.x;
+    satelites[globalId].velocity.y = tmpVelocity.y;
+
+}
+
+
+// Float physics (--physics-precision float), the compensated float
+// integration of common/physics_float.h for devices without fast double
+// support. Every state variable is a float pair hi + lo and each step is
+// added with Kahan's compensation. Must be built without
+// -cl-fast-relaxed-math, which would let the compiler drop the
+// compensation terms.
+__kernel void physicsEngineKernelFloat(__global satelite* satelites,
+                                       int windowWidth, int windowHeight,
+                                       int physicsUpdatesPerFrame) {
+
+    size_t globalId = get_global_id(0);
+
+    const float centerX = HORIZONTAL_CENTER;
+    const float centerY = VERTICAL_CENTER;
+    const float h = (float)DELTATIME / PHYSICSUPDATESPERFRAME;
+
+    // hi and lo parts, satelite storage is float so lo starts at 0
+    float2 position = (float2)(satelites[globalId].position.x,
+                               satelites[globalId].position.y);
+    float2 velocity = (float2)(satelites[globalId].velocity.x,
+                               satelites[globalId].velocity.y);
+    float2 positionLow = (float2)(0.f, 0.f);
+    float2 velocityLow = (float2)(0.f, 0.f);
+
+    for(int physicsUpdateIndex = 0;
+        physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
+      ++physicsUpdateIndex){
+
+        float2 positionToBlackHole = (position - (float2)(centerX, centerY)) +
+            positionLow;
+        float distToBlackHoleSquared =
+            positionToBlackHole.x * positionToBlackHole.x +
+            positionToBlackHole.y * positionToBlackHole.y;
+        float distToBlackHole = sqrt(distToBlackHoleSquared);
+        float accumulation = GRAVITY / distToBlackHoleSquared;
+
+        float2 dv = velocityLow -
+            accumulation * (positionToBlackHole / distToBlackHole) * h;
+        float2 newVelocity = velocity + dv;
+        velocityLow = dv - (newVelocity - velocity);
+        velocity = newVelocity;
+
+        float2 dx = velocity * h + (velocityLow * h + positionLow);
+        float2 newPosition = position + dx;
+        positionLow = dx - (newPosition - position);
+        position = newPosition;
+    }
+
+    satelites[globalId].position.x = position.x + positionLow.x;
+    satelites[globalId].position.y = position.y + positionLow.y;
+    satelites[globalId].velocity.x = velocity.x + velocityLow.x;
+    satelites[globalId].velocity.y = velocity.y + velocityLow.y;
+
+}
+
+
+// N-body physics (--nbody), one kick-drift substep of the black hole and
+// satelite-satelite gravity from in to out. The positions are staged
+// through local memory one work-group sized tile at a time as
+// (x, y, mass, 0); the padding beyond sateliteCount has mass 0. Softening
+// must be positive so a satelite's own term is 0 rather than NaN.
+__kernel void nbodyPhysicsEngineKernel(__global const satelite* in,
+                                       __global satelite* out,
+                                       __local float4* tile,
+                                       int sateliteCount,
+                                       int windowWidth, int windowHeight,
+                                       float sateliteGravity,
+                                       float softening2,
+                                       float deltaTime) {
+
+    size_t globalId = get_global_id(0);
+    size_t localId = get_local_id(0);
+    size_t localSize = get_local_size(0);
+    int active = globalId < SATELITE_COUNT;
+
+    float2 position = (float2)(0.f, 0.f);
+    if (active) {
+        position = (float2)(in[globalId].position.x, in[globalId].position.y);
+    }
+
+    // Every work-item takes part in the tile loads and barriers
+    float2 sum = (float2)(0.f, 0.f);
+    for (int tileStart = 0; tileStart < SATELITE_COUNT; tileStart += localSize) {
+        int j = tileStart + localId;
+        tile[localId] = j < SATELITE_COUNT ?
+            (float4)(in[j].position.x, in[j].position.y, 1.f, 0.f) :
+            (float4)(0.f, 0.f, 0.f, 0.f);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k = 0; k < localSize; ++k) {
+            float2 difference = tile[k].xy - position;
+            float r2 = dot(difference, difference) + softening2;
+            float inverse = rsqrt(r2);
+            sum += difference * (tile[k].z * inverse * inverse * inverse);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (!active) {
+        return;
+    }
+
+    // The black hole term like in physicsEngineKernel
+    doublevector positionToBlackHole = {.x = position.x - HORIZONTAL_CENTER,
+                                        .y = position.y - VERTICAL_CENTER};
+    double distToBlackHoleSquared =
+        positionToBlackHole.x * positionToBlackHole.x +
+        positionToBlackHole.y * positionToBlackHole.y;
+    double distToBlackHole = sqrt(distToBlackHoleSquared);
+    double accumulation = GRAVITY / distToBlackHoleSquared;
+
+    doublevector acceleration = {
+        .x = -accumulation * positionToBlackHole.x / distToBlackHole +
+             sateliteGravity * sum.x,
+        .y = -accumulation * positionToBlackHole.y / distToBlackHole +
+             sateliteGravity * sum.y};
+
+    // Kick and drift
+    doublevector velocity = {.x = in[globalId].velocity.x,
+                             .y = in[globalId].velocity.y};
+    velocity.x += acceleration.x * deltaTime;
+    velocity.y += acceleration.y * deltaTime;
+
+    out[globalId].identifier = in[globalId].identifier;
+    out[globalId].position.x = position.x + velocity.x * deltaTime;
+    out[globalId].position.y = position.y + velocity.y * deltaTime;
+    out[globalId].velocity.x = velocity.x;
+    out[globalId].velocity.y = velocity.y;
+
+}
+
+
+// Color of one pixel from all satelites
+color shadePixel(__global satelite* satelites, floatvector pixel,
+                 int sateliteCount) {
+
+    // This color is used for coloring the pixel
+    __private color renderColor = { .red = 0.f, .green = 0.f, .blue = 0.f };
+    __private color incrementColor = { .red = 0.f, .green = 0.f, .blue = 0.f };
+
+    // Find closest satelite
+    float shortestDistance = INFINITY;
+
+    float weights = 0.f;
+
+    // Graphics satelite loop: Find the closest satellite.
+    for (int j = 0; j < SATELITE_COUNT; ++j) {
+
+        floatvector difference = { .x = pixel.x - satelites[j].position.x,
+                                    .y = pixel.y - satelites[j].position.y };
+        float distance = sqrt(difference.x * difference.x +
+                              difference.y * difference.y);
+
+        
+        float weight = 1.0f / (distance * distance * distance * distance);
+        weights += weight;            
+        if (distance < shortestDistance) {
+            shortestDistance = distance;
+            renderColor = satelites[j].identifier;
+        }            
+        incrementColor.red += satelites[j].identifier.red * weight;
+        incrementColor.green += satelites[j].identifier.green * weight;
+        incrementColor.blue += satelites[j].identifier.blue * weight;
+        
+    }
+
+    // Calculate the color based on distance to every satelite.
+    if (shortestDistance < SATELITE_RADIUS) {
+
+        renderColor.red = 1.0f;
+        renderColor.green = 1.0f;
+        renderColor.blue = 1.0f;        
+
+    } else {
+        
+        renderColor.red   += incrementColor.red / weights * 3.0f;                                                      
+        renderColor.green += incrementColor.green / weights * 3.0f;                             	 
+        renderColor.blue  += incrementColor.blue / weights * 3.0f;
+
+    }
+
+    return renderColor;
+}
+
+
+#ifndef GRAPHICS_LOCAL_TILES
+
+__kernel void graphicsEngineKernel(__global satelite* satelites,
+                                   __global color* pixels,
+                                   int windowWidth, int sateliteCount) {
+	
+    // Get global x,y coordinates
+    size_t globalId_x = get_global_id(1);
+    size_t globalId_y = get_global_id(0);
+
+    // Row wise ordering
+    __private floatvector pixel = { .x = globalId_x, .y = globalId_y};
+
+    pixels[globalId_x + WINDOW_WIDTH * globalId_y] =
+        shadePixel(satelites, pixel, sateliteCount);
+   
+} 
+
+
+// Graphics Engine of --pixel-format rgba8: clamps and quantizes in the
+// kernel and stores 4 bytes per pixel, a third of the float readback
+__kernel void graphicsEngineKernelRGBA8(__global satelite* satelites,
+                                        __global uchar4* pixels,
+                                        int windowWidth, int sateliteCount) {
+
+    size_t globalId_x = get_global_id(1);
+    size_t globalId_y = get_global_id(0);
+
+    __private floatvector pixel = { .x = globalId_x, .y = globalId_y};
+    color renderColor = shadePixel(satelites, pixel, sateliteCount);
+
+    float4 value = (float4)(renderColor.red, renderColor.green,
+                            renderColor.blue, 1.0f) * 255.0f;
+    pixels[globalId_x + WINDOW_WIDTH * globalId_y] = convert_uchar4_sat_rte(value);
+
+}
+
+
+#else
+
+// Local memory Graphics Engine (--cl-graphics local), compiled instead of
+// the kernels above with -D GRAPHICS_LOCAL_TILES. A work-group loads
+// GRAPHICS_TILE_SATELITES satelites at a time into local memory as
+// structure-of-arrays, every work-item shades 4 neighbouring pixels of a
+// row with float4 math. The second global dimension is a quarter of the
+// window width, rounded up to the work-group size by the host.
+
+#ifndef GRAPHICS_TILE_SATELITES
+#define GRAPHICS_TILE_SATELITES 128
+#endif
+
+// Tile padding: far away and black, so it never is the nearest satelite
+// and its weight vanishes against the real ones. Finite, because
+// -cl-fast-relaxed-math assumes there are no infinities.
+#define GRAPHICS_PADDING_POSITION 1e9f
+
+// Local memory of a work-group: x, y, red, green and blue of the tile.
+// OpenCL C only allows local arrays at kernel scope.
+#define GRAPHICS_TILE_FLOATS (5 * GRAPHICS_TILE_SATELITES)
+
+// Running sums of 4 pixels, like the locals of shadePixel
+typedef struct{
+    float4 shortest;
+    float4 weights;
+    float4 red;
+    float4 green;
+    float4 blue;
+    float4 nearestRed;
+    float4 nearestGreen;
+    float4 nearestBlue;
+} pixelSums4;
+
+// Adds one satelite to the sums of the pixels (px, py)
+void accumulateSatelite4(pixelSums4 *s, float4 px, float py, float sx,
+                         float sy, float red, float green, float blue) {
+
+    float4 dx = px - sx;
+    float dy = py - sy;
+    float4 distance = sqrt(dx * dx + dy * dy);
+
+    float4 weight = 1.0f / (distance * distance * distance * distance);
+    s->weights += weight;
+    int4 closer = distance < s->shortest;
+    s->shortest = select(s->shortest, distance, closer);
+    s->nearestRed = select(s->nearestRed, (float4)(red), closer);
+    s->nearestGreen = select(s->nearestGreen, (float4)(green), closer);
+    s->nearestBlue = select(s->nearestBlue, (float4)(blue), closer);
+    s->red += red * weight;
+    s->green += green * weight;
+    s->blue += blue * weight;
+}
+
+// Shades pixels x0 ... x0 + 3 of row y into red, green and blue. tile is
+// the local memory of the kernel, GRAPHICS_TILE_FLOATS. Every work-item of
+// the group has to call it, it synchronizes on the tiles.
+void shadePixels4(__global satelite* satelites, __local float *tile,
+                  int sateliteCount, int x0, int y,
+                  float4 *red, float4 *green, float4 *blue) {
+
+    __local float *tileX = tile;
+    __local float *tileY = tile + GRAPHICS_TILE_SATELITES;
+    __local float *tileRed = tile + 2 * GRAPHICS_TILE_SATELITES;
+    __local float *tileGreen = tile + 3 * GRAPHICS_TILE_SATELITES;
+    __local float *tileBlue = tile + 4 * GRAPHICS_TILE_SATELITES;
+
+    int localId = get_local_id(0) * get_local_size(1) + get_local_id(1);
+    int localSize = get_local_size(0) * get_local_size(1);
+
+    float4 px = (float4)(x0, x0 + 1, x0 + 2, x0 + 3);
+    float py = y;
+    pixelSums4 s;
+    s.shortest = (float4)(INFINITY);
+    s.weights = (float4)(0.f);
+    s.red = (float4)(0.f);
+    s.green = (float4)(0.f);
+    s.blue = (float4)(0.f);
+    s.nearestRed = (float4)(0.f);
+    s.nearestGreen = (float4)(0.f);
+    s.nearestBlue = (float4)(0.f);
+
+    for (int tileStart = 0; tileStart < SATELITE_COUNT;
+         tileStart += GRAPHICS_TILE_SATELITES) {
+
+        // Cooperative load, padded to a multiple of 4
+        int count = min(GRAPHICS_TILE_SATELITES, SATELITE_COUNT - tileStart);
+        int padded = (count + 3) & ~3;
+        for (int j = localId; j < padded; j += localSize) {
+            if (j < count) {
+                __global satelite *loaded = &satelites[tileStart + j];
+                tileX[j] = loaded->position.x;
+                tileY[j] = loaded->position.y;
+                tileRed[j] = loaded->identifier.red;
+                tileGreen[j] = loaded->identifier.green;
+                tileBlue[j] = loaded->identifier.blue;
+            } else {
+                tileX[j] = GRAPHICS_PADDING_POSITION;
+                tileY[j] = GRAPHICS_PADDING_POSITION;
+                tileRed[j] = 0.f;
+                tileGreen[j] = 0.f;
+                tileBlue[j] = 0.f;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Satelites in the order of shadePixel, 4 per local load
+        for (int k = 0; k < padded / 4; ++k) {
+            float4 sx = vload4(k, tileX);
+            float4 sy = vload4(k, tileY);
+            float4 sr = vload4(k, tileRed);
+            float4 sg = vload4(k, tileGreen);
+            float4 sb = vload4(k, tileBlue);
+            accumulateSatelite4(&s, px, py, sx.s0, sy.s0, sr.s0, sg.s0, sb.s0);
+            accumulateSatelite4(&s, px, py, sx.s1, sy.s1, sr.s1, sg.s1, sb.s1);
+            accumulateSatelite4(&s, px, py, sx.s2, sy.s2, sr.s2, sg.s2, sb.s2);
+            accumulateSatelite4(&s, px, py, sx.s3, sy.s3, sr.s3, sg.s3, sb.s3);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    int4 hit = s.shortest < SATELITE_RADIUS;
+    *red = select(s.nearestRed + s.red / s.weights * 3.0f, (float4)(1.0f), hit);
+    *green = select(s.nearestGreen + s.green / s.weights * 3.0f,
+                    (float4)(1.0f), hit);
+    *blue = select(s.nearestBlue + s.blue / s.weights * 3.0f,
+                   (float4)(1.0f), hit);
+}
+
+__kernel void graphicsEngineKernel(__global satelite* satelites,
+                                   __global color* pixels,
+                                   int windowWidth, int sateliteCount) {
+
+    int x0 = get_global_id(1) * 4;
+    int y = get_global_id(0);
+
+    __local float tile[GRAPHICS_TILE_FLOATS];
+    float4 red, green, blue;
+    shadePixels4(satelites, tile, sateliteCount, x0, y, &red, &green, &blue);
+
+    float r[4], g[4], b[4];
+    vstore4(red, 0, r);
+    vstore4(green, 0, g);
+    vstore4(blue, 0, b);
+    for (int i = 0; i < 4 && x0 + i < WINDOW_WIDTH; ++i) {
+        color renderColor = { .red = r[i], .green = g[i], .blue = b[i] };
+        pixels[x0 + i + WINDOW_WIDTH * y] = renderColor;
+    }
+
+}
+
+__kernel void graphicsEngineKernelRGBA8(__global satelite* satelites,
+                                        __global uchar4* pixels,
+                                        int windowWidth, int sateliteCount) {
+
+    int x0 = get_global_id(1) * 4;
+    int y = get_global_id(0);
+
+    __local float tile[GRAPHICS_TILE_FLOATS];
+    float4 red, green, blue;
+    shadePixels4(satelites, tile, sateliteCount, x0, y, &red, &green, &blue);
+
+    float r[4], g[4], b[4];
+    vstore4(red, 0, r);
+    vstore4(green, 0, g);
+    vstore4(blue, 0, b);
+    for (int i = 0; i < 4 && x0 + i < WINDOW_WIDTH; ++i) {
+        float4 value = (float4)(r[i], g[i], b[i], 1.0f) * 255.0f;
+        pixels[x0 + i + WINDOW_WIDTH * y] = convert_uchar4_sat_rte(value);
+    }
+
+}
+
+#endif // GRAPHICS_LOCAL_TILES
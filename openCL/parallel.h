@@ -1,20 +1,15 @@
-// These are used to decide the window size
-#define WINDOW_HEIGHT 1024
-#define WINDOW_WIDTH 1024
-
-// The number of satelites can be changed to see how it affects performance.
-// Benchmarks must be run with the original number of satellites
-#define SATELITE_COUNT 64
+// WINDOW_WIDTH, WINDOW_HEIGHT, SATELITE_COUNT and PHYSICSUPDATESPERFRAME
+// are runtime values. The host code maps them to the command line options
+// (see common/options.h) and the kernels receive them as arguments.
 
 // These are used to control the satelite movement
 #define SATELITE_RADIUS 3.16f
 #define MAX_VELOCITY 0.1f
 #define GRAVITY 1.0f
 #define DELTATIME 32
-#define PHYSICSUPDATESPERFRAME 100000
 
 // Some helpers to window size variables
-#define SIZE WINDOW_HEIGHT*WINDOW_HEIGHT
+#define SIZE (WINDOW_WIDTH*WINDOW_HEIGHT)
 #define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
 #define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
 
@@ -24,6 +24,10 @@ VERSION 20.0 - relax physic correctness check
 // most optimization: gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL -O3
 
 
+// clock_gettime is POSIX, not part of -std=c99
+#define _POSIX_C_SOURCE 200809L
+// sched_setaffinity for thread pinning (common/topology.h)
+#define _GNU_SOURCE
 
 #ifdef _WIN32
 #include <windows.h>
@@ -32,8 +36,34 @@ VERSION 20.0 - relax physic correctness check
 #include <math.h> // INFINITY
 #include <stdlib.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h> // omp_get_thread_num
+#else
+#define omp_get_thread_num() 0
+#define omp_get_max_threads() 1
+#define omp_set_num_threads(threads) ((void)(threads))
+#endif
 
-// Window handling includes
+#include "../common/options.h" // Command line options
+#include "../common/timing.h" // nowNanoseconds
+#include "../common/frame_stats.h" // Benchmark statistics
+#include "../common/physics_simd.h" // SoA physics kernels
+#include "../common/physics_float.h" // Compensated float physics
+#include "../common/integrators.h" // Yoshida and Kepler integrators
+#include "../common/nbody.h" // Satelite-satelite gravity
+#include "../common/shader_simd.h" // Vectorized pixel shaders
+#include "../common/satellite_tree.h" // Barnes-Hut quadtree
+#include "../common/tile_scheduler.h" // Work-stealing tiles
+#include "../common/dirty_tiles.h" // Incremental rendering
+#include "../common/frame_writer.h" // Asynchronous frame output
+#include "../common/pixel_format.h" // Packed RGBA8 framebuffer
+#include "../common/topology.h" // Thread pinning and first touch
+#include "../common/trace.h" // Per-thread hot path tracing
+#include "../common/perf_counters.h" // Hardware counters per phase
+
+// Window handling includes, left out of headless-only builds
+// (-DPARALLEL_HEADLESS) so they build without OpenGL and GLUT
+#ifndef PARALLEL_HEADLESS
 #ifndef __APPLE__
 #include <GL/gl.h>
 #include <GL/glut.h>
@@ -41,32 +71,45 @@ VERSION 20.0 - relax physic correctness check
 #include <OpenGL/gl.h>
 #include <GLUT/glut.h>
 #endif
-// These are used to decide the window size
-#define WINDOW_HEIGHT 1024
-#define WINDOW_WIDTH  1024
+#endif
+// These are used to decide the window size. Runtime options (--width and
+// --height, see common/options.h), 1024x1024 by default.
+#define WINDOW_HEIGHT (options.windowHeight)
+#define WINDOW_WIDTH  (options.windowWidth)
 
-// The number of satelites can be changed to see how it affects performance.
-// Benchmarks must be run with the original number of satellites
-#define SATELITE_COUNT 64
+// The number of satelites can be changed to see how it affects performance
+// (--satellites). Benchmarks must be run with the original number of satellites
+#define SATELITE_COUNT (options.sateliteCount)
 
 // These are used to control the satelite movement
 #define SATELITE_RADIUS 3.16f
 #define MAX_VELOCITY 0.1f
 #define GRAVITY 1.0f
 #define DELTATIME 32
-#define PHYSICSUPDATESPERFRAME 100000
+#define PHYSICSUPDATESPERFRAME (options.physicsUpdatesPerFrame)
 
 // Some helpers to window size variables
-#define SIZE WINDOW_HEIGHT*WINDOW_HEIGHT
+#define SIZE (WINDOW_WIDTH*WINDOW_HEIGHT)
 #define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
 #define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
 
 // Is used to find out frame times
-int previousFrameTimeSinceStart = 0;
-int previousFinishTime = 0;
+long long previousFrameTimeSinceStart = 0;
+long long previousFinishTime = 0;
 unsigned int frameNumber = 0;
 unsigned int seed = 0;
 
+// Command line options (see common/options.h)
+simulationOptions options;
+
+// Accumulated frame timings for the headless summary, in nanoseconds
+// Per frame timings for --stats-json and --stats-csv
+frameStats frameStatistics;
+
+long long totalFrameTime = 0;
+long long totalPhysicsTime = 0;
+long long totalGraphicsTime = 0;
+
 // Stores 2D data like the coordinates
 typedef struct{
    float x;
@@ -112,13 +155,402 @@ satelite* backupSatelites;
 
 // ## You may add your own variables here ##
 
+// Structure-of-arrays double precision copy of the satelites for physics
+physicsState physics;
+
+// Widest physics kernel supported by this CPU
+physicsKernel physicsKernelSelected;
+
+// Integrator selected with --integrator. The physics check of the first
+// frames compares bit for bit with the Euler reference, so it only runs
+// for INTEGRATOR_EULER; --integrator-report measures the others instead.
+#define INTEGRATOR_EULER 0    // Reference symplectic Euler, PHYSICSUPDATESPERFRAME steps
+#define INTEGRATOR_YOSHIDA 1  // Fourth order symplectic, integratorSteps steps
+#define INTEGRATOR_KEPLER 2   // Analytic, one step per frame
+int integratorMode = INTEGRATOR_EULER;
+int integratorSteps = 1000;
+int integratorReport = 0;
+physicsKernel integratorKernel;
+
+// Precision of the Euler integrator (--physics-precision). Float keeps the
+// state as compensated float pairs and is checked with a tolerance.
+#define PHYSICS_DOUBLE 0
+#define PHYSICS_FLOAT 1
+int physicsPrecision = PHYSICS_DOUBLE;
+
+// Euler result of the same frame for --integrator-report
+physicsState eulerReference;
+
+// Gravity between the satelites (--nbody). Like the other integrators it
+// is checked against nothing, the reference engine has no such force.
+#define NBODY_OFF 0     // Black hole only
+#define NBODY_DIRECT 1  // All pairs, tiled SIMD kernel
+#define NBODY_TREE 2    // Barnes-Hut quadtree
+#define NBODY_AUTO 3    // NBODY_DIRECT up to NBODY_DIRECT_LIMIT satelites
+int nbodyMode = NBODY_OFF;
+int nbodySteps = NBODY_DEFAULT_STEPS;
+double nbodyMass = NBODY_DEFAULT_MASS;
+double nbodySoftening = NBODY_DEFAULT_SOFTENING;
+float nbodyTheta = NBODY_DEFAULT_THETA;
+nbodyKernel nbodyKernelSelected;
+
+// Accelerations of one substep and the positions and quadtree of
+// NBODY_TREE
+double *nbodyAX;
+double *nbodyAY;
+renderSatelites nbodySnapshot;
+sateliteTree nbodyTree;
+
+// Satelites per task of the N-body force loop
+#define NBODY_CHUNK 64
+
+// Widest pixel shader supported by this CPU, for GRAPHICS_BRUTE_FORCE
+pixelShader pixelShaderSelected;
+
+// Graphics engine selected with --graphics
+#define GRAPHICS_BRUTE_FORCE 0  // Every pixel against every satelite
+#define GRAPHICS_TREE 1         // Quadtree with Barnes-Hut far field
+int graphicsMode = GRAPHICS_BRUTE_FORCE;
+
+// Opening angle of the far field approximation (--tree-theta)
+float treeTheta = 0.3f;
+
+// Per frame satelite snapshot for the shaders and quadtree for
+// GRAPHICS_TREE
+renderSatelites renderSnapshot;
+sateliteTree tree;
+// Lists of the tile each thread is shading and the span shader over them
+treeTile *treeTiles = NULL;
+treeSpanFunction treeSpanShader;
+
+// Hands out the tiles of a frame to the OpenMP threads
+tileScheduler tiles;
+
+// Incremental rendering (--incremental), only tiles the satelite motion
+// may have changed are shaded. Off when incrementalInterval is 0.
+int incrementalInterval = 0;
+double incrementalTolerance = DIRTY_TILES_DEFAULT_TOLERANCE;
+dirtyTiles incremental;
+
+// Online CPUs, cores and NUMA nodes for thread placement
+cpuTopology topology;
+
+// Hardware counters of the engine phases (--perf-counters)
+perfCounters phaseCounters;
+
+// Colors pixels [begin, end) of a row into out, interleaved float RGB
+typedef void (*spanEngine)(int row, int begin, int end, float *out);
+
+// Framebuffer format (--pixel-format). In PIXEL_FORMAT_RGBA8 the engines
+// write pixelsRGBA8 instead of pixels.
+int pixelFormat = PIXEL_FORMAT_FLOAT;
+unsigned char *pixelsRGBA8 = NULL;
+// One float row of a tile per thread, packed to RGBA8 from there. On the
+// heap because --tile-size may be far wider than any stack.
+float *tileSpans = NULL;
+int tileSpanWidth = 0;
+
+// Frame output (--output, --output-pipe), NULL target for none
+const char *frameOutputTarget = NULL;
+int frameOutputCommand = 0;
+int frameOutputSlots = FRAME_WRITER_DEFAULT_SLOTS;
+int frameOutputWait = 0;
+frameWriter frameOutput;
+
+// Batch mode (--batch S): S independent scenarios, seeds seed, seed + 1,
+// ... (seed 0 draws like seed 1), simulated headless in one process. All
+// S * SATELITE_COUNT satelites are stepped together by the physics kernel;
+// the scenarios listed with --batch-render are also shaded every frame and
+// written as PPM sequences.
+typedef struct{
+   unsigned int seed;
+   double minRadius;        // Closest and farthest satelite from the black hole
+   double maxRadius;
+   double initialEnergy;    // Sum of the specific orbital energies
+   double energy;
+   double maxEnergyDrift;   // Largest |E - E0| / |E0| of any frame
+} batchScenario;
+
+int batchScenarios = 0;
+const char *batchRenderList = NULL;
+const char *batchFramePrefix = "scenario-";
+const char *batchStatesFile = NULL;
+satelite *batchSatelites;
+physicsState batchPhysics;
+batchScenario *batchResults;
+int *batchRendered;         // Scenario indices rendered every frame
+int batchRenderCount = 0;
+frameWriter *batchWriters;
+char **batchTargets;        // Frame patterns, kept open by the writers
+
+
+
+// Sets the thread count and pins the OpenMP threads, unless the OpenMP
+// environment already asks for a placement
+void placeThreads(){
+
+   discoverTopology(&topology);
+   if(options.threads > 0){
+      omp_set_num_threads(options.threads);
+   } else if(getenv("OMP_NUM_THREADS") == NULL){
+      omp_set_num_threads(topology.cpuCount);
+   }
+   int pin = options.pinThreads && getenv("OMP_PROC_BIND") == NULL &&
+             getenv("OMP_PLACES") == NULL;
+   if(pin){
+      #pragma omp parallel
+      {
+         pinWorker(&topology, omp_get_thread_num());
+      }
+   }
+   printTopology(&topology, omp_get_max_threads(), pin);
+}
 
-
+// Places the pages of the frame buffers on the node of the thread whose
+// home band of tiles they hold
+void firstTouchFrameBuffers(){
+
+   #pragma omp parallel
+   {
+      int worker = omp_get_thread_num();
+      if(pixelFormat == PIXEL_FORMAT_RGBA8){
+         firstTouchRows(&tiles, worker, pixelsRGBA8,
+                        (size_t)4 * WINDOW_WIDTH, WINDOW_HEIGHT);
+      } else {
+         firstTouchRows(&tiles, worker, pixels,
+                        sizeof(color) * WINDOW_WIDTH, WINDOW_HEIGHT);
+      }
+   }
+}
 
 // ## You may add your own initialization routines here ##
 void init(){
 
+   placeThreads();
+   traceStart(options.traceFile, omp_get_max_threads());
+
+   // The OpenMP runtime keeps its threads between parallel regions, so
+   // counters opened here count every later region
+   initPerfCounters(&phaseCounters, options.perfCounters,
+                    omp_get_max_threads(), SATELITE_COUNT,
+                    PHYSICSUPDATESPERFRAME, SIZE);
+   if(options.perfCounters){
+      #pragma omp parallel
+      {
+         perfOpenThread(&phaseCounters, omp_get_thread_num());
+      }
+      printPerfCounterStatus(&phaseCounters);
+   }
+
+   initPhysicsState(&physics, SATELITE_COUNT);
+   physicsKernelSelected = selectPhysicsKernel();
+   printf("Physics kernel: %s\n", physicsKernelSelected.name);
+   if(integratorMode == INTEGRATOR_YOSHIDA){
+      integratorKernel.step = stepSatelitesYoshida;
+      integratorKernel.width = 1;
+      integratorKernel.name = "yoshida";
+      printf("Integrator: yoshida, %d steps per frame\n", integratorSteps);
+   } else if(integratorMode == INTEGRATOR_KEPLER){
+      integratorKernel.step = stepSatelitesKepler;
+      integratorKernel.width = 1;
+      integratorKernel.name = "kepler";
+      printf("Integrator: kepler\n");
+   } else if(physicsPrecision == PHYSICS_FLOAT){
+      integratorKernel = selectFloatPhysicsKernel();
+      printf("Physics precision: float with compensated summation (%s)\n",
+             integratorKernel.name);
+   } else {
+      integratorKernel = physicsKernelSelected;
+   }
+   if(integratorReport){
+      initPhysicsState(&eulerReference, SATELITE_COUNT);
+   }
+   if(nbodyMode == NBODY_AUTO){
+      nbodyMode = SATELITE_COUNT <= NBODY_DIRECT_LIMIT ?
+         NBODY_DIRECT : NBODY_TREE;
+   }
+   if(nbodyMode != NBODY_OFF){
+      nbodyKernelSelected = selectNbodyKernel();
+      nbodyAX = (double*)allocateAligned(sizeof(double) * SATELITE_COUNT);
+      nbodyAY = (double*)allocateAligned(sizeof(double) * SATELITE_COUNT);
+      initRenderSatelites(&nbodySnapshot, SATELITE_COUNT);
+      initSateliteTree(&nbodyTree);
+      // Only the positions matter for gravity
+      memset(nbodySnapshot.red, 0, sizeof(float) * SATELITE_COUNT);
+      memset(nbodySnapshot.green, 0, sizeof(float) * SATELITE_COUNT);
+      memset(nbodySnapshot.blue, 0, sizeof(float) * SATELITE_COUNT);
+      if(nbodyMode == NBODY_DIRECT){
+         printf("N-body: direct (%s), %d steps per frame\n",
+                nbodyKernelSelected.name, nbodySteps);
+      } else {
+         printf("N-body: tree (theta %.2f), %d steps per frame\n",
+                nbodyTheta, nbodySteps);
+      }
+   }
+   pixelShaderSelected = selectPixelShader();
+   printf("Pixel shader: %s\n", pixelShaderSelected.name);
+
+   initRenderSatelites(&renderSnapshot, SATELITE_COUNT);
+   initSateliteTree(&tree);
+   if(graphicsMode == GRAPHICS_TREE){
+      treeTiles = (treeTile*)malloc(sizeof(treeTile) * omp_get_max_threads());
+      if(treeTiles == NULL){
+         fprintf(stderr, "Failed to allocate the tree tile lists\n");
+         exit(EXIT_FAILURE);
+      }
+      for(int t = 0; t < omp_get_max_threads(); ++t){
+         initTreeTile(&treeTiles[t], SATELITE_COUNT);
+      }
+      treeSpanShader = selectTreeSpanShader(pixelShaderSelected.name);
+   }
+
+   initTileScheduler(&tiles, omp_get_max_threads(), options.tileSize,
+                     WINDOW_WIDTH, WINDOW_HEIGHT);
+
+   if(pixelFormat == PIXEL_FORMAT_RGBA8){
+      pixelsRGBA8 = allocateRGBA8(SIZE);
+      tileSpanWidth = options.tileSize < WINDOW_WIDTH ?
+         options.tileSize : WINDOW_WIDTH;
+      tileSpans = (float*)allocateAligned(sizeof(float) * 3 *
+                                          (size_t)tileSpanWidth *
+                                          omp_get_max_threads());
+   }
+   firstTouchFrameBuffers();
+
+   if(incrementalInterval > 0){
+      initDirtyTiles(&incremental, SATELITE_COUNT, tiles.tileCount,
+                     incrementalInterval, incrementalTolerance);
+      printf("Incremental rendering: full frame every %d frames, "
+             "tolerance %g\n", incrementalInterval, incrementalTolerance);
+   }
+
+   if(frameOutputTarget != NULL){
+      openFrameWriter(&frameOutput, frameOutputTarget, frameOutputCommand,
+                      WINDOW_WIDTH, WINDOW_HEIGHT, frameOutputSlots,
+                      frameOutputWait);
+   }
+
+}
+
+// Steps all satelites of state through one frame with kernel
+void runPhysicsKernel(physicsKernel kernel, physicsState *state,
+                      const physicsParameters *parameters, int count){
+
+   // Physics satelite loop, one vector of satelites per iteration
+   const int width = kernel.width;
+   const int vectorCount = (count + width - 1) / width;
+
+   #pragma omp parallel for schedule(static)
+   for(int v = 0; v < vectorCount; ++v){
+      TRACE_BEGIN(chunkStart);
+      int begin = v * width;
+      int end = begin + width < count ? begin + width : count;
+      kernel.step(state, begin, end, parameters);
+      TRACE_END(omp_get_thread_num(), "physics chunk", v, chunkStart);
+   }
+}
+
+// Prints how far the selected integrator lands from the Euler reference
+// started from the same state, and what both cost
+void reportIntegratorError(const physicsParameters *euler,
+                           long long integratorTime){
+
+   long long start = nowNanoseconds();
+   runPhysicsKernel(physicsKernelSelected, &eulerReference, euler,
+                    SATELITE_COUNT);
+   long long eulerTime = nowNanoseconds() - start;
+
+   integratorError error = comparePhysicsStates(&physics, &eulerReference,
+                                                SATELITE_COUNT);
+   printf("Integrator %s vs euler: max error %.3e px (satelite %d), "
+          "rms %.3e px, %.3fms vs %.3fms\n",
+          integratorKernel.name, error.maxError, error.worstSatelite,
+          error.rmsError, nanosecondsToMilliseconds(integratorTime),
+          nanosecondsToMilliseconds(eulerTime));
+}
 
+// The physics check compares bit for bit with the sequential engine, which
+// only the reference integrator without satelite gravity reproduces
+int physicsMatchesReference(){
+   return integratorMode == INTEGRATOR_EULER && nbodyMode == NBODY_OFF &&
+      physicsPrecision == PHYSICS_DOUBLE;
+}
+
+// Physics check of --physics-precision float: prints how far the
+// satelites are from the double reference in backupSatelites and flags
+// those beyond PHYSICS_FLOAT_TOLERANCE
+void physicsToleranceCheck(){
+   checkPhysicsTolerance(&satelites[0].position.x,
+                         &backupSatelites[0].position.x, SATELITE_COUNT,
+                         sizeof(satelite) / sizeof(float));
+}
+
+// Moves the satelites of physics through one frame under the black hole
+// and each other's gravity, nbodySteps kick-drift substeps
+void nbodyPhysicsEngine(){
+
+   const nbodyParameters parameters = {
+      .centerX = HORIZONTAL_CENTER, .centerY = VERTICAL_CENTER,
+      .gravity = GRAVITY, .sateliteGravity = GRAVITY * nbodyMass,
+      .softening2 = nbodySoftening * nbodySoftening,
+      .deltaTime = (double)DELTATIME / nbodySteps};
+   const int chunkCount = (SATELITE_COUNT + NBODY_CHUNK - 1) / NBODY_CHUNK;
+
+   #pragma omp parallel
+   {
+      for(int step = 0; step < nbodySteps; ++step){
+
+         // The tree build is serial, it is cheap next to the traversals
+         if(nbodyMode == NBODY_TREE){
+            #pragma omp single
+            {
+               TRACE_BEGIN(treeStart);
+               for(int i = 0; i < SATELITE_COUNT; ++i){
+                  nbodySnapshot.x[i] = physics.x[i];
+                  nbodySnapshot.y[i] = physics.y[i];
+               }
+               buildSateliteTree(&nbodyTree, &nbodySnapshot);
+               TRACE_END(omp_get_thread_num(), "nbody tree", step, treeStart);
+            }
+         }
+
+         // Forces from the positions of this substep, the tree traversal
+         // cost varies so the chunks are handed out dynamically
+         #pragma omp for schedule(dynamic)
+         for(int c = 0; c < chunkCount; ++c){
+            TRACE_BEGIN(forceStart);
+            int begin = c * NBODY_CHUNK;
+            int end = begin + NBODY_CHUNK < SATELITE_COUNT ?
+               begin + NBODY_CHUNK : SATELITE_COUNT;
+            nbodyCentralForce(&physics, begin, end, &parameters,
+                              nbodyAX, nbodyAY);
+            if(nbodyMode == NBODY_DIRECT){
+               nbodyKernelSelected.force(&physics, SATELITE_COUNT, begin, end,
+                                         &parameters, nbodyAX, nbodyAY);
+            } else {
+               for(int i = begin; i < end; ++i){
+                  double ax, ay;
+                  treeAcceleration(&nbodyTree, &nbodySnapshot,
+                                   nbodySnapshot.x[i], nbodySnapshot.y[i],
+                                   nbodyTheta, parameters.softening2,
+                                   &ax, &ay);
+                  nbodyAX[i] += parameters.sateliteGravity * ax;
+                  nbodyAY[i] += parameters.sateliteGravity * ay;
+               }
+            }
+            TRACE_END(omp_get_thread_num(), "nbody forces", c, forceStart);
+         }
+
+         #pragma omp for schedule(static)
+         for(int c = 0; c < chunkCount; ++c){
+            int begin = c * NBODY_CHUNK;
+            int end = begin + NBODY_CHUNK < SATELITE_COUNT ?
+               begin + NBODY_CHUNK : SATELITE_COUNT;
+            nbodyKickDrift(&physics, begin, end, &parameters,
+                           nbodyAX, nbodyAY);
+         }
+      }
+   }
 }
 
 // ## You are asked to make this code parallel ##
@@ -128,71 +560,93 @@ void init(){
 // is not accurate enough to be done only once
 void parallelPhysicsEngine(){
 
+   perfPhaseBegin(&phaseCounters);
+   const physicsParameters parameters = {
+      .centerX = HORIZONTAL_CENTER, .centerY = VERTICAL_CENTER,
+      .gravity = GRAVITY, .deltaTime = DELTATIME,
+      .updatesPerFrame = PHYSICSUPDATESPERFRAME,
+      .updates = PHYSICSUPDATESPERFRAME};
+
+   // The alternative integrators take their own number of steps
+   physicsParameters integratorParameters = parameters;
+   if(integratorMode == INTEGRATOR_YOSHIDA){
+      integratorParameters.updates = integratorSteps;
+      integratorParameters.updatesPerFrame = integratorSteps;
+   }
 
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELITE_COUNT];
-   doublevector tmpVelocity[SATELITE_COUNT];
-   
-   #pragma omp simd
    for (int i = 0; i < SATELITE_COUNT; ++i) {
-       tmpPosition[i].x = satelites[i].position.x;
-       tmpPosition[i].y = satelites[i].position.y;
-       tmpVelocity[i].x = satelites[i].velocity.x;
-       tmpVelocity[i].y = satelites[i].velocity.y;
+       physics.x[i] = satelites[i].position.x;
+       physics.y[i] = satelites[i].position.y;
+       physics.vx[i] = satelites[i].velocity.x;
+       physics.vy[i] = satelites[i].velocity.y;
    }
-
-   // Physics satelite loop
-   #pragma omp parallel for  
-   for(int i = 0; i < SATELITE_COUNT; ++i){  
-
-      // Physics iteration loop    
-         for(int physicsUpdateIndex = 0; 
-            physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
-            ++physicsUpdateIndex){ 
-
-         // Distance to the blackhole (bit ugly code because C-struct cannot have member functions)
-         doublevector positionToBlackHole = {.x = tmpPosition[i].x -
-            HORIZONTAL_CENTER, .y = tmpPosition[i].y - VERTICAL_CENTER};
-         double distToBlackHoleSquared =
-            positionToBlackHole.x * positionToBlackHole.x +
-            positionToBlackHole.y * positionToBlackHole.y;
-         double distToBlackHole = sqrt(distToBlackHoleSquared);
-
-         // Gravity force
-         doublevector normalizedDirection = {
-            .x = positionToBlackHole.x / distToBlackHole,
-            .y = positionToBlackHole.y / distToBlackHole};
-         double accumulation = GRAVITY / distToBlackHoleSquared;
-
-         // Delta time is used to make velocity same despite different FPS
-         // Update velocity based on force
-         tmpVelocity[i].x -= accumulation * normalizedDirection.x *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
-         tmpVelocity[i].y -= accumulation * normalizedDirection.y *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
-
-         // Update position based on velocity
-         tmpPosition[i].x +=
-            tmpVelocity[i].x * DELTATIME / PHYSICSUPDATESPERFRAME;
-         tmpPosition[i].y +=
-            tmpVelocity[i].y * DELTATIME / PHYSICSUPDATESPERFRAME;
-
+   if(integratorReport){
+      for (int i = 0; i < SATELITE_COUNT; ++i) {
+         eulerReference.x[i] = physics.x[i];
+         eulerReference.y[i] = physics.y[i];
+         eulerReference.vx[i] = physics.vx[i];
+         eulerReference.vy[i] = physics.vy[i];
       }
    }
 
+   long long start = nowNanoseconds();
+   if(nbodyMode != NBODY_OFF){
+      nbodyPhysicsEngine();
+   } else {
+      runPhysicsKernel(integratorKernel, &physics, &integratorParameters,
+                       SATELITE_COUNT);
+   }
+   TRACE_END(0, "physics", (int)frameNumber, start);
+   if(integratorReport){
+      reportIntegratorError(&parameters, nowNanoseconds() - start);
+   }
+
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
    // copy back the float storage.
-   
-   #pragma omp simd
    for (int i = 0; i < SATELITE_COUNT; ++i) {
-       satelites[i].position.x = tmpPosition[i].x;
-       satelites[i].position.y = tmpPosition[i].y;
-       satelites[i].velocity.x = tmpVelocity[i].x;
-       satelites[i].velocity.y = tmpVelocity[i].y;
+       satelites[i].position.x = physics.x[i];
+       satelites[i].position.y = physics.y[i];
+       satelites[i].velocity.x = physics.vx[i];
+       satelites[i].velocity.y = physics.vy[i];
+   }
+   perfPhaseEnd(&phaseCounters, PERF_PHASE_PHYSICS);
+
+}
+
+// Colors pixels [begin, end) of a row with the selected pixel shader
+void graphicsEngineSpanShader(int row, int begin, int end, float *out){
+   pixelShaderSelected.shade(&renderSnapshot, SATELITE_RADIUS, row, begin, end,
+                             out);
+}
+
+// Colors pixels [begin, end) of a row with the quadtree lists of the tile
+// the thread collected. The nearest satelite is exact, the weighted color
+// sum uses the Barnes-Hut approximation. A source of the lists costs about
+// twice a satelite of the brute force shaders, so tiles whose lists are
+// not below half the satelites are shaded brute force.
+void graphicsEngineSpanTree(int row, int begin, int end, float *out){
+   const treeTile *tile = &treeTiles[omp_get_thread_num()];
+   if(2 * tile->sourceCount >= SATELITE_COUNT){
+      graphicsEngineSpanShader(row, begin, end, out);
+   } else {
+      treeSpanShader(tile, &renderSnapshot, SATELITE_RADIUS, row, begin, end,
+                     out);
    }
+}
+
+// Copies the satelites into the structure-of-arrays snapshot
+void fillRenderSnapshot(){
 
+   for(int j = 0; j < SATELITE_COUNT; ++j){
+      renderSnapshot.x[j] = satelites[j].position.x;
+      renderSnapshot.y[j] = satelites[j].position.y;
+      renderSnapshot.red[j] = satelites[j].identifier.red;
+      renderSnapshot.green[j] = satelites[j].identifier.green;
+      renderSnapshot.blue[j] = satelites[j].identifier.blue;
+   }
 }
 
 // ## You are asked to make this code parallel ##
@@ -200,72 +654,145 @@ void parallelPhysicsEngine(){
 // Decides the color for each pixel.
 void parallelGraphicsEngine(){
 
-    // Graphics pixel loop
-    #pragma omp parallel for
-    for(int i = 0 ;i < SIZE; ++i) {
+    perfPhaseBegin(&phaseCounters);
+    TRACE_BEGIN(graphicsStart);
+    spanEngine engine = graphicsEngineSpanShader;
 
-      // Row wise ordering
-      floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
-
-      // This color is used for coloring the pixel
-      color renderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
+    fillRenderSnapshot();
+    if(graphicsMode == GRAPHICS_TREE){
+       buildSateliteTree(&tree, &renderSnapshot);
+       engine = graphicsEngineSpanTree;
+    }
 
-      // Find closest satelite
-      float shortestDistance = INFINITY;
+    // Graphics tile loop, threads steal tiles from each other when their
+    // own part of the frame is done. Incremental rendering hands out the
+    // indices of the dirty tile list instead of all tiles.
+    const int *tileList = NULL;
+    if(incrementalInterval > 0){
+       TRACE_BEGIN(dirtyStart);
+       markDirtyTiles(&incremental, &tiles, &renderSnapshot, SATELITE_RADIUS,
+                      pixelFormat == PIXEL_FORMAT_RGBA8 ? NULL : &pixels[0].red,
+                      pixelsRGBA8, WINDOW_WIDTH, WINDOW_HEIGHT);
+       tileList = incremental.dirtyList;
+       TRACE_END(0, "dirty tiles", incremental.dirtyCount, dirtyStart);
+       resetTileSchedulerCount(&tiles, incremental.dirtyCount);
+    } else {
+       resetTileScheduler(&tiles);
+    }
+    #pragma omp parallel
+    {
+       int worker = omp_get_thread_num();
+       int tile;
+       while((tile = nextTile(&tiles, worker)) >= 0) {
+          TRACE_BEGIN(tileStart);
+          if(tileList != NULL) {
+             tile = tileList[tile];
+          }
+          int x0, y0, x1, y1;
+          tileBounds(&tiles, tile, WINDOW_WIDTH, WINDOW_HEIGHT,
+                     &x0, &y0, &x1, &y1);
+          if(graphicsMode == GRAPHICS_TREE) {
+             collectTreeTile(&treeTiles[worker], &tree, &renderSnapshot,
+                             treeTheta, x0, y0, x1, y1);
+          }
+          for(int row = y0; row < y1; ++row) {
+             if(pixelFormat == PIXEL_FORMAT_RGBA8) {
+                float *span = &tileSpans[3 * (size_t)tileSpanWidth * worker];
+                engine(row, x0, x1, span);
+                convertSpanRGBA8(span,
+                                 &pixelsRGBA8[4 * ((size_t)row * WINDOW_WIDTH + x0)],
+                                 x1 - x0);
+             } else {
+                engine(row, x0, x1,
+                       &pixels[(size_t)row * WINDOW_WIDTH + x0].red);
+             }
+          }
+          TRACE_END(worker, "tile", tile, tileStart);
+       }
+    }
 
-      float weights = 0.f;
-      int hitsSatellite = 0;
+    // Converted here, written by the writer thread
+    if(frameOutputTarget != NULL){
+       TRACE_BEGIN(outputStart);
+       if(pixelFormat == PIXEL_FORMAT_RGBA8){
+          submitFrameRGBA8(&frameOutput, pixelsRGBA8, frameNumber);
+       } else {
+          submitFrame(&frameOutput, &pixels[0].red, frameNumber);
+       }
+       TRACE_END(0, "frame output", (int)frameNumber, outputStart);
+    }
+    TRACE_END(0, "graphics", (int)frameNumber, graphicsStart);
+    perfPhaseEnd(&phaseCounters, PERF_PHASE_GRAPHICS);
+}
 
-      // Temporary rgb increments
-      float red = 0.0f;
-      float green = 0.0f;
-      float blue = 0.0f;
+// ## You may add your own destrcution routines here ##
+void destroy(){
 
-      // First Graphics satelite loop: Find the closest satellite.    
-      #pragma omp reduction (+:red,green,blue) ordered_schedule(dynamic)
-      for(int j = 0; j < SATELITE_COUNT; ++j){
-         floatvector difference = {.x = pixel.x - satelites[j].position.x,
-                                   .y = pixel.y - satelites[j].position.y};
-         float distance = sqrt(difference.x * difference.x + 
-                               difference.y * difference.y);
-         if(distance < SATELITE_RADIUS) {
-            renderColor.red = 1.0f;
-            renderColor.green = 1.0f;
-            renderColor.blue = 1.0f;
-            hitsSatellite = 1;
-            break;
-         } else {
-            float weight = 1.0f / (distance*distance*distance*distance);
-            weights += weight;
-            if(distance < shortestDistance){
-               shortestDistance = distance;
-               renderColor = satelites[j].identifier;
-            }
-            
-            red += satelites[j].identifier.red*weight;
-            green += satelites[j].identifier.green*weight;
-            blue += satelites[j].identifier.blue*weight;
-            
-         }
+   freePhysicsState(&physics);
+   if(integratorReport){
+      freePhysicsState(&eulerReference);
+   }
+   freeRenderSatelites(&renderSnapshot);
+   freeSateliteTree(&tree);
+   if(treeTiles != NULL){
+      for(int t = 0; t < omp_get_max_threads(); ++t){
+         freeTreeTile(&treeTiles[t]);
       }
+      free(treeTiles);
+   }
+   freeTileScheduler(&tiles);
+   freeTopology(&topology);
+   traceFinish();
+   printPerfSummary(&phaseCounters);
+   freePerfCounters(&phaseCounters);
+   if(frameOutputTarget != NULL){
+      closeFrameWriter(&frameOutput);
+   }
+   free(pixelsRGBA8);
+   free(tileSpans);
+   if(incrementalInterval > 0){
+      printf("Incremental rendering: %.1f%% of the tiles shaded\n",
+             100.0 * incremental.shadedTiles / incremental.totalTiles);
+      freeDirtyTiles(&incremental);
+   }
+   if(nbodyMode != NBODY_OFF){
+      free(nbodyAX);
+      free(nbodyAY);
+      freeRenderSatelites(&nbodySnapshot);
+      freeSateliteTree(&nbodyTree);
+   }
 
-      // Second graphics loop: Calculate the color based on distance to every satelite.
-      if (!hitsSatellite) {         
+}
 
-         renderColor.red += red/weights * 3.0f;
-         renderColor.green += green/weights * 3.0f;
-         renderColor.blue += blue/weights * 3.0f; 
-         
+// errorCheck() in the quantized domain of --pixel-format rgba8, called by
+// compute() with ALLOWED_FP_ERROR
+void errorCheckRGBA8(double allowedError){
+   const int tolerance = quantizedTolerance(allowedError);
+   for(unsigned int i = 0; i < SIZE; ++i){
+      const unsigned char *pixel = &pixelsRGBA8[4 * i];
+      if(abs(quantizeChannel(correctPixels[i].red) - pixel[0]) > tolerance ||
+         abs(quantizeChannel(correctPixels[i].green) - pixel[1]) > tolerance ||
+         abs(quantizeChannel(correctPixels[i].blue) - pixel[2]) > tolerance){
+         printf("Buggy pixel at (x=%i, y=%i). Press enter to continue.\n",
+                i % WINDOW_WIDTH, i / WINDOW_WIDTH);
+         getchar();
+         return;
       }
-      pixels[i] = renderColor;
    }
+   printf("Error check passed!\n");
 }
 
-// ## You may add your own destrcution routines here ##
-void destroy(){
-
-
+#ifndef PARALLEL_HEADLESS
+// Draws the framebuffer of the selected --pixel-format, called by render()
+void drawPixels(){
+   if(pixelFormat == PIXEL_FORMAT_RGBA8){
+      glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE,
+                   pixelsRGBA8);
+   } else {
+      glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
+   }
 }
+#endif
 
 
 
@@ -346,8 +873,10 @@ void sequentialPhysicsEngine(satelite *s){
 
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELITE_COUNT];
-   doublevector tmpVelocity[SATELITE_COUNT];
+   doublevector *tmpPosition =
+      (doublevector*)malloc(sizeof(doublevector) * SATELITE_COUNT);
+   doublevector *tmpVelocity =
+      (doublevector*)malloc(sizeof(doublevector) * SATELITE_COUNT);
 
    for (int i = 0; i < SATELITE_COUNT; ++i) {
        tmpPosition[i].x = s[i].position.x;
@@ -403,6 +932,9 @@ void sequentialPhysicsEngine(satelite *s){
        s[i].velocity.x = tmpVelocity[i].x;
        s[i].velocity.y = tmpVelocity[i].y;
    }
+
+   free(tmpPosition);
+   free(tmpVelocity);
 }
 
 // Just some value that barely passes for OpenCL example program
@@ -423,7 +955,7 @@ void errorCheck(){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 void compute(void){
-   int timeSinceStart = glutGet(GLUT_ELAPSED_TIME);
+   long long timeSinceStart = nowNanoseconds();
    previousFrameTimeSinceStart = timeSinceStart;
 
    // Error check during first frames
@@ -432,7 +964,7 @@ void compute(void){
       sequentialPhysicsEngine(backupSatelites);
    }
    parallelPhysicsEngine();
-   if (frameNumber < 2) {
+   if (frameNumber < 2 && physicsMatchesReference()) {
       for (int i = 0; i < SATELITE_COUNT; i++) {
          if (memcmp (&satelites[i], &backupSatelites[i], sizeof(satelite))) {
             printf("Incorrect satelite data of satelite: %d\n", i);
@@ -440,32 +972,50 @@ void compute(void){
          }
       }
    }
+   if (frameNumber < 2 && physicsPrecision == PHYSICS_FLOAT) {
+      physicsToleranceCheck();
+   }
 
-   int sateliteMovementMoment = glutGet(GLUT_ELAPSED_TIME);
-   int sateliteMovementTime = sateliteMovementMoment  - timeSinceStart;
+   long long sateliteMovementMoment = nowNanoseconds();
+   long long sateliteMovementTime = sateliteMovementMoment  - timeSinceStart;
 
    // Decides the colors for the pixels
    parallelGraphicsEngine();
 
-   int pixelColoringMoment = glutGet(GLUT_ELAPSED_TIME);
-   int pixelColoringTime =  pixelColoringMoment - sateliteMovementMoment;
+   long long pixelColoringMoment = nowNanoseconds();
+   long long pixelColoringTime =  pixelColoringMoment - sateliteMovementMoment;
 
    // Sequential code is used to check possible errors in the parallel version
    if(frameNumber < 2){
       sequentialGraphicsEngine();
-      errorCheck();
+      pixelFormat == PIXEL_FORMAT_RGBA8 ? errorCheckRGBA8(ALLOWED_FP_ERROR) : errorCheck();
    }
 
-   int finishTime = glutGet(GLUT_ELAPSED_TIME);
+   long long finishTime = nowNanoseconds();
    // Print timings
-   int totalTime = finishTime - previousFinishTime;
+   long long totalTime = finishTime - previousFinishTime;
    previousFinishTime = finishTime;
 
-   printf("Total frametime: %ims, satelite moving: %ims, space coloring: %ims.\n",
-      totalTime, sateliteMovementTime, pixelColoringTime);
+   totalFrameTime += totalTime;
+   totalPhysicsTime += sateliteMovementTime;
+   totalGraphicsTime += pixelColoringTime;
+   if(frameNumber >= STATS_SKIPPED_FRAMES){
+      recordFrame(&frameStatistics, sateliteMovementTime, pixelColoringTime,
+                  totalTime);
+   }
+
+   printf("Total frametime: %.3fms, satelite moving: %.3fms, space coloring: %.3fms.\n",
+      nanosecondsToMilliseconds(totalTime),
+      nanosecondsToMilliseconds(sateliteMovementTime),
+      nanosecondsToMilliseconds(pixelColoringTime));
+   printPerfFrame(&phaseCounters);
 
    // Render the frame
-   glutPostRedisplay();
+#ifndef PARALLEL_HEADLESS
+   if(!options.headless){
+      glutPostRedisplay();
+   }
+#endif
 }
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
@@ -545,22 +1095,648 @@ void fixedDestroy(void){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 // Renders pixels-buffer to the window 
+#ifndef PARALLEL_HEADLESS
 void render(void){
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-   glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
+   drawPixels();
    glutSwapBuffers();
    frameNumber++;
 }
+#endif
+
+// Fills out with the satelites of one batch scenario. The same draws in
+// the same order as fixedInit(), so a scenario starts exactly like a
+// single run with its seed. fixedInit() is protected and writes only to
+// satelites, so its generation loop cannot be shared and is copied here:
+// any change there has to be made here too. checkBatchAgainstSingleRun()
+// stops the batch on a mismatch.
+void initScenario(unsigned int scenarioSeed, satelite *out){
+
+   srand(scenarioSeed);
+   for(int i = 0; i < SATELITE_COUNT; ++i){
+      color id = {.red = randomNumber(0.f, 0.15f) + 0.1f,
+                  .green = randomNumber(0.f, 0.14f) + 0.0f,
+                  .blue = randomNumber(0.f, 0.16f) + 0.0f};
+
+      floatvector initialPosition = {.x = HORIZONTAL_CENTER - randomNumber(50, 320),
+                              .y = VERTICAL_CENTER - randomNumber(50, 320) };
+      initialPosition.x = (i / 2 % 2 == 0) ?
+         initialPosition.x : WINDOW_WIDTH - initialPosition.x;
+      initialPosition.y = (i < SATELITE_COUNT / 2) ?
+         initialPosition.y : WINDOW_HEIGHT - initialPosition.y;
+
+      floatvector positionToBlackHole = {.x = initialPosition.x - HORIZONTAL_CENTER,
+                                    .y = initialPosition.y - VERTICAL_CENTER};
+      float distance = (0.06 + randomNumber(-0.01f, 0.01f))/
+        sqrt(positionToBlackHole.x * positionToBlackHole.x +
+          positionToBlackHole.y * positionToBlackHole.y);
+      floatvector initialVelocity = {.x = distance * -positionToBlackHole.y,
+                                .y = distance * positionToBlackHole.x};
+
+      if(i % 2 == 0){
+         initialVelocity.x = -initialVelocity.x;
+         initialVelocity.y = -initialVelocity.y;
+      }
+
+      satelite tmpSatelite = {.identifier = id, .position = initialPosition,
+                              .velocity = initialVelocity};
+      out[i] = tmpSatelite;
+   }
+}
+
+// Compares the first scenario with the single run state in satelites,
+// which fixedInit() generated from the same seed, and exits on a mismatch
+void checkBatchAgainstSingleRun(const char *when){
+
+   for(int i = 0; i < SATELITE_COUNT; ++i){
+      if(memcmp(&batchSatelites[i], &satelites[i], sizeof(satelite))){
+         fprintf(stderr, "Batch scenario 0 differs from the single run with "
+                 "seed %u %s, satelite: %d\n", batchResults[0].seed, when, i);
+         exit(EXIT_FAILURE);
+      }
+   }
+   printf("Batch check against the single run passed %s\n", when);
+}
+
+// Compares the first scenario with the sequential engine result in
+// backupSatelites. Every differing satelite is listed, then the batch
+// waits for a key like the other checks and exits.
+void checkBatchAgainstSequential(){
+
+   int failures = 0;
+   for(int i = 0; i < SATELITE_COUNT; i++){
+      if(memcmp(&batchSatelites[i], &backupSatelites[i], sizeof(satelite))){
+         printf("Incorrect satelite data of satelite: %d\n", i);
+         ++failures;
+      }
+   }
+   if(failures > 0){
+      printf("Batch physics check failed at frame %d: %d of %d satelites "
+             "differ from the sequential engine\n", frameNumber, failures,
+             SATELITE_COUNT);
+      getchar();
+      exit(EXIT_FAILURE);
+   }
+   printf("Batch physics check passed at frame %d\n", frameNumber);
+}
+
+// Parses the comma separated scenario indices of --batch-render
+void parseBatchRenderList(){
+
+   batchRendered = (int*)malloc(sizeof(int) * batchScenarios);
+   const char *p = batchRenderList;
+   while(p != NULL && *p != '\0'){
+      char *end;
+      long index = strtol(p, &end, 10);
+      if(end == p || (*end != ',' && *end != '\0') ||
+         index < 0 || index >= batchScenarios){
+         fprintf(stderr, "Invalid scenario in --batch-render: %s\n",
+                 batchRenderList);
+         exit(EXIT_FAILURE);
+      }
+      if(batchRenderCount < batchScenarios){
+         batchRendered[batchRenderCount++] = (int)index;
+      }
+      p = *end == ',' ? end + 1 : end;
+   }
+}
+
+// Updates the radius range and energy drift of every scenario
+void updateBatchStatistics(int first){
+
+   #pragma omp parallel for schedule(static)
+   for(int s = 0; s < batchScenarios; ++s){
+      batchScenario *result = &batchResults[s];
+      const satelite *scenario = &batchSatelites[(size_t)s * SATELITE_COUNT];
+      double energy = 0.0;
+      for(int i = 0; i < SATELITE_COUNT; ++i){
+         double px = scenario[i].position.x - HORIZONTAL_CENTER;
+         double py = scenario[i].position.y - VERTICAL_CENTER;
+         double vx = scenario[i].velocity.x;
+         double vy = scenario[i].velocity.y;
+         double radius = sqrt(px * px + py * py);
+         energy += 0.5 * (vx * vx + vy * vy) - GRAVITY / radius;
+         if(first || radius < result->minRadius){
+            result->minRadius = radius;
+         }
+         if(first || radius > result->maxRadius){
+            result->maxRadius = radius;
+         }
+      }
+      result->energy = energy;
+      if(first){
+         result->initialEnergy = energy;
+         result->maxEnergyDrift = 0.0;
+      } else {
+         double drift = fabs(energy - result->initialEnergy) /
+                        fabs(result->initialEnergy);
+         if(drift > result->maxEnergyDrift){
+            result->maxEnergyDrift = drift;
+         }
+      }
+   }
+}
+
+// Physics engine of batch mode, parallelPhysicsEngine() over all scenarios
+void batchPhysicsEngine(const physicsParameters *parameters){
+
+   perfPhaseBegin(&phaseCounters);
+   const int count = batchScenarios * SATELITE_COUNT;
+
+   // Through double and back to float every frame like a single run
+   #pragma omp parallel for schedule(static)
+   for(int i = 0; i < count; ++i){
+      batchPhysics.x[i] = batchSatelites[i].position.x;
+      batchPhysics.y[i] = batchSatelites[i].position.y;
+      batchPhysics.vx[i] = batchSatelites[i].velocity.x;
+      batchPhysics.vy[i] = batchSatelites[i].velocity.y;
+   }
+   TRACE_BEGIN(physicsStart);
+   runPhysicsKernel(integratorKernel, &batchPhysics, parameters, count);
+   TRACE_END(0, "batch physics", (int)frameNumber, physicsStart);
+   #pragma omp parallel for schedule(static)
+   for(int i = 0; i < count; ++i){
+      batchSatelites[i].position.x = batchPhysics.x[i];
+      batchSatelites[i].position.y = batchPhysics.y[i];
+      batchSatelites[i].velocity.x = batchPhysics.vx[i];
+      batchSatelites[i].velocity.y = batchPhysics.vy[i];
+   }
+   perfPhaseEnd(&phaseCounters, PERF_PHASE_PHYSICS);
+}
+
+// Shades the --batch-render scenarios and queues them to their writers
+void renderBatchScenarios(){
+
+   for(int r = 0; r < batchRenderCount; ++r){
+      memcpy(satelites,
+             &batchSatelites[(size_t)batchRendered[r] * SATELITE_COUNT],
+             sizeof(satelite) * SATELITE_COUNT);
+      parallelGraphicsEngine();
+      if(pixelFormat == PIXEL_FORMAT_RGBA8){
+         submitFrameRGBA8(&batchWriters[r], pixelsRGBA8, frameNumber);
+      } else {
+         submitFrame(&batchWriters[r], &pixels[0].red, frameNumber);
+      }
+   }
+}
+
+// Writes the final satelite states of all scenarios as CSV
+void writeBatchStates(){
+
+   FILE *out = openStatsFile(batchStatesFile);
+   if(out == NULL){
+      return;
+   }
+   fprintf(out, "scenario,seed,satelite,x,y,vx,vy\n");
+   for(int s = 0; s < batchScenarios; ++s){
+      const satelite *scenario = &batchSatelites[(size_t)s * SATELITE_COUNT];
+      for(int i = 0; i < SATELITE_COUNT; ++i){
+         fprintf(out, "%d,%u,%d,%.9g,%.9g,%.9g,%.9g\n", s,
+                 batchResults[s].seed, i, scenario[i].position.x,
+                 scenario[i].position.y, scenario[i].velocity.x,
+                 scenario[i].velocity.y);
+      }
+   }
+   if(out != stdout){
+      fclose(out);
+   }
+}
+
+// Headless loop of --batch: all scenarios through options.frames frames,
+// then the statistics of each scenario and a timing summary
+void runBatch(void){
+
+   const int count = batchScenarios * SATELITE_COUNT;
+   const unsigned int firstSeed = seed != 0 ? seed : 1;
+   physicsParameters parameters = {
+      .centerX = HORIZONTAL_CENTER, .centerY = VERTICAL_CENTER,
+      .gravity = GRAVITY, .deltaTime = DELTATIME,
+      .updatesPerFrame = PHYSICSUPDATESPERFRAME,
+      .updates = PHYSICSUPDATESPERFRAME};
+   if(integratorMode == INTEGRATOR_YOSHIDA){
+      parameters.updates = integratorSteps;
+      parameters.updatesPerFrame = integratorSteps;
+   }
+
+   batchSatelites = (satelite*)malloc(sizeof(satelite) * count);
+   batchResults = (batchScenario*)malloc(sizeof(batchScenario) *
+                                         batchScenarios);
+   if(batchSatelites == NULL || batchResults == NULL){
+      fprintf(stderr, "Failed to allocate %d scenarios\n", batchScenarios);
+      exit(EXIT_FAILURE);
+   }
+   initPhysicsState(&batchPhysics, count);
+   for(int s = 0; s < batchScenarios; ++s){
+      batchResults[s].seed = firstSeed + s;
+      initScenario(batchResults[s].seed,
+                   &batchSatelites[(size_t)s * SATELITE_COUNT]);
+   }
+   updateBatchStatistics(1);
+   checkBatchAgainstSingleRun("at the start");
+
+   parseBatchRenderList();
+   batchWriters = (frameWriter*)malloc(sizeof(frameWriter) *
+                                       (batchRenderCount + 1));
+   batchTargets = (char**)malloc(sizeof(char*) * (batchRenderCount + 1));
+   for(int r = 0; r < batchRenderCount; ++r){
+      // A '%' of the prefix is doubled, the pattern has only the frame %d
+      size_t length = 2 * strlen(batchFramePrefix) + 32;
+      batchTargets[r] = (char*)malloc(length);
+      char *target = batchTargets[r];
+      for(const char *p = batchFramePrefix; *p != '\0'; ++p){
+         if(*p == '%'){
+            *target++ = '%';
+         }
+         *target++ = *p;
+      }
+      snprintf(target, length - (target - batchTargets[r]),
+               "seed%u-%%05d.ppm", batchResults[batchRendered[r]].seed);
+      openFrameWriter(&batchWriters[r], batchTargets[r], 0, WINDOW_WIDTH,
+                      WINDOW_HEIGHT, frameOutputSlots, frameOutputWait);
+   }
+
+   // The counters normalize by the work of the whole batch
+   phaseCounters.physicsUpdates *= batchScenarios;
+   phaseCounters.interactions *= batchRenderCount > 0 ? batchRenderCount : 1;
+
+   printf("Batch: %d scenarios of %d satelites, seeds %u to %u, "
+          "%d rendered\n", batchScenarios, SATELITE_COUNT, firstSeed,
+          firstSeed + batchScenarios - 1, batchRenderCount);
+
+   initFrameStats(&frameStatistics);
+   previousFinishTime = nowNanoseconds();
+   for(frameNumber = 0; frameNumber < options.frames; ++frameNumber){
+      // The first scenario is checked against the sequential engine. The
+      // reference runs and the comparisons are left out of the frame times.
+      long long checkStart = nowNanoseconds();
+      int checked = frameNumber < 2 && physicsMatchesReference();
+      if(checked){
+         memcpy(backupSatelites, batchSatelites,
+                sizeof(satelite) * SATELITE_COUNT);
+         sequentialPhysicsEngine(backupSatelites);
+      }
+      long long start = nowNanoseconds();
+      long long checkTime = start - checkStart;
+
+      batchPhysicsEngine(&parameters);
+      updateBatchStatistics(0);
+      long long physicsMoment = nowNanoseconds();
+
+      if(frameNumber == 0){
+         // The single run state through its own engine
+         parallelPhysicsEngine();
+         checkBatchAgainstSingleRun("after the first frame");
+      }
+      if(checked){
+         checkBatchAgainstSequential();
+      }
+      long long renderStart = nowNanoseconds();
+      checkTime += renderStart - physicsMoment;
+
+      renderBatchScenarios();
+      long long finishTime = nowNanoseconds();
+
+      long long physicsTime = physicsMoment - start;
+      long long renderTime = finishTime - renderStart;
+      long long totalTime = finishTime - previousFinishTime - checkTime;
+      previousFinishTime = finishTime;
+      totalFrameTime += totalTime;
+      totalPhysicsTime += physicsTime;
+      totalGraphicsTime += renderTime;
+      if(frameNumber >= STATS_SKIPPED_FRAMES){
+         recordFrame(&frameStatistics, physicsTime, renderTime, totalTime);
+      }
+      printf("Batch frametime: %.3fms, satelite moving: %.3fms, "
+             "space coloring: %.3fms.\n",
+             nanosecondsToMilliseconds(totalTime),
+             nanosecondsToMilliseconds(physicsTime),
+             nanosecondsToMilliseconds(renderTime));
+      printPerfFrame(&phaseCounters);
+   }
+
+   for(int s = 0; s < batchScenarios; ++s){
+      const batchScenario *result = &batchResults[s];
+      printf("Scenario %d (seed %u): radius %.3f to %.3f px, "
+             "energy %.9g, max energy drift %.3e\n", s, result->seed,
+             result->minRadius, result->maxRadius, result->energy,
+             result->maxEnergyDrift);
+   }
+   printf("Batch summary: %d scenarios, %u frames, average frametime: "
+          "%.3fms, satelite moving: %.3fms, space coloring: %.3fms, "
+          "%.3fns per satelite frame.\n", batchScenarios, options.frames,
+          nanosecondsToMilliseconds(totalFrameTime) / options.frames,
+          nanosecondsToMilliseconds(totalPhysicsTime) / options.frames,
+          nanosecondsToMilliseconds(totalGraphicsTime) / options.frames,
+          (double)totalPhysicsTime / options.frames / count);
+   if(batchStatesFile != NULL){
+      writeBatchStates();
+   }
+
+   perfRecordStats(&phaseCounters, &frameStatistics);
+   writeFrameStats(&frameStatistics, "openmp-batch", omp_get_max_threads(),
+                   &options);
+   freeFrameStats(&frameStatistics);
+   for(int r = 0; r < batchRenderCount; ++r){
+      closeFrameWriter(&batchWriters[r]);
+      free(batchTargets[r]);
+   }
+   free(batchTargets);
+   free(batchWriters);
+   free(batchRendered);
+   free(batchResults);
+   free(batchSatelites);
+   freePhysicsState(&batchPhysics);
+}
+
+// Runs the engines in a tight loop without a window and prints a summary.
+// Used for benchmarking on machines without a display.
+void runHeadless(void){
+   if(batchScenarios > 0){
+      runBatch();
+      return;
+   }
+   initFrameStats(&frameStatistics);
+   previousFrameTimeSinceStart = nowNanoseconds();
+   previousFinishTime = previousFrameTimeSinceStart;
+
+   for(frameNumber = 0; frameNumber < options.frames; ++frameNumber){
+      compute();
+   }
+
+   printf("Headless summary: %u frames, average frametime: %.3fms, "
+          "satelite moving: %.3fms, space coloring: %.3fms, %.2f FPS.\n",
+      options.frames,
+      nanosecondsToMilliseconds(totalFrameTime) / options.frames,
+      nanosecondsToMilliseconds(totalPhysicsTime) / options.frames,
+      nanosecondsToMilliseconds(totalGraphicsTime) / options.frames,
+      options.frames * 1000.0 / nanosecondsToMilliseconds(totalFrameTime));
+
+   perfRecordStats(&phaseCounters, &frameStatistics);
+   writeFrameStats(&frameStatistics, "openmp", omp_get_max_threads(), &options);
+   freeFrameStats(&frameStatistics);
+}
+
+// Options of this backend for printUsage()
+void printBackendUsage(FILE *stream){
+   fprintf(stream,
+      "  --graphics E     graphics engine: brute (default) or tree\n"
+      "  --tree-theta T   Barnes-Hut opening angle of --graphics tree\n"
+      "  --incremental K  shade only changed tiles, full frame every K frames\n"
+      "  --incremental-tolerance T  color error allowed for unchanged tiles\n"
+      "                   (default %g)\n"
+      "  --integrator I   physics integrator: euler (default), yoshida or kepler\n"
+      "  --integrator-steps N  yoshida steps per frame (default 1000)\n"
+      "  --integrator-report   print the error against euler every frame\n"
+      "  --physics-precision P  euler in double (default) or compensated float\n"
+      "  --pixel-format F framebuffer: float (default) or rgba8\n"
+      "  --output PATH    write frames: PATTERN%%05d.ppm, FILE.y4m or raw rgb24\n"
+      "  --output-pipe CMD  pipe frames as Y4M to CMD, e.g. \"ffmpeg -i - out.mp4\"\n"
+      "  --output-buffers N  frames queued for the writer (default %d)\n"
+      "  --output-wait    wait for the writer instead of dropping frames\n"
+      "  --nbody M        satelite gravity: off (default), direct, tree or auto\n"
+      "  --nbody-steps N  N-body substeps per frame (default %d)\n"
+      "  --nbody-mass M   satelite mass relative to the black hole (default %g)\n"
+      "  --nbody-softening E  softening length in pixels (default %g)\n"
+      "  --nbody-theta T  Barnes-Hut opening angle of --nbody tree (default %g)\n"
+      "  --batch S        simulate S scenarios, seeds seed to seed + S - 1, headless\n"
+      "  --batch-render L shade the scenarios in the comma separated list L\n"
+      "  --batch-frames P PPM prefix of rendered scenarios (default scenario-)\n"
+      "  --batch-states F write the final satelite states as CSV, - = stdout\n",
+      DIRTY_TILES_DEFAULT_TOLERANCE, FRAME_WRITER_DEFAULT_SLOTS,
+      NBODY_DEFAULT_STEPS, NBODY_DEFAULT_MASS,
+      NBODY_DEFAULT_SOFTENING, NBODY_DEFAULT_THETA);
+}
+
+// Parses the command line into options and the seed
+void parseArguments(int argc, char** argv){
+   initOptions(&options);
+   options.backendUsage = printBackendUsage;
+
+   for(int i = 1; i < argc; ++i){
+      if(parseCommonOption(&options, argc, argv, &i)){
+         continue;
+      }
+      if(strcmp(argv[i], "--graphics") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "brute") == 0){
+            graphicsMode = GRAPHICS_BRUTE_FORCE;
+         } else if(strcmp(argv[i], "tree") == 0){
+            graphicsMode = GRAPHICS_TREE;
+         } else {
+            fprintf(stderr, "Unknown graphics engine: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--integrator") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "euler") == 0){
+            integratorMode = INTEGRATOR_EULER;
+         } else if(strcmp(argv[i], "yoshida") == 0){
+            integratorMode = INTEGRATOR_YOSHIDA;
+         } else if(strcmp(argv[i], "kepler") == 0){
+            integratorMode = INTEGRATOR_KEPLER;
+         } else {
+            fprintf(stderr, "Unknown integrator: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--integrator-steps") == 0){
+         integratorSteps = parseSizeValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--integrator-report") == 0){
+         integratorReport = 1;
+         continue;
+      }
+      if(strcmp(argv[i], "--physics-precision") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "double") == 0){
+            physicsPrecision = PHYSICS_DOUBLE;
+         } else if(strcmp(argv[i], "float") == 0){
+            physicsPrecision = PHYSICS_FLOAT;
+         } else {
+            fprintf(stderr, "Unknown physics precision: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--pixel-format") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "float") == 0){
+            pixelFormat = PIXEL_FORMAT_FLOAT;
+         } else if(strcmp(argv[i], "rgba8") == 0){
+            pixelFormat = PIXEL_FORMAT_RGBA8;
+         } else {
+            fprintf(stderr, "Unknown pixel format: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--output") == 0 ||
+         strcmp(argv[i], "--output-pipe") == 0){
+         frameOutputCommand = strcmp(argv[i], "--output-pipe") == 0;
+         frameOutputTarget = parsePathValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--output-buffers") == 0){
+         frameOutputSlots = parseSizeValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--output-wait") == 0){
+         frameOutputWait = 1;
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody") == 0){
+         requireValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         if(strcmp(argv[i], "off") == 0){
+            nbodyMode = NBODY_OFF;
+         } else if(strcmp(argv[i], "direct") == 0){
+            nbodyMode = NBODY_DIRECT;
+         } else if(strcmp(argv[i], "tree") == 0){
+            nbodyMode = NBODY_TREE;
+         } else if(strcmp(argv[i], "auto") == 0){
+            nbodyMode = NBODY_AUTO;
+         } else {
+            fprintf(stderr, "Unknown N-body mode: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+         }
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody-steps") == 0){
+         nbodySteps = parseSizeValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody-mass") == 0){
+         nbodyMass = parseDoubleValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody-softening") == 0){
+         nbodySoftening = parseDoubleValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--nbody-theta") == 0){
+         nbodyTheta = parseDoubleValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--incremental") == 0){
+         incrementalInterval = parseSizeValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--incremental-tolerance") == 0){
+         incrementalTolerance = parseDoubleValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--batch") == 0){
+         batchScenarios = parseSizeValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--batch-render") == 0){
+         batchRenderList = parsePathValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--batch-frames") == 0){
+         batchFramePrefix = parsePathValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--batch-states") == 0){
+         batchStatesFile = parsePathValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      if(strcmp(argv[i], "--tree-theta") == 0){
+         treeTheta = parseDoubleValue(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      printUsage(stderr, &options, argv[0]);
+      exit(EXIT_FAILURE);
+   }
+   if(physicsPrecision == PHYSICS_FLOAT &&
+      (integratorMode != INTEGRATOR_EULER || nbodyMode != NBODY_OFF)){
+      fprintf(stderr, "--physics-precision float applies to the euler "
+                      "integrator without --nbody\n");
+      exit(EXIT_FAILURE);
+   }
+   if(nbodyMode != NBODY_OFF && nbodySoftening <= 0.0){
+      fprintf(stderr, "--nbody-softening must be positive\n");
+      exit(EXIT_FAILURE);
+   }
+   if(nbodyMode != NBODY_OFF &&
+      (integratorMode != INTEGRATOR_EULER || integratorReport)){
+      fprintf(stderr, "--nbody has its own integrator, it cannot be combined "
+                      "with --integrator or --integrator-report\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(batchScenarios > 0 && (nbodyMode != NBODY_OFF || integratorReport ||
+      incrementalInterval > 0 || frameOutputTarget != NULL)){
+      fprintf(stderr, "--batch cannot be combined with --nbody, "
+                      "--integrator-report, --incremental or --output\n");
+      exit(EXIT_FAILURE);
+   }
+   if(batchScenarios == 0 && (batchRenderList != NULL ||
+      batchStatesFile != NULL)){
+      fprintf(stderr, "--batch-render and --batch-states need --batch\n");
+      exit(EXIT_FAILURE);
+   }
+   if((long long)batchScenarios * options.sateliteCount > 1000000000){
+      fprintf(stderr, "--batch: too many satelites in total\n");
+      exit(EXIT_FAILURE);
+   }
+
+#ifdef PARALLEL_HEADLESS
+   // There is no window to run in
+   options.headless = 1;
+#endif
+   // Batch mode has no window
+   if(batchScenarios > 0){
+      options.headless = 1;
+   }
+   if(options.headless && options.frames == 0){
+      fprintf(stderr, "--frames must be at least 1\n");
+      exit(EXIT_FAILURE);
+   }
+   seed = options.seed;
+}
 
 // DO NOT EDIT THIS FUNCTION
 // Inits glut and start mainloop
 int main(int argc, char** argv){
 
-   if(argc > 1){
-     seed = atoi(argv[1]);
+   parseArguments(argc, argv);
+   if(seed != 0){
      printf("Using seed: %i\n", seed);
    }
 
+   if(options.headless){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      init();
+      runHeadless();
+      return 0;
+   }
+
+#ifndef PARALLEL_HEADLESS
    // Init glut window
    glutInit(&argc, argv);
    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
@@ -568,8 +1744,8 @@ int main(int argc, char** argv){
    glutCreateWindow("Parallelization excercise");
    glutDisplayFunc(render);
    atexit(fixedDestroy);
-   previousFrameTimeSinceStart = glutGet(GLUT_ELAPSED_TIME);
-   previousFinishTime = glutGet(GLUT_ELAPSED_TIME);
+   previousFrameTimeSinceStart = nowNanoseconds();
+   previousFinishTime = previousFrameTimeSinceStart;
    glEnable(GL_DEPTH_TEST);
    glClearColor(0.0, 0.0, 0.0, 1.0);
    fixedInit(seed);
@@ -580,4 +1756,6 @@ int main(int argc, char** argv){
 
    // Start main loop
    glutMainLoop();
+#endif
+   return 0;
 }
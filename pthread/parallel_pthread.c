@@ -23,6 +23,10 @@ VERSION 20.0 - relax physic correctness check
 // most optimization: gcc -o parallel_p parallel_pthread.c -std=c99 -framework GLUT -framework OpenGL -O3
 
 
+// clock_gettime is POSIX, not part of -std=c99
+#define _POSIX_C_SOURCE 200809L
+// sched_setaffinity for thread pinning (common/topology.h)
+#define _GNU_SOURCE
 
 #ifdef _WIN32
 #include <windows.h>
@@ -32,7 +36,19 @@ VERSION 20.0 - relax physic correctness check
 #include <stdlib.h>
 #include <string.h>
 
-// Window handling includes
+#include "../common/options.h" // Command line options
+#include "../common/timing.h" // nowNanoseconds
+#include "../common/frame_stats.h" // Benchmark statistics
+#include "../common/physics_simd.h" // SoA physics kernels
+#include "../common/shader_simd.h" // Vectorized pixel shaders
+#include "../common/tile_scheduler.h" // Work-stealing tiles
+#include "../common/topology.h" // Thread pinning and first touch
+#include "../common/trace.h" // Per-thread hot path tracing
+#include "../common/perf_counters.h" // Hardware counters per phase
+
+// Window handling includes, left out of headless-only builds
+// (-DPARALLEL_HEADLESS) so they build without OpenGL and GLUT
+#ifndef PARALLEL_HEADLESS
 #ifndef __APPLE__
 #include <GL/gl.h>
 #include <GL/glut.h>
@@ -40,35 +56,51 @@ VERSION 20.0 - relax physic correctness check
 #include <OpenGL/gl.h>
 #include <GLUT/glut.h>
 #endif
+#endif
 #include <pthread.h>
 
 
-// These are used to decide the window size
-#define WINDOW_HEIGHT 1024
-#define WINDOW_WIDTH  1024
+// These are used to decide the window size. Runtime options (--width and
+// --height, see common/options.h), 1024x1024 by default.
+#define WINDOW_HEIGHT (options.windowHeight)
+#define WINDOW_WIDTH  (options.windowWidth)
 
-// The number of satelites can be changed to see how it affects performance.
-// Benchmarks must be run with the original number of satellites
-#define SATELITE_COUNT 64
+// The number of satelites can be changed to see how it affects performance
+// (--satellites). Benchmarks must be run with the original number of satellites
+#define SATELITE_COUNT (options.sateliteCount)
 
 // These are used to control the satelite movement
 #define SATELITE_RADIUS 3.16f
 #define MAX_VELOCITY 0.1f
 #define GRAVITY 1.0f
 #define DELTATIME 32
-#define PHYSICSUPDATESPERFRAME 100000
+#define PHYSICSUPDATESPERFRAME (options.physicsUpdatesPerFrame)
 
 // Some helpers to window size variables
-#define SIZE WINDOW_HEIGHT*WINDOW_HEIGHT
+#define SIZE (WINDOW_WIDTH*WINDOW_HEIGHT)
 #define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
 #define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
 
 // Is used to find out frame times
-int previousFrameTimeSinceStart = 0;
-int previousFinishTime = 0;
+long long previousFrameTimeSinceStart = 0;
+long long previousFinishTime = 0;
 unsigned int frameNumber = 0;
 unsigned int seed = 0;
 
+// Command line options (see common/options.h)
+simulationOptions options;
+
+// Hands out the tiles of a frame to the pool threads
+tileScheduler tiles;
+
+// Accumulated frame timings for the headless summary, in nanoseconds
+// Per frame timings for --stats-json and --stats-csv
+frameStats frameStatistics;
+
+long long totalFrameTime = 0;
+long long totalPhysicsTime = 0;
+long long totalGraphicsTime = 0;
+
 // Stores 2D data like the coordinates
 typedef struct{
    float x;
@@ -114,91 +146,275 @@ satelite* backupSatelites;
 
 // ## You may add your own variables here ##
 
-#define NUM_THREADS 12
+// Number of threads in the pool, one per online CPU unless --threads
+// says otherwise (set in init())
+int threadCount = 0;
+#define NUM_THREADS (threadCount)
+
+int *ints;
+pthread_t *thread_id;
+
+// Online CPUs, cores and NUMA nodes for thread placement
+cpuTopology topology;
+
+// Hardware counters of the engine phases (--perf-counters)
+perfCounters phaseCounters;
+
+// Structure-of-arrays double precision copy of the satelites for physics
+physicsState physics;
+
+// Widest physics kernel supported by this CPU
+physicsKernel physicsKernelSelected;
+
+// Structure-of-arrays copy of the satelites for the pixel shader
+renderSatelites renderSnapshot;
+
+// Widest pixel shader supported by this CPU
+pixelShader pixelShaderSelected;
+
+// Pipelined frames (--pipeline): while the pool renders frame N, the last
+// physicsThreads threads already step physics for frame N+1 into the
+// physics state, which acts as the second satelite buffer. The next
+// parallelPhysicsEngine() then only copies the result back. Physics
+// threads that finish early steal tiles from the renderers.
+//
+// compute() times that physics as space coloring. It is measured on its own
+// as pipelined physics: from the start of the frame's pool job to the last
+// physics thread done.
+int pipelineMode = 0;
+int physicsThreads = 0;         // 0 = one thread per physics vector
+int physicsReady = 0;           // physics holds the next frame
+long long pipelineStart = 0;    // When the pool got the frame
+long long *physicsFinished;     // Per physics thread, when it was done
+long long totalPipelinedPhysicsTime = 0;
+
+// Work executed by every thread of the pool, gets the thread id as argument
+typedef void (*poolJob)(int thrd_id);
+
+// Persistent worker pool. Thread 0 is the calling thread, threads
+// 1..NUM_THREADS-1 are created once in init() and sleep between jobs.
+// A job is published by bumping poolGeneration; workers wake up when the
+// generation changes and the last one to finish signals poolDone.
+pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+unsigned long poolGeneration = 0;
+int poolPending = 0;
+int poolShutdown = 0;
+poolJob poolCurrentJob = NULL;
+
+void *poolWorker(void *thrd_id){
 
-unsigned int ints[NUM_THREADS];
-pthread_t thread_id[NUM_THREADS];
-
-   
-// ## You may add your own initialization routines here ##
-void init(){
+   int curr_thread_id = *((int *)thrd_id);
+   unsigned long seenGeneration = 0;
 
-   // Initialize intergers for thread id, unrolled by 4.
-	for (int i = 0;i < (int)(NUM_THREADS/4);++i){
-	   ints[i]=i;
-      ints[i+(int)(NUM_THREADS/4)]=i+(int)(NUM_THREADS/4);
-      ints[i+(int)(2*NUM_THREADS/4)]=i+(int)(2*NUM_THREADS/4);  
-      ints[i+(int)(3*NUM_THREADS/4)]=i+(int)(3*NUM_THREADS/4); 
+   if (options.pinThreads) {
+      pinWorker(&topology, curr_thread_id);
    }
 
+   for(;;){
+      // Sleep until a new job is published
+      pthread_mutex_lock(&poolMutex);
+      while(poolGeneration == seenGeneration && !poolShutdown){
+         pthread_cond_wait(&poolWake, &poolMutex);
+      }
+      if(poolShutdown){
+         pthread_mutex_unlock(&poolMutex);
+         break;
+      }
+      seenGeneration = poolGeneration;
+      poolJob job = poolCurrentJob;
+      pthread_mutex_unlock(&poolMutex);
+
+      job(curr_thread_id);
+
+      // Last worker to finish wakes up the calling thread
+      pthread_mutex_lock(&poolMutex);
+      if(--poolPending == 0){
+         pthread_cond_signal(&poolDone);
+      }
+      pthread_mutex_unlock(&poolMutex);
+   }
+   return NULL;
 }
 
-void *threadedParallelPhysicsEngine(void *thrd_id){
+// Runs job on all NUM_THREADS threads and returns when every thread is done
+void runOnPool(poolJob job){
 
-   int curr_thread_id = *((int *)thrd_id);
+   pthread_mutex_lock(&poolMutex);
+   poolCurrentJob = job;
+   poolPending = NUM_THREADS - 1;
+   ++poolGeneration;
+   pthread_cond_broadcast(&poolWake);
+   pthread_mutex_unlock(&poolMutex);
 
-   // Starting and ending index of satelites for each thread.
-   int start_index = (int)((curr_thread_id*SATELITE_COUNT)/NUM_THREADS);
-   int end_index = (int)fminf((curr_thread_id+1)*SATELITE_COUNT/NUM_THREADS,SATELITE_COUNT);
+   // The calling thread takes the share of thread 0
+   job(0);
 
-   // double precision required for accumulation inside this routine,
-   // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELITE_COUNT];
-   doublevector tmpVelocity[SATELITE_COUNT];
-   for(int i = start_index; i < end_index; ++i){       
-	   tmpPosition[i].x = satelites[i].position.x;
-	   tmpPosition[i].y = satelites[i].position.y ;
-	   tmpVelocity[i].x = satelites[i].velocity.x;
-	   tmpVelocity[i].y = satelites[i].velocity.y;
+   // Time thread 0 waits for the slowest worker
+   TRACE_BEGIN(waitStart);
+   pthread_mutex_lock(&poolMutex);
+   while(poolPending > 0){
+      pthread_cond_wait(&poolDone, &poolMutex);
    }
+   pthread_mutex_unlock(&poolMutex);
+   TRACE_END(0, "pool wait", (int)frameNumber, waitStart);
+}
 
-   // Physics iteration loop
-   for(int physicsUpdateIndex = 0; 
-          physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
-         ++physicsUpdateIndex){     
+
+// Writes the home band of tiles of the thread once, so its pixel pages
+// are placed on the thread's NUMA node
+void firstTouchPixels(int curr_thread_id){
+   firstTouchRows(&tiles, curr_thread_id, pixels,
+                  sizeof(color) * WINDOW_WIDTH, WINDOW_HEIGHT);
+}
+
+// Opens the hardware counters of the thread
+void openPhaseCounters(int curr_thread_id){
+   perfOpenThread(&phaseCounters, curr_thread_id);
+}
    
-      // Physics satelite loop
-      for(int i = start_index; i < end_index; ++i){         
+// ## You may add your own initialization routines here ##
+void init(){
 
-         // Distance to the blackhole (bit ugly code because C-struct cannot have member functions)
-         doublevector positionToBlackHole = {.x = tmpPosition[i].x - HORIZONTAL_CENTER,
-										 .y = tmpPosition[i].y - VERTICAL_CENTER};
-         double distToBlackHoleSquared =
-           positionToBlackHole.x * positionToBlackHole.x +
-           positionToBlackHole.y * positionToBlackHole.y;
-         double distToBlackHole = sqrt(distToBlackHoleSquared);
+   discoverTopology(&topology);
+   threadCount = options.threads > 0 ? options.threads : topology.cpuCount;
+   ints = (int*)malloc(sizeof(int) * NUM_THREADS);
+   thread_id = (pthread_t*)malloc(sizeof(pthread_t) * NUM_THREADS);
+   if (ints == NULL || thread_id == NULL) {
+      fprintf(stderr, "Failed to allocate the thread pool\n");
+      exit(EXIT_FAILURE);
+   }
 
-         // Gravity force
-         doublevector normalizedDirection = {
-            .x = positionToBlackHole.x / distToBlackHole,
-		      .y = positionToBlackHole.y / distToBlackHole};
-         double accumulation = GRAVITY / distToBlackHoleSquared;
+   // Initialize intergers for thread id
+   for (int i = 0; i < NUM_THREADS; ++i) {
+      ints[i] = i;
+   }
 
-         // Delta time is used to make velocity same despite different FPS
-         // Update velocity based on force
-         tmpVelocity[i].x -= accumulation * normalizedDirection.x *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
-         tmpVelocity[i].y -= accumulation * normalizedDirection.y * 
-            DELTATIME / PHYSICSUPDATESPERFRAME;
+   // The calling thread is thread 0 of the pool
+   if (options.pinThreads) {
+      pinWorker(&topology, 0);
+   }
+   printTopology(&topology, NUM_THREADS, options.pinThreads);
+   traceStart(options.traceFile, NUM_THREADS);
 
-         // Update position based on velocity
-         tmpPosition[i].x +=
-            tmpVelocity[i].x * DELTATIME / PHYSICSUPDATESPERFRAME;
-         tmpPosition[i].y +=
-           tmpVelocity[i].y * DELTATIME / PHYSICSUPDATESPERFRAME;
+   initPhysicsState(&physics, SATELITE_COUNT);
+   physicsKernelSelected = selectPhysicsKernel();
+   printf("Physics kernel: %s\n", physicsKernelSelected.name);
+
+   initRenderSatelites(&renderSnapshot, SATELITE_COUNT);
+   pixelShaderSelected = selectPixelShader();
+   printf("Pixel shader: %s\n", pixelShaderSelected.name);
+
+   // Pipelining needs a thread for physics besides the calling one
+   if (pipelineMode && NUM_THREADS < 2) {
+      printf("Pipelined frames need at least 2 threads, disabled\n");
+      pipelineMode = 0;
+   }
+   if (pipelineMode) {
+      // By default every physics vector gets its own thread, but at least
+      // one thread (the calling one) is left for rendering
+      if (physicsThreads == 0) {
+         int width = physicsKernelSelected.width;
+         physicsThreads = (SATELITE_COUNT + width - 1) / width;
+      }
+      if (physicsThreads > NUM_THREADS - 1) {
+         physicsThreads = NUM_THREADS - 1;
+      }
+      physicsFinished = (long long*)malloc(sizeof(long long) *
+                                           physicsThreads);
+      if (physicsFinished == NULL) {
+         fprintf(stderr, "Failed to allocate the pipeline timings\n");
+         exit(EXIT_FAILURE);
+      }
+      printf("Pipelined frames, %d physics threads\n", physicsThreads);
+   }
+
+   initTileScheduler(&tiles, NUM_THREADS, options.tileSize,
+                     WINDOW_WIDTH, WINDOW_HEIGHT);
+
+   // Start the worker pool, thread 0 is the main thread itself
+   for (int i = 1;i < NUM_THREADS; ++i) {
+      if (pthread_create(&thread_id[i], NULL, poolWorker, &ints[i]) != 0) {
+         fprintf(stderr, "Failed to create worker thread %d\n", i);
+         exit(EXIT_FAILURE);
       }
    }
 
+   // Place the pixel pages on the node of the thread that renders them
+   runOnPool(firstTouchPixels);
+
+   initPerfCounters(&phaseCounters, options.perfCounters, NUM_THREADS,
+                    SATELITE_COUNT, PHYSICSUPDATESPERFRAME, SIZE);
+   if (options.perfCounters) {
+      runOnPool(openPhaseCounters);
+      printPerfCounterStatus(&phaseCounters);
+   }
+
+}
+
+// Copies the satelites [start_index, end_index) into the physics state
+void gatherPhysics(int start_index, int end_index){
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   // copy back the float storage.   
-   for(int i = start_index; i < end_index; ++i){   
-      satelites[i].position.x = tmpPosition[i].x;
-      satelites[i].position.y = tmpPosition[i].y;
-      satelites[i].velocity.x = tmpVelocity[i].x;
-      satelites[i].velocity.y = tmpVelocity[i].y;
+   for(int i = start_index; i < end_index; ++i){
+      physics.x[i] = satelites[i].position.x;
+      physics.y[i] = satelites[i].position.y;
+      physics.vx[i] = satelites[i].velocity.x;
+      physics.vy[i] = satelites[i].velocity.y;
    }
-   pthread_exit(NULL);
+}
+
+// Copies the physics state [start_index, end_index) back to the satelites
+void scatterPhysics(int start_index, int end_index){
+   for(int i = start_index; i < end_index; ++i){
+      satelites[i].position.x = physics.x[i];
+      satelites[i].position.y = physics.y[i];
+      satelites[i].velocity.x = physics.vx[i];
+      satelites[i].velocity.y = physics.vy[i];
+   }
+}
+
+// Steps share number share of shares through one frame of physics. The
+// result stays in the physics state.
+void stepPhysicsShare(int share, int shares, int *start, int *end){
+
+   const physicsParameters parameters = {
+      .centerX = HORIZONTAL_CENTER, .centerY = VERTICAL_CENTER,
+      .gravity = GRAVITY, .deltaTime = DELTATIME,
+      .updatesPerFrame = PHYSICSUPDATESPERFRAME,
+      .updates = PHYSICSUPDATESPERFRAME};
+
+   // Satelites are handed out in whole vectors so that no thread
+   // has to fall back to the scalar kernel in the middle of the array.
+   const int width = physicsKernelSelected.width;
+   const int vectorCount = (SATELITE_COUNT + width - 1) / width;
+
+   // Starting and ending index of satelites for this share.
+   int start_index = (share * vectorCount / shares) * width;
+   int end_index = ((share + 1) * vectorCount / shares) * width;
+   if (end_index > SATELITE_COUNT) {
+      end_index = SATELITE_COUNT;
+   }
+   *start = start_index;
+   *end = end_index;
+   if (start_index >= end_index) {
+      return;
+   }
+
+   gatherPhysics(start_index, end_index);
+
+   // Physics satelite and iteration loops
+   physicsKernelSelected.step(&physics, start_index, end_index, &parameters);
+}
+
+void threadedParallelPhysicsEngine(int curr_thread_id){
+
+   int start_index, end_index;
+   TRACE_BEGIN(chunkStart);
+   stepPhysicsShare(curr_thread_id, NUM_THREADS, &start_index, &end_index);
+   scatterPhysics(start_index, end_index);
+   TRACE_END(curr_thread_id, "physics chunk", curr_thread_id, chunkStart);
 
 }
 
@@ -210,108 +426,62 @@ void *threadedParallelPhysicsEngine(void *thrd_id){
 // is not accurate enough to be done only once
 void parallelPhysicsEngine(){
 
-   // Create NUM_THREADS threads to do PhysicsEngine work
-   for (int i = 0;i < NUM_THREADS; ++i) {
-      pthread_create(&thread_id[i], NULL, threadedParallelPhysicsEngine, &ints[i]);
-   }
-   // Join and detach threads
-   for (int i = 0;i < NUM_THREADS; ++i) {
-      pthread_join(thread_id[i],NULL);
-	   pthread_detach(thread_id[i]);
-   }   
-
-}
-
-
-void *threadedParallelGraphicsEngine(void *thrd_id){
+   perfPhaseBegin(&phaseCounters);
 
-   int curr_thread_id = *((int *)thrd_id);
-
-   // Starting and ending index of pixels for each thread.
-   int start_index = curr_thread_id*SIZE/NUM_THREADS;
-   int end_index = (int)fminf((curr_thread_id+1)*SIZE/NUM_THREADS,SIZE);
+   // Already stepped during the previous frame's rendering, the counters
+   // of the pipelined physics go to the graphics phase
+   if (physicsReady) {
+      scatterPhysics(0, SATELITE_COUNT);
+      physicsReady = 0;
+      perfPhaseEnd(&phaseCounters, PERF_PHASE_PHYSICS);
+      return;
+   }
 
-   // Graphics pixel loop
-   for (int i = start_index ;i < end_index; ++i) {
+   // Hand the PhysicsEngine work to the worker pool
+   TRACE_BEGIN(physicsStart);
+   runOnPool(threadedParallelPhysicsEngine);
+   TRACE_END(0, "physics", (int)frameNumber, physicsStart);
+   perfPhaseEnd(&phaseCounters, PERF_PHASE_PHYSICS);
 
-      // Row wise ordering
-      floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
+}
 
-      // This color is used for coloring the pixel
-      color renderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
-	   color tmpRenderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
-      // Find closest satelite
-      float shortestDistance2 = INFINITY;
-      float dist2s[SATELITE_COUNT]; // Store distances to satellites
 
-      float weights = 0.f;
-      int hitsSatellite = 0;
+void threadedParallelGraphicsEngine(int curr_thread_id){
 
-      // Temporary rgb variables for increment
-      float red = 0.0f;
-      float green = 0.0f;
-      float blue = 0.0f;
-      
-      // Distance-to-satellite loop, unrolled by 4
-      for (int k = 0; k < SATELITE_COUNT; k+=4) {
-         floatvector difference0 = {.x = pixel.x - satelites[k].position.x,
-                                    .y = pixel.y - satelites[k].position.y};
-         floatvector difference1 = {.x = pixel.x - satelites[k+1].position.x,
-                                    .y = pixel.y - satelites[k+1].position.y};
-         floatvector difference2 = {.x = pixel.x - satelites[k+2].position.x,
-                                    .y = pixel.y - satelites[k+2].position.y};
-         floatvector difference3 = {.x = pixel.x - satelites[k+3].position.x,
-                                    .y = pixel.y - satelites[k+3].position.y};
-
-         dist2s[k]   = (difference0.x * difference0.x + 
-                        difference0.y * difference0.y);
-         dist2s[k+1] = (difference1.x * difference1.x + 
-                        difference1.y * difference1.y);
-         dist2s[k+2] = (difference2.x * difference2.x + 
-                        difference2.y * difference2.y);             
-         dist2s[k+3] = (difference3.x * difference3.x + 
-                        difference3.y * difference3.y);
+   // Take tiles until the frame is done, stealing from the other threads
+   // once the own share runs out
+   int tile;
+   while ((tile = nextTile(&tiles, curr_thread_id)) >= 0) {
+      TRACE_BEGIN(tileStart);
+      int x0, y0, x1, y1;
+      tileBounds(&tiles, tile, WINDOW_WIDTH, WINDOW_HEIGHT,
+                 &x0, &y0, &x1, &y1);
 
+      for (int row = y0; row < y1; ++row) {
+         pixelShaderSelected.shade(&renderSnapshot, SATELITE_RADIUS,
+                                   row, x0, x1,
+                                   &pixels[row*WINDOW_WIDTH + x0].red);
       }
+      TRACE_END(curr_thread_id, "tile", tile, tileStart);
+   }
+}
 
-	  
-      // First Graphics satelite loop: Find the closest satellite.
-      for (int j = 0; j < SATELITE_COUNT; ++j){
-         float dist2 = (dist2s[j]);
-         if (dist2 < SATELITE_RADIUS*SATELITE_RADIUS) {
-            renderColor.red = 1.0f;
-            renderColor.green = 1.0f;
-            renderColor.blue = 1.0f;
-            hitsSatellite = 1;
-            break;
-         } else {
-            float weight = 1.0f / (dist2*dist2);
-            weights += weight;
-            if(dist2 < shortestDistance2){
-               shortestDistance2 = dist2;
-               renderColor = satelites[j].identifier;
-            }
-            // Increase color through temporary variables
-			   red += (satelites[j].identifier.red)*weight;
-	 
-            green += (satelites[j].identifier.green)*weight;
-	 
-            blue += (satelites[j].identifier.blue)*weight;
-         }
-      }
 
-      // Second graphics loop: Calculate the color based on distance to every satelite.
-		if (!hitsSatellite) {
-       
-         renderColor.red   += red/weights * 3.0f;                               
-	                              
-         renderColor.green += green/weights * 3.0f;
-                              	 
-         renderColor.blue  += blue/weights * 3.0f;
-            
-		}
-      pixels[i] = renderColor;
+// Renders the current frame and, on the last physicsThreads threads, steps
+// the physics of the next frame
+void threadedPipelinedFrameEngine(int curr_thread_id){
+
+   int firstPhysicsThread = NUM_THREADS - physicsThreads;
+   if (curr_thread_id >= firstPhysicsThread) {
+      int start_index, end_index;
+      TRACE_BEGIN(chunkStart);
+      stepPhysicsShare(curr_thread_id - firstPhysicsThread, physicsThreads,
+                       &start_index, &end_index);
+      physicsFinished[curr_thread_id - firstPhysicsThread] = nowNanoseconds();
+      TRACE_END(curr_thread_id, "physics chunk",
+                curr_thread_id - firstPhysicsThread, chunkStart);
    }
+   threadedParallelGraphicsEngine(curr_thread_id);
 }
 
 
@@ -320,15 +490,40 @@ void *threadedParallelGraphicsEngine(void *thrd_id){
 // Decides the color for each pixel.
 void parallelGraphicsEngine(){
 
-   // Create NUM_THREADS threads to do GraphicsEngine work
-   for (int i = 0;i < NUM_THREADS; ++i) {
-      pthread_create(&thread_id[i], NULL, threadedParallelGraphicsEngine, &ints[i]);
+   perfPhaseBegin(&phaseCounters);
+
+   // Structure-of-arrays copy of the satelites for the shader
+   for (int j = 0; j < SATELITE_COUNT; ++j) {
+      renderSnapshot.x[j] = satelites[j].position.x;
+      renderSnapshot.y[j] = satelites[j].position.y;
+      renderSnapshot.red[j] = satelites[j].identifier.red;
+      renderSnapshot.green[j] = satelites[j].identifier.green;
+      renderSnapshot.blue[j] = satelites[j].identifier.blue;
+   }
+
+   // Hand the GraphicsEngine work to the worker pool
+   TRACE_BEGIN(graphicsStart);
+   resetTileScheduler(&tiles);
+   if (pipelineMode) {
+      pipelineStart = nowNanoseconds();
+      runOnPool(threadedPipelinedFrameEngine);
+      physicsReady = 1;
+
+      long long physicsTime = 0;
+      for (int i = 0; i < physicsThreads; ++i) {
+         if (physicsFinished[i] - pipelineStart > physicsTime) {
+            physicsTime = physicsFinished[i] - pipelineStart;
+         }
+      }
+      totalPipelinedPhysicsTime += physicsTime;
+      if (frameNumber >= STATS_SKIPPED_FRAMES) {
+         recordPipelinedPhysics(&frameStatistics, physicsTime);
+      }
+   } else {
+      runOnPool(threadedParallelGraphicsEngine);
    }
-   // Join and detach threads
-   for (int i = 0;i < NUM_THREADS; ++i) {
-      pthread_join(thread_id[i],NULL);
-	   pthread_detach(thread_id[i]);
-   }      
+   TRACE_END(0, "graphics", (int)frameNumber, graphicsStart);
+   perfPhaseEnd(&phaseCounters, PERF_PHASE_GRAPHICS);
 
 }
 
@@ -336,6 +531,26 @@ void parallelGraphicsEngine(){
 // ## You may add your own destrcution routines here ##
 void destroy(){
 
+   // Wake up the workers one last time and let them exit
+   pthread_mutex_lock(&poolMutex);
+   poolShutdown = 1;
+   pthread_cond_broadcast(&poolWake);
+   pthread_mutex_unlock(&poolMutex);
+
+   for (int i = 1;i < NUM_THREADS; ++i) {
+      pthread_join(thread_id[i], NULL);
+   }
+
+   freePhysicsState(&physics);
+   freeRenderSatelites(&renderSnapshot);
+   freeTileScheduler(&tiles);
+   freeTopology(&topology);
+   free(physicsFinished);
+   traceFinish();
+   printPerfSummary(&phaseCounters);
+   freePerfCounters(&phaseCounters);
+   free(ints);
+   free(thread_id);
 
 }
 
@@ -418,8 +633,10 @@ void sequentialPhysicsEngine(satelite *s){
 
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELITE_COUNT];
-   doublevector tmpVelocity[SATELITE_COUNT];
+   doublevector *tmpPosition =
+      (doublevector*)malloc(sizeof(doublevector) * SATELITE_COUNT);
+   doublevector *tmpVelocity =
+      (doublevector*)malloc(sizeof(doublevector) * SATELITE_COUNT);
 
    for (int i = 0; i < SATELITE_COUNT; ++i) {
        tmpPosition[i].x = s[i].position.x;
@@ -475,6 +692,9 @@ void sequentialPhysicsEngine(satelite *s){
        s[i].velocity.x = tmpVelocity[i].x;
        s[i].velocity.y = tmpVelocity[i].y;
    }
+
+   free(tmpPosition);
+   free(tmpVelocity);
 }
 
 // Just some value that barely passes for OpenCL example program
@@ -495,7 +715,7 @@ void errorCheck(){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 void compute(void){
-   int timeSinceStart = glutGet(GLUT_ELAPSED_TIME);
+   long long timeSinceStart = nowNanoseconds();
    previousFrameTimeSinceStart = timeSinceStart;
 
    // Error check during first frames
@@ -513,14 +733,14 @@ void compute(void){
       }
    }
 
-   int sateliteMovementMoment = glutGet(GLUT_ELAPSED_TIME);
-   int sateliteMovementTime = sateliteMovementMoment  - timeSinceStart;
+   long long sateliteMovementMoment = nowNanoseconds();
+   long long sateliteMovementTime = sateliteMovementMoment  - timeSinceStart;
 
    // Decides the colors for the pixels
    parallelGraphicsEngine();
 
-   int pixelColoringMoment = glutGet(GLUT_ELAPSED_TIME);
-   int pixelColoringTime =  pixelColoringMoment - sateliteMovementMoment;
+   long long pixelColoringMoment = nowNanoseconds();
+   long long pixelColoringTime =  pixelColoringMoment - sateliteMovementMoment;
 
    // Sequential code is used to check possible errors in the parallel version
    if(frameNumber < 2){
@@ -528,16 +748,31 @@ void compute(void){
       errorCheck();
    }
 
-   int finishTime = glutGet(GLUT_ELAPSED_TIME);
+   long long finishTime = nowNanoseconds();
    // Print timings
-   int totalTime = finishTime - previousFinishTime;
+   long long totalTime = finishTime - previousFinishTime;
    previousFinishTime = finishTime;
 
-   printf("Total frametime: %ims, satelite moving: %ims, space coloring: %ims.\n",
-      totalTime, sateliteMovementTime, pixelColoringTime);
+   totalFrameTime += totalTime;
+   totalPhysicsTime += sateliteMovementTime;
+   totalGraphicsTime += pixelColoringTime;
+   if(frameNumber >= STATS_SKIPPED_FRAMES){
+      recordFrame(&frameStatistics, sateliteMovementTime, pixelColoringTime,
+                  totalTime);
+   }
+
+   printf("Total frametime: %.3fms, satelite moving: %.3fms, space coloring: %.3fms.\n",
+      nanosecondsToMilliseconds(totalTime),
+      nanosecondsToMilliseconds(sateliteMovementTime),
+      nanosecondsToMilliseconds(pixelColoringTime));
+   printPerfFrame(&phaseCounters);
 
    // Render the frame
-   glutPostRedisplay();
+#ifndef PARALLEL_HEADLESS
+   if(!options.headless){
+      glutPostRedisplay();
+   }
+#endif
 }
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
@@ -617,22 +852,105 @@ void fixedDestroy(void){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 // Renders pixels-buffer to the window 
+#ifndef PARALLEL_HEADLESS
 void render(void){
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
    glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
    glutSwapBuffers();
    frameNumber++;
 }
+#endif
+
+// Runs the engines in a tight loop without a window and prints a summary.
+// Used for benchmarking on machines without a display.
+void runHeadless(void){
+   initFrameStats(&frameStatistics);
+   previousFrameTimeSinceStart = nowNanoseconds();
+   previousFinishTime = previousFrameTimeSinceStart;
+
+   for(frameNumber = 0; frameNumber < options.frames; ++frameNumber){
+      compute();
+   }
+
+   printf("Headless summary: %u frames, average frametime: %.3fms, "
+          "satelite moving: %.3fms, space coloring: %.3fms, %.2f FPS.\n",
+      options.frames,
+      nanosecondsToMilliseconds(totalFrameTime) / options.frames,
+      nanosecondsToMilliseconds(totalPhysicsTime) / options.frames,
+      nanosecondsToMilliseconds(totalGraphicsTime) / options.frames,
+      options.frames * 1000.0 / nanosecondsToMilliseconds(totalFrameTime));
+   if(pipelineMode){
+      printf("Pipelined physics: %.3fms, part of space coloring (stepped "
+             "for the next frame while rendering).\n",
+         nanosecondsToMilliseconds(totalPipelinedPhysicsTime) /
+         options.frames);
+   }
+
+   perfRecordStats(&phaseCounters, &frameStatistics);
+   writeFrameStats(&frameStatistics, "pthread", NUM_THREADS, &options);
+   freeFrameStats(&frameStatistics);
+}
+
+// Options of this backend for printUsage()
+void printBackendUsage(FILE *stream){
+   fprintf(stream,
+      "  --pipeline       step the next frame's physics while rendering\n"
+      "  --physics-threads N  threads stepping physics in --pipeline\n");
+}
+
+// Parses the command line into options and the seed
+void parseArguments(int argc, char** argv){
+   initOptions(&options);
+   options.backendUsage = printBackendUsage;
+
+   for(int i = 1; i < argc; ++i){
+      if(parseCommonOption(&options, argc, argv, &i)){
+         continue;
+      }
+      if(strcmp(argv[i], "--pipeline") == 0){
+         pipelineMode = 1;
+         continue;
+      }
+      if(strcmp(argv[i], "--physics-threads") == 0){
+         physicsThreads = parseSizeValue(argv[i],
+                                         i + 1 < argc ? argv[i + 1] : NULL);
+         ++i;
+         continue;
+      }
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      printUsage(stderr, &options, argv[0]);
+      exit(EXIT_FAILURE);
+   }
+
+#ifdef PARALLEL_HEADLESS
+   // There is no window to run in
+   options.headless = 1;
+#endif
+   if(options.headless && options.frames == 0){
+      fprintf(stderr, "--frames must be at least 1\n");
+      exit(EXIT_FAILURE);
+   }
+   seed = options.seed;
+}
 
 // DO NOT EDIT THIS FUNCTION
 // Inits glut and start mainloop
 int main(int argc, char** argv){
 
-   if(argc > 1){
-     seed = atoi(argv[1]);
+   parseArguments(argc, argv);
+   if(seed != 0){
      printf("Using seed: %i\n", seed);
    }
 
+   if(options.headless){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      init();
+      runHeadless();
+      return 0;
+   }
+
+#ifndef PARALLEL_HEADLESS
    // Init glut window
    glutInit(&argc, argv);
    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
@@ -640,8 +958,8 @@ int main(int argc, char** argv){
    glutCreateWindow("Parallelization excercise");
    glutDisplayFunc(render);
    atexit(fixedDestroy);
-   previousFrameTimeSinceStart = glutGet(GLUT_ELAPSED_TIME);
-   previousFinishTime = glutGet(GLUT_ELAPSED_TIME);
+   previousFrameTimeSinceStart = nowNanoseconds();
+   previousFinishTime = previousFrameTimeSinceStart;
    glEnable(GL_DEPTH_TEST);
    glClearColor(0.0, 0.0, 0.0, 1.0);
    fixedInit(seed);
@@ -652,4 +970,6 @@ int main(int argc, char** argv){
 
    // Start main loop
    glutMainLoop();
+#endif
+   return 0;
 }
@@ -0,0 +1,121 @@
+#!/bin/sh
+# Runs every backend headless with the same seed and frame count and
+# collects the per-phase frame statistics (min/median/p95/p99/mean in
+# microseconds) into one JSON array and one CSV table.
+#
+#    tools/benchmark.sh [-s seed] [-f frames] [-o outdir] [-b backends]
+#                       [-i isa] [-- backend options]
+#
+# Backends are openmp, pthread and opencl (OpenCL with --cl-device cpu);
+# missing toolchains or devices are reported and skipped. They are built
+# with CMake into outdir/build as the parallel_<backend>_headless targets,
+# or parallel_<backend>_headless_<isa> with -i x86-64, avx2 or avx512.
+# Everything after -- is passed to every backend, e.g. -- --satellites 128
+# --width 512. OMP_NUM_THREADS and the other environment variables are
+# passed through.
+
+set -u
+
+seed=1
+frames=100
+outdir=benchmark-results
+backends="openmp pthread opencl"
+isa=""
+
+while [ $# -gt 0 ]; do
+   case "$1" in
+      -s) seed=$2; shift 2 ;;
+      -f) frames=$2; shift 2 ;;
+      -o) outdir=$2; shift 2 ;;
+      -b) backends=$2; shift 2 ;;
+      -i) isa=$2; shift 2 ;;
+      --) shift; break ;;
+      -h|--help) sed -n '2,15p' "$0"; exit 0 ;;
+      *) echo "Unknown option: $1" >&2; exit 1 ;;
+   esac
+done
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+mkdir -p "$outdir" || exit 1
+outdir=$(cd "$outdir" && pwd)
+builddir="$outdir/build"
+
+if ! cmake -S "$root" -B "$builddir" -DCMAKE_BUILD_TYPE=Release \
+      > "$outdir/cmake.log" 2>&1; then
+   echo "CMake configuration failed, see $outdir/cmake.log" >&2
+   exit 1
+fi
+
+# target <backend>: the CMake target and binary name of the backend
+target() {
+   echo "parallel_$1_headless${isa:+_$isa}"
+}
+
+# build <backend>: builds the backend in $builddir
+build() {
+   case "$1" in
+      openmp|pthread|opencl) ;;
+      *) echo "Unknown backend: $1" >&2; return 1 ;;
+   esac
+   # CMake leaves out the targets of missing toolchains and ISAs
+   cmake --build "$builddir" --target "$(target "$1")" -j \
+      > "$outdir/$1.build.log" 2>&1
+}
+
+# run <backend> [options]: runs the backend headless and writes the stats
+run() {
+   backend=$1
+   shift
+   case "$backend" in
+      # The OpenCL backend loads parallel.cl from the working directory,
+      # where CMake copies it, and tunes its work-group sizes on the first
+      # run on a device
+      opencl) (cd "$builddir" && \
+                  "./$(target opencl)" "$seed" --headless --frames "$frames" \
+                  --cl-device cpu \
+                  --stats-json "$outdir/$backend.json" \
+                  --stats-csv "$outdir/$backend.csv" "$@" < /dev/null) ;;
+      *) "$builddir/$(target "$backend")" "$seed" --headless --frames "$frames" \
+            --stats-json "$outdir/$backend.json" \
+            --stats-csv "$outdir/$backend.csv" "$@" < /dev/null ;;
+   esac
+}
+
+json="$outdir/results.json"
+csv="$outdir/results.csv"
+printf '[' > "$json"
+: > "$csv"
+separator=''
+
+for backend in $backends; do
+   echo "== $backend"
+   rm -f "$outdir/$backend.json" "$outdir/$backend.csv"
+   if ! build "$backend"; then
+      echo "   build failed, skipped, see $outdir/$backend.build.log" >&2
+      continue
+   fi
+   if ! run "$backend" "$@" > "$outdir/$backend.log" 2>&1 ||
+      [ ! -s "$outdir/$backend.json" ]; then
+      echo "   run failed, see $outdir/$backend.log" >&2
+      continue
+   fi
+   if grep -q "Buggy pixel\|Incorrect satelite" "$outdir/$backend.log"; then
+      echo "   error check failed, see $outdir/$backend.log" >&2
+   fi
+
+   printf '%s\n' "$separator" >> "$json"
+   cat "$outdir/$backend.json" >> "$json"
+   separator=','
+   if [ -s "$csv" ]; then
+      tail -n +2 "$outdir/$backend.csv" >> "$csv"
+   else
+      cat "$outdir/$backend.csv" >> "$csv"
+   fi
+   grep 'frame,' "$outdir/$backend.csv" | \
+      awk -F, '{ printf "   frame median %s us, p99 %s us\n", $11, $13 }'
+   # Only with -- --perf-counters
+   grep '^Counters summary' "$outdir/$backend.log" | sed 's/^/   /'
+done
+
+printf ']\n' >> "$json"
+echo "Results in $json and $csv"
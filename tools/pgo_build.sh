@@ -0,0 +1,40 @@
+#!/bin/sh
+# Builds the release configuration: LTO plus profile guided optimization.
+#
+#    tools/pgo_build.sh [builddir] [-- training options]
+#
+# The backends are first built with instrumentation and every headless
+# binary is run once as training (default problem size, PGO_FRAMES frames,
+# 10 by default). The build directory is then reconfigured to use the
+# collected profiles and rebuilt. Requires GCC.
+
+set -eu
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build=build-release
+if [ $# -gt 0 ] && [ "$1" != "--" ]; then
+   build=$1
+   shift
+fi
+if [ $# -gt 0 ] && [ "$1" = "--" ]; then
+   shift
+fi
+frames=${PGO_FRAMES:-10}
+
+cmake -S "$root" -B "$build" -DCMAKE_BUILD_TYPE=Release \
+      -DPARALLEL_LTO=ON -DPARALLEL_PGO=GENERATE
+cmake --build "$build" --target headless -j
+build=$(cd "$build" && pwd)
+rm -rf "$build/pgo-profiles"
+
+# The OpenCL backend reads parallel.cl from the working directory
+for exe in "$build"/parallel_*_headless*; do
+   [ -x "$exe" ] || continue
+   echo "Training $(basename "$exe")"
+   (cd "$build" && "$exe" 1 --frames "$frames" "$@" \
+       < /dev/null > /dev/null) || echo "   training run failed" >&2
+done
+
+cmake -S "$root" -B "$build" -DPARALLEL_PGO=USE
+cmake --build "$build" -j
+echo "Release build in $build"